@@ -0,0 +1,41 @@
+# Generate the kEmbeddedFiles table of src/embedded.hpp from INPUTS (separated
+# by |), every file named by its path relative to BASE_DIR:
+# cmake -DOUTPUT=<cpp> -DBASE_DIR=<dir> -DHEADER=<embedded.hpp> -DINPUTS=<a|b> -P EmbedBitcode.cmake
+string(REPLACE "|" ";" INPUTS "${INPUTS}")
+
+set(arrays "")
+set(entries "")
+set(index 0)
+foreach(input ${INPUTS})
+    file(SIZE "${input}" size)
+    if(size EQUAL 0)
+        continue()
+    endif()
+    file(RELATIVE_PATH name "${BASE_DIR}" "${input}")
+    file(READ "${input}" hex HEX)
+    # 16 bytes per line (CMake regular expressions have no {16})
+    string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," hex "${hex}")
+    string(REPEAT "0x..," 16 line)
+    string(REGEX REPLACE "(${line})" "\\1\n    " hex "${hex}")
+    string(APPEND arrays
+        "// ${name}\n"
+        "alignas(16) static const unsigned char file${index}[] = {\n"
+        "    ${hex}\n"
+        "};\n\n"
+    )
+    string(APPEND entries
+        "    {\"${name}\", reinterpret_cast<const char *>(file${index}), "
+        "sizeof(file${index})},\n"
+    )
+    math(EXPR index "${index} + 1")
+endforeach()
+
+file(WRITE "${OUTPUT}"
+    "// Generated by cmake/EmbedBitcode.cmake - DO NOT EDIT\n"
+    "#include \"${HEADER}\"\n\n"
+    "${arrays}"
+    "extern const EmbeddedFile kEmbeddedFiles[] = {\n"
+    "${entries}"
+    "    {nullptr, nullptr, 0},\n"
+    "};\n"
+)
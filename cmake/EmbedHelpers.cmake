@@ -0,0 +1,30 @@
+# embed_helpers(<target>)
+# Compile the bitcode built by add_helper (the HELPER_BITCODE global property)
+# into target as read-only data and define REMILL_EMBEDDED_HELPERS, see
+# src/embedded.hpp. Does nothing when EMBED_HELPERS is off.
+set(EMBED_BITCODE_SCRIPT "${CMAKE_CURRENT_LIST_DIR}/EmbedBitcode.cmake")
+
+function(embed_helpers target)
+    if(NOT EMBED_HELPERS)
+        return()
+    endif()
+    get_property(bitcode GLOBAL PROPERTY HELPER_BITCODE)
+    # The list is passed as one argument, semicolons would split it
+    list(JOIN bitcode "|" inputs)
+    set(output "${CMAKE_BINARY_DIR}/embedded/${target}.cpp")
+    add_custom_command(
+        OUTPUT "${output}"
+        COMMAND "${CMAKE_COMMAND}"
+            "-DOUTPUT=${output}"
+            "-DBASE_DIR=${CMAKE_BINARY_DIR}"
+            "-DHEADER=${PROJECT_SOURCE_DIR}/src/embedded.hpp"
+            "-DINPUTS=${inputs}"
+            -P "${EMBED_BITCODE_SCRIPT}"
+        DEPENDS ${bitcode} "${EMBED_BITCODE_SCRIPT}"
+        COMMENT "Embedding helpers into ${target}"
+        VERBATIM
+    )
+    add_dependencies(${target} helpers)
+    target_sources(${target} PRIVATE "${output}")
+    target_compile_definitions(${target} PRIVATE REMILL_EMBEDDED_HELPERS=1)
+endfunction()
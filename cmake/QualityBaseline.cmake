@@ -0,0 +1,40 @@
+# add_quality_targets(<target>)
+# quality-check runs target (remill-quality) for every architecture in
+# QUALITY_ARCHS against its checked-in baseline in quality/<arch>.json and
+# fails when a count regressed. quality-baseline records the baselines again,
+# run it on the CI configuration after an intended change of the counts.
+set(QUALITY_ARCHS "amd64;x86;aarch64" CACHE STRING
+    "Architectures with a remill-quality baseline in quality/")
+set(QUALITY_TOLERANCE 0 CACHE STRING
+    "Percentage a count may grow over its baseline in quality-check")
+
+function(add_quality_targets target)
+    set(check)
+    set(record)
+    foreach(arch ${QUALITY_ARCHS})
+        set(baseline "${PROJECT_SOURCE_DIR}/quality/${arch}.json")
+        list(APPEND check COMMAND "$<TARGET_FILE:${target}>"
+            "--archs=${arch}"
+            "--baseline=${baseline}"
+            "--tolerance=${QUALITY_TOLERANCE}"
+            "--output=${CMAKE_BINARY_DIR}/quality/${arch}.json"
+        )
+        list(APPEND record COMMAND "$<TARGET_FILE:${target}>"
+            "--archs=${arch}"
+            "--output=${baseline}"
+        )
+    endforeach()
+    add_custom_target(quality-check
+        COMMAND "${CMAKE_COMMAND}" -E make_directory "${CMAKE_BINARY_DIR}/quality"
+        ${check}
+        COMMENT "Comparing ${target} against quality/"
+        VERBATIM
+    )
+    add_custom_target(quality-baseline
+        ${record}
+        COMMENT "Recording the baselines in quality/"
+        VERBATIM
+    )
+    add_dependencies(quality-check ${target})
+    add_dependencies(quality-baseline ${target})
+endfunction()
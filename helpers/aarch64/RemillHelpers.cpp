@@ -14,52 +14,162 @@
 
 extern "C" uint8_t RAM[0];
 
+// Masked flavor (-DHELPERS_FLAVOR_MASKED): guest addresses wrap around at
+// 2^HELPERS_SANDBOX_BITS, so every access stays inside the reservation of a
+// sandboxed GuestMemory (see GuestMemory::createSandboxed) without a branch
+
+#if defined(HELPERS_FLAVOR_MASKED)
+extern "C" const uint64_t __remill_sandbox_bits = HELPERS_SANDBOX_BITS;
+#define GUEST_ADDRESS(a) ((a) & ((1ull << HELPERS_SANDBOX_BITS) - 1))
+#else
+#define GUEST_ADDRESS(a) (a)
+#endif
+
+// Execution profile (-DHELPERS_PROFILE_EXECUTION): the helpers are vectorized
+// and tuned for the host CPU, the JIT compiles the lifted code for the same
+// CPU so they can be inlined (see JitExecutor)
+
+#if defined(HELPERS_PROFILE_EXECUTION)
+extern "C" const uint8_t __remill_execution_profile = 1;
+#endif
+
 // Implementation of the Remill memory access (read/write) intrinsics
 
 HELPER uint8_t __remill_read_memory_8(Memory *m, addr_t a) {
   uint8_t v = 0;
-  __builtin_memcpy(&v, &RAM[a], sizeof(v));
+  __builtin_memcpy(&v, &RAM[GUEST_ADDRESS(a)], sizeof(v));
   return v;
 }
 
 HELPER uint16_t __remill_read_memory_16(Memory *m, addr_t a) {
   uint16_t v = 0;
-  __builtin_memcpy(&v, &RAM[a], sizeof(v));
+  __builtin_memcpy(&v, &RAM[GUEST_ADDRESS(a)], sizeof(v));
   return v;
 }
 
 HELPER uint32_t __remill_read_memory_32(Memory *m, addr_t a) {
   uint32_t v = 0;
-  __builtin_memcpy(&v, &RAM[a], sizeof(v));
+  __builtin_memcpy(&v, &RAM[GUEST_ADDRESS(a)], sizeof(v));
   return v;
 }
 
 HELPER uint64_t __remill_read_memory_64(Memory *m, addr_t a) {
   uint64_t v = 0;
-  __builtin_memcpy(&v, &RAM[a], sizeof(v));
+  __builtin_memcpy(&v, &RAM[GUEST_ADDRESS(a)], sizeof(v));
   return v;
 }
 
 HELPER Memory *__remill_write_memory_8(Memory *m, addr_t a, uint8_t v) {
-  __builtin_memcpy(&RAM[a], &v, sizeof(v));
+  __builtin_memcpy(&RAM[GUEST_ADDRESS(a)], &v, sizeof(v));
   return m;
 }
 
 HELPER Memory *__remill_write_memory_16(Memory *m, addr_t a, uint16_t v) {
-  __builtin_memcpy(&RAM[a], &v, sizeof(v));
+  __builtin_memcpy(&RAM[GUEST_ADDRESS(a)], &v, sizeof(v));
   return m;
 }
 
 HELPER Memory *__remill_write_memory_32(Memory *m, addr_t a, uint32_t v) {
-  __builtin_memcpy(&RAM[a], &v, sizeof(v));
+  __builtin_memcpy(&RAM[GUEST_ADDRESS(a)], &v, sizeof(v));
   return m;
 }
 
 HELPER Memory *__remill_write_memory_64(Memory *m, addr_t a, uint64_t v) {
-  __builtin_memcpy(&RAM[a], &v, sizeof(v));
+  __builtin_memcpy(&RAM[GUEST_ADDRESS(a)], &v, sizeof(v));
   return m;
 }
 
+// Implementation of the Remill atomic memory intrinsics. The guest runs on a
+// single host thread, so a plain read-modify-write is atomic for it (and
+// works for unaligned addresses, which lock-prefixed instructions allow)
+
+#define COMPARE_EXCHANGE(size, type)                                          \
+  HELPER Memory *__remill_compare_exchange_memory_##size(                     \
+      Memory *m, addr_t a, type &expected, DESIRED(type) desired) {           \
+    type v = 0;                                                               \
+    __builtin_memcpy(&v, &RAM[GUEST_ADDRESS(a)], sizeof(v));                  \
+    if (v == expected) {                                                      \
+      __builtin_memcpy(&RAM[GUEST_ADDRESS(a)], &desired, sizeof(v));          \
+    }                                                                         \
+    expected = v;                                                             \
+    return m;                                                                 \
+  }
+
+// The old value goes back to the caller in value
+#define FETCH_AND(name, size, type, op)                                       \
+  HELPER Memory *__remill_fetch_and_##name##_##size(Memory *m, addr_t a,      \
+                                                    type &value) {            \
+    type v = 0;                                                               \
+    __builtin_memcpy(&v, &RAM[GUEST_ADDRESS(a)], sizeof(v));                  \
+    type result = op;                                                         \
+    __builtin_memcpy(&RAM[GUEST_ADDRESS(a)], &result, sizeof(v));             \
+    value = v;                                                                \
+    return m;                                                                 \
+  }
+
+#define ATOMICS(size, type)                                                   \
+  COMPARE_EXCHANGE(size, type)                                                \
+  FETCH_AND(add, size, type, v + value)                                       \
+  FETCH_AND(sub, size, type, v - value)                                       \
+  FETCH_AND(and, size, type, v & value)                                       \
+  FETCH_AND(nand, size, type, ~(v & value))                                   \
+  FETCH_AND(or, size, type, v | value)                                        \
+  FETCH_AND(xor, size, type, v ^ value)
+
+#define DESIRED(type) type
+ATOMICS(8, uint8_t)
+ATOMICS(16, uint16_t)
+ATOMICS(32, uint32_t)
+ATOMICS(64, uint64_t)
+#undef DESIRED
+
+#if ADDRESS_SIZE_BITS == 64
+// The 128-bit variant takes desired by reference too
+#define DESIRED(type) type &
+COMPARE_EXCHANGE(128, uint128_t)
+#undef DESIRED
+#endif
+
+#undef ATOMICS
+#undef FETCH_AND
+#undef COMPARE_EXCHANGE
+
+// Region flavor (-DHELPERS_FLAVOR_REGIONS): the same intrinsics for accesses
+// MemoryRegionPass proved to be on the stack or in the image. RAM_STACK and
+// RAM_IMAGE are replaced with RAM after the helpers are inlined, see
+// tagMemoryRegions
+
+#if defined(HELPERS_FLAVOR_REGIONS)
+
+extern "C" uint8_t RAM_STACK[0];
+extern "C" uint8_t RAM_IMAGE[0];
+
+#define REGION_MEMORY(region, ram, suffix, type)                              \
+  HELPER type __remill_##region##_read_memory_##suffix(Memory *m, addr_t a) { \
+    type v = 0;                                                               \
+    __builtin_memcpy(&v, &ram[a], sizeof(v));                                 \
+    return v;                                                                 \
+  }                                                                           \
+  HELPER Memory *__remill_##region##_write_memory_##suffix(Memory *m,         \
+                                                          addr_t a, type v) { \
+    __builtin_memcpy(&ram[a], &v, sizeof(v));                                 \
+    return m;                                                                 \
+  }
+
+#define REGION(region, ram)                                                   \
+  REGION_MEMORY(region, ram, 8, uint8_t)                                      \
+  REGION_MEMORY(region, ram, 16, uint16_t)                                    \
+  REGION_MEMORY(region, ram, 32, uint32_t)                                    \
+  REGION_MEMORY(region, ram, 64, uint64_t)
+
+REGION(stack, RAM_STACK)
+REGION(image, RAM_IMAGE)
+
+#undef REGION
+#undef REGION_MEMORY
+
+#endif // HELPERS_FLAVOR_REGIONS
+
 // Implementation of the Remill flag and comparison computation intrinsics
 
 HELPER bool __remill_flag_computation_zero(bool result, ...) {
@@ -0,0 +1,482 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "optimizer.hpp"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <remill/Arch/Arch.h>
+#include <remill/Arch/Instruction.h>
+#include <remill/Arch/Name.h>
+#include <remill/BC/IntrinsicTable.h>
+#include <remill/BC/Lifter.h>
+#include <remill/BC/Optimizer.h>
+#include <remill/BC/Util.h>
+#include <remill/OS/OS.h>
+#include <remill/Version/Version.h>
+
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/raw_ostream.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+#elif !defined(__linux__)
+#include <sys/resource.h>
+#endif
+
+DEFINE_string(archs, "amd64,x86,aarch64",
+              "Comma separated remill architectures to benchmark");
+DEFINE_uint64(instructions, 10000,
+              "Number of instructions in the stream of every architecture");
+DEFINE_uint32(iterations, 5, "Measured iterations per architecture");
+DEFINE_uint32(warmup, 1, "Iterations to run before measuring");
+DEFINE_uint32(block_size, 16, "Instructions lifted into every function");
+DEFINE_string(optimizer, "module",
+              "Optimizer to measure: module (remill::OptimizeModule) or "
+              "incremental");
+DEFINE_string(pipeline, "default",
+              "Pipeline of the incremental optimizer: default, fast, "
+              "deobfuscate or custom");
+DEFINE_string(pipeline_text, "",
+              "New pass manager function pipeline for --pipeline=custom");
+DEFINE_bool(scalarize_state, false,
+            "Promote State accesses to SSA values in the incremental "
+            "optimizer");
+DEFINE_bool(freeze_undefined, false,
+            "Lower undefined values (__remill_undefined_*) to freeze poison "
+            "in the incremental optimizer");
+DEFINE_bool(eliminate_flags, false,
+            "Remove dead flag computations in the incremental optimizer");
+DEFINE_string(output, "-", "Where to write the JSON report (- for stdout)");
+
+using Clock = std::chrono::steady_clock;
+
+/// A short, representative mix of encodings for every architecture. The
+/// benchmark repeats it to the requested length. None of the instructions
+/// change control flow, so the stream can be split into blocks anywhere.
+static std::string corpusPattern(remill::ArchName arch) {
+  using namespace std::string_view_literals;
+  // The sv literals keep their length, the patterns contain zero bytes
+  switch (arch) {
+  case remill::kArchAMD64:
+    return std::string(
+        "\x48\xc7\xc1\x39\x05\x00\x00" // mov rcx, 1337
+        "\x48\x01\xd8"                 // add rax, rbx
+        "\x48\x8b\x44\x24\x08"         // mov rax, [rsp + 8]
+        "\x48\x8d\x14\x88"             // lea rdx, [rax + 4*rcx]
+        "\x31\xc0"                     // xor eax, eax
+        "\x48\x83\xf8\x10"             // cmp rax, 16
+        "\x48\x0f\xaf\xca"             // imul rcx, rdx
+        "\x53"                         // push rbx
+        "\x5b"                         // pop rbx
+        "\xf3\x0f\x6f\x07"             // movdqu xmm0, [rdi]
+        "\x48\xc1\xe0\x03"             // shl rax, 3
+        "\x85\xc9"                     // test ecx, ecx
+        "\x89\x46\x04"                 // mov [rsi + 4], eax
+        "\x0f\x95\xc0"sv);             // setne al
+  case remill::kArchX86:
+    return std::string(
+        "\xb9\x39\x05\x00\x00" // mov ecx, 1337
+        "\x01\xd8"             // add eax, ebx
+        "\x8b\x44\x24\x08"     // mov eax, [esp + 8]
+        "\x8d\x14\x88"         // lea edx, [eax + 4*ecx]
+        "\x31\xc0"             // xor eax, eax
+        "\x83\xf8\x10"         // cmp eax, 16
+        "\x0f\xaf\xca"         // imul ecx, edx
+        "\x53"                 // push ebx
+        "\x5b"                 // pop ebx
+        "\xc1\xe0\x03"         // shl eax, 3
+        "\x85\xc9"             // test ecx, ecx
+        "\x89\x46\x04"         // mov [esi + 4], eax
+        "\x0f\x95\xc0"sv);     // setne al
+  case remill::kArchAArch64LittleEndian:
+    return std::string(
+        "\x20\x00\x02\x8b"  // add x0, x1, x2
+        "\xe3\x07\x40\xf9"  // ldr x3, [sp, #8]
+        "\x24\x08\x00\xf9"  // str x4, [x1, #16]
+        "\x25\xa7\x80\xd2"  // mov x5, #1337
+        "\x1f\x40\x00\xf1"  // cmp x0, #16
+        "\x26\x00\x82\x9a"  // csel x6, x1, x2, eq
+        "\x07\xf0\x7d\xd3"  // lsl x7, x0, #3
+        "\xfd\x7b\x41\xa9"  // ldp x29, x30, [sp, #16]
+        "\x28\x0c\x02\x9b"  // madd x8, x1, x2, x3
+        "\x29\x1c\x00\x12"  // and w9, w1, #0xff
+        "\xff\x83\x00\xd1"sv); // sub sp, sp, #32
+  default:
+    return {};
+  }
+}
+
+/// Reset the peak resident set size, so every phase reports its own peak.
+/// Only Linux supports this, elsewhere the peak of the process is reported.
+static void resetPeakMemory() {
+#if defined(__linux__)
+  std::ofstream("/proc/self/clear_refs") << "5";
+#endif
+}
+
+/// Peak resident set size in bytes.
+static uint64_t peakMemory() {
+#if defined(_WIN32)
+  PROCESS_MEMORY_COUNTERS counters = {};
+  if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+    return counters.PeakWorkingSetSize;
+  }
+  return 0;
+#elif defined(__linux__)
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.rfind("VmHWM:", 0) == 0) {
+      return std::stoull(line.substr(6)) * 1024;
+    }
+  }
+  return 0;
+#else
+  // ru_maxrss is in bytes on macOS
+  rusage usage = {};
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+#endif
+}
+
+/// Samples and totals of one phase, accumulated over all the iterations.
+struct PhaseStats {
+  uint64_t numInstructions = 0;
+  Clock::duration elapsed{};
+  // Nanoseconds per instruction
+  std::vector<double> samples;
+  uint64_t peakMemory = 0;
+
+  void addSample(Clock::duration duration, uint64_t instructions) {
+    elapsed += duration;
+    numInstructions += instructions;
+    auto ns = std::chrono::duration<double, std::nano>(duration).count();
+    samples.push_back(ns / std::max<uint64_t>(instructions, 1));
+  }
+};
+
+static double percentile(const std::vector<double> &sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  auto index = static_cast<size_t>(p / 100 * (sorted.size() - 1) + 0.5);
+  return sorted[std::min(index, sorted.size() - 1)];
+}
+
+static void writePhase(llvm::json::OStream &json, llvm::StringRef name,
+                       PhaseStats stats) {
+  std::sort(stats.samples.begin(), stats.samples.end());
+  auto seconds = std::chrono::duration<double>(stats.elapsed).count();
+  json.attributeObject(name, [&] {
+    json.attribute("instructions", stats.numInstructions);
+    json.attribute("seconds", seconds);
+    json.attribute("instructions_per_second",
+                   seconds > 0 ? stats.numInstructions / seconds : 0.0);
+    json.attributeObject("ns_per_instruction", [&] {
+      json.attribute("samples", static_cast<uint64_t>(stats.samples.size()));
+      json.attribute("min", percentile(stats.samples, 0));
+      json.attribute("p50", percentile(stats.samples, 50));
+      json.attribute("p90", percentile(stats.samples, 90));
+      json.attribute("p99", percentile(stats.samples, 99));
+      json.attribute("max", percentile(stats.samples, 100));
+    });
+    json.attribute("peak_rss_bytes", stats.peakMemory);
+  });
+}
+
+/// Decode, lift and optimize the corpus of one architecture.
+class ArchBenchmark {
+public:
+  explicit ArchBenchmark(std::string name) : name(std::move(name)) {}
+
+  bool initialize() {
+    arch = remill::Arch::Get(context, "linux", name);
+    if (!arch) {
+      llvm::errs() << "Failed to get architecture " << name << "\n";
+      return false;
+    }
+
+    auto pattern = corpusPattern(arch->arch_name);
+    if (pattern.empty()) {
+      llvm::errs() << "No corpus for architecture " << name << "\n";
+      return false;
+    }
+    // No instruction is longer than 16 bytes
+    while (stream.size() < FLAGS_instructions * 16) {
+      stream += pattern;
+    }
+
+    resetPeakMemory();
+    auto start = Clock::now();
+    semantics = remill::LoadArchSemantics(arch.get());
+    loadTime = Clock::now() - start;
+    loadMemory = peakMemory();
+    if (!semantics) {
+      llvm::errs() << "Failed to load semantics of " << name << "\n";
+      return false;
+    }
+    intrinsics = arch->GetInstrinsicTable();
+
+    auto pipeline = parsePipelinePreset(FLAGS_pipeline);
+    if (!pipeline) {
+      llvm::errs() << "Unknown pipeline: " << FLAGS_pipeline << "\n";
+      return false;
+    }
+    if (FLAGS_optimizer == "incremental") {
+      optimizer = std::make_unique<IncrementalOptimizer>();
+      if (!optimizer->setPipeline(*pipeline, FLAGS_pipeline_text)) {
+        return false;
+      }
+      optimizer->setScalarizeState(FLAGS_scalarize_state);
+      optimizer->setFreezeUndefined(FLAGS_freeze_undefined);
+      if (FLAGS_eliminate_flags) {
+        optimizer->setFlagElimination(arch.get());
+      }
+    } else if (FLAGS_optimizer != "module") {
+      llvm::errs() << "Unknown optimizer: " << FLAGS_optimizer << "\n";
+      return false;
+    } else if (*pipeline != PipelinePreset::Default) {
+      llvm::errs() << "--pipeline requires --optimizer=incremental\n";
+      return false;
+    }
+    return true;
+  }
+
+  bool run(bool measure) {
+    std::vector<remill::Instruction> instructions;
+    if (!decode(instructions, measure)) {
+      return false;
+    }
+    std::vector<llvm::Function *> functions;
+    if (!lift(instructions, functions, measure)) {
+      return false;
+    }
+    optimize(functions, measure);
+
+    for (auto function : functions) {
+      if (optimizer) {
+        optimizer->forget(function);
+      }
+      function->eraseFromParent();
+    }
+    iteration++;
+    return true;
+  }
+
+  void write(llvm::json::OStream &json) const {
+    json.object([&] {
+      json.attribute("arch", name);
+      json.attribute("corpus_instructions", FLAGS_instructions);
+      json.attributeObject("semantics", [&] {
+        json.attribute("seconds",
+                       std::chrono::duration<double>(loadTime).count());
+        json.attribute("peak_rss_bytes", loadMemory);
+      });
+      json.attributeObject("phases", [&] {
+        writePhase(json, "decode", decodeStats);
+        writePhase(json, "lift", liftStats);
+        writePhase(json, "optimize", optimizeStats);
+      });
+      // Size of the inlined IR before and after the pipeline, only the
+      // incremental optimizer sees the IR in between
+      if (optimizer) {
+        json.attributeObject("ir_instructions", [&] {
+          json.attribute("before", irBefore);
+          json.attribute("after", irAfter);
+        });
+      }
+    });
+  }
+
+private:
+  bool decode(std::vector<remill::Instruction> &instructions, bool measure) {
+    resetPeakMemory();
+    auto context = arch->CreateInitialContext();
+    std::string_view bytes = stream;
+    uint64_t base = 0x1000;
+    size_t offset = 0;
+    instructions.reserve(FLAGS_instructions);
+    while (instructions.size() < FLAGS_instructions) {
+      auto &instruction = instructions.emplace_back();
+      auto start = Clock::now();
+      auto success = arch->DecodeInstruction(
+          base + offset, bytes.substr(offset), instruction, context);
+      auto elapsed = Clock::now() - start;
+      if (!success) {
+        llvm::errs() << "Failed to decode " << name << " instruction at offset "
+                     << offset << "\n";
+        return false;
+      }
+      if (measure) {
+        decodeStats.addSample(elapsed, 1);
+      }
+      offset += instruction.NumBytes();
+    }
+    if (measure) {
+      decodeStats.peakMemory = std::max(decodeStats.peakMemory, peakMemory());
+    }
+    return true;
+  }
+
+  bool lift(std::vector<remill::Instruction> &instructions,
+            std::vector<llvm::Function *> &functions, bool measure) {
+    resetPeakMemory();
+    for (size_t i = 0; i < instructions.size(); i += FLAGS_block_size) {
+      auto functionName = "bench_" + std::to_string(iteration) + "_" +
+                          llvm::utohexstr(instructions[i].pc, true);
+      auto function =
+          arch->DefineLiftedFunction(functionName, semantics.get());
+      auto block = &function->getEntryBlock();
+      functions.push_back(function);
+
+      auto end = std::min<size_t>(i + FLAGS_block_size, instructions.size());
+      for (auto j = i; j < end; j++) {
+        auto &instruction = instructions[j];
+        auto start = Clock::now();
+        auto lifter = instruction.GetLifter();
+        auto status = lifter->LiftIntoBlock(instruction, block);
+        auto elapsed = Clock::now() - start;
+        if (status != remill::kLiftedInstruction) {
+          llvm::errs() << "Failed to lift " << name << " instruction "
+                       << instruction.Serialize() << "\n";
+          return false;
+        }
+        if (measure) {
+          liftStats.addSample(elapsed, 1);
+        }
+      }
+
+      llvm::IRBuilder<> ir(block);
+      ir.CreateRet(remill::LoadMemoryPointer(block, *intrinsics));
+    }
+    if (measure) {
+      liftStats.peakMemory = std::max(liftStats.peakMemory, peakMemory());
+    }
+    return true;
+  }
+
+  void optimize(const std::vector<llvm::Function *> &functions, bool measure) {
+    resetPeakMemory();
+    // OptimizeModule works on all the functions at once, the incremental
+    // optimizer gives one sample per function
+    if (optimizer) {
+      auto before = optimizer->getStats();
+      uint64_t remaining = FLAGS_instructions;
+      for (auto function : functions) {
+        auto numInstructions = std::min<uint64_t>(remaining, FLAGS_block_size);
+        remaining -= numInstructions;
+        auto start = Clock::now();
+        optimizer->optimize(function);
+        if (measure) {
+          optimizeStats.addSample(Clock::now() - start, numInstructions);
+        }
+      }
+      if (measure) {
+        const auto &after = optimizer->getStats();
+        irBefore += after.instructionsBefore - before.instructionsBefore;
+        irAfter += after.instructionsAfter - before.instructionsAfter;
+      }
+    } else {
+      auto start = Clock::now();
+      remill::OptimizeModule(arch.get(), semantics.get(), functions);
+      if (measure) {
+        optimizeStats.addSample(Clock::now() - start, FLAGS_instructions);
+      }
+    }
+    if (measure) {
+      optimizeStats.peakMemory =
+          std::max(optimizeStats.peakMemory, peakMemory());
+    }
+  }
+
+  std::string name;
+  llvm::LLVMContext context;
+  remill::ArchPtr arch;
+  std::unique_ptr<llvm::Module> semantics;
+  const remill::IntrinsicTable *intrinsics = nullptr;
+  std::unique_ptr<IncrementalOptimizer> optimizer;
+  std::string stream;
+  unsigned iteration = 0;
+
+  Clock::duration loadTime{};
+  uint64_t loadMemory = 0;
+  PhaseStats decodeStats;
+  PhaseStats liftStats;
+  PhaseStats optimizeStats;
+  uint64_t irBefore = 0;
+  uint64_t irAfter = 0;
+};
+
+int main(int argc, char **argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  if (FLAGS_instructions == 0 || FLAGS_block_size == 0) {
+    llvm::errs() << "--instructions and --block_size must not be zero\n";
+    return EXIT_FAILURE;
+  }
+
+  llvm::SmallVector<llvm::StringRef, 4> archNames;
+  llvm::StringRef(FLAGS_archs).split(archNames, ',', -1, false);
+
+  // Architectures run one after the other so their peaks do not overlap
+  std::vector<std::unique_ptr<ArchBenchmark>> benchmarks;
+  for (auto archName : archNames) {
+    auto benchmark = std::make_unique<ArchBenchmark>(archName.trim().str());
+    if (!benchmark->initialize()) {
+      return EXIT_FAILURE;
+    }
+    for (unsigned i = 0; i < FLAGS_warmup + FLAGS_iterations; i++) {
+      if (!benchmark->run(/*measure=*/i >= FLAGS_warmup)) {
+        return EXIT_FAILURE;
+      }
+    }
+    benchmarks.push_back(std::move(benchmark));
+  }
+
+  std::error_code ec;
+  llvm::raw_fd_ostream os(FLAGS_output, ec, llvm::sys::fs::OF_Text);
+  if (ec) {
+    llvm::errs() << "Failed to open " << FLAGS_output << ": " << ec.message()
+                 << "\n";
+    return EXIT_FAILURE;
+  }
+
+  llvm::json::OStream json(os, /*IndentSize=*/2);
+  json.object([&] {
+    json.attribute("remill", remill::version::HasVersionData()
+                                 ? remill::version::GetCommitHash()
+                                 : std::string("unknown"));
+    json.attribute("llvm", LLVM_VERSION_STRING);
+    json.attribute("optimizer", FLAGS_optimizer);
+    json.attribute("pipeline", FLAGS_pipeline);
+    json.attribute("scalarize_state", FLAGS_scalarize_state);
+    json.attribute("eliminate_flags", FLAGS_eliminate_flags);
+    json.attribute("freeze_undefined", FLAGS_freeze_undefined);
+    if (FLAGS_pipeline == "custom") {
+      json.attribute("pipeline_text", FLAGS_pipeline_text);
+    }
+    json.attribute("iterations", FLAGS_iterations);
+    json.attribute("block_size", FLAGS_block_size);
+    json.attributeArray("results", [&] {
+      for (const auto &benchmark : benchmarks) {
+        benchmark->write(json);
+      }
+    });
+  });
+  os << "\n";
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,207 @@
+#include "cluster.hpp"
+#include "extract.hpp"
+#include "lifter.hpp"
+#include "socket.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <thread>
+
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+
+namespace {
+
+enum class Reply {
+  Ok,
+  // The node answered with an error, payload is the message
+  Error,
+  // The connection is unusable
+  Lost,
+};
+
+/// Send one request (see LiftDaemon) and read the reply into payload.
+Reply request(int socket, const std::string &header, std::string &payload) {
+  std::string line;
+  if (!writeAll(socket, header + "\n") || !readLine(socket, line)) {
+    return Reply::Lost;
+  }
+  llvm::StringRef status(line);
+  if (status.consume_front("error ")) {
+    payload = status.str();
+    return Reply::Error;
+  }
+  uint64_t size = 0;
+  if (!status.consume_front("ok ") || status.getAsInteger(10, size)) {
+    return Reply::Lost;
+  }
+  payload.resize(size);
+  return readAll(socket, payload.data(), size) ? Reply::Ok : Reply::Lost;
+}
+
+/// Lift every shard on one of the nodes. The bitcode of the shards that were
+/// given up is std::nullopt.
+std::vector<std::optional<std::string>>
+runShards(const std::vector<std::vector<uint64_t>> &shards,
+          const ClusterOptions &options) {
+  std::vector<std::optional<std::string>> results(shards.size());
+  std::vector<unsigned> attempts(shards.size());
+  std::deque<size_t> queue;
+  for (size_t i = 0; i < shards.size(); i++) {
+    queue.push_back(i);
+  }
+
+  // Shards that are neither lifted nor given up. A node that fails a shard
+  // queues it again before it is done, so this only reaches zero at the end.
+  std::mutex mutex;
+  std::condition_variable changed;
+  size_t numPending = shards.size();
+  size_t numAlive = options.nodes.size();
+
+  auto imageHeader = "image " + options.imageFormat + " 0x" +
+                     llvm::utohexstr(options.imageBase) + " " +
+                     options.imagePath;
+  auto serveNode = [&](const std::string &node) {
+    std::string payload;
+    auto socket = connectSocket(node);
+    if (socket >= 0 && request(socket, imageHeader, payload) != Reply::Ok) {
+      llvm::errs() << "[node " << node << "] Failed to open the image: "
+                   << payload << "\n";
+      closeSocket(socket);
+      socket = -1;
+    }
+
+    while (socket >= 0) {
+      size_t shard = 0;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&] { return !queue.empty() || numPending == 0; });
+        if (numPending == 0) {
+          break;
+        }
+        shard = queue.front();
+        queue.pop_front();
+      }
+
+      std::string header = "functions " + options.arch + " ";
+      for (size_t i = 0; i < shards[shard].size(); i++) {
+        header += (i ? ",0x" : "0x") + llvm::utohexstr(shards[shard][i]);
+      }
+      auto reply = request(socket, header, payload);
+
+      std::lock_guard<std::mutex> lock(mutex);
+      if (reply == Reply::Ok) {
+        results[shard] = std::move(payload);
+        numPending--;
+      } else {
+        llvm::errs() << "[node " << node << "] Shard " << shard << " failed: "
+                     << (reply == Reply::Lost ? "connection lost" : payload)
+                     << "\n";
+        if (++attempts[shard] < options.maxAttempts) {
+          queue.push_back(shard);
+        } else {
+          numPending--;
+        }
+        if (reply == Reply::Lost) {
+          closeSocket(socket);
+          socket = -1;
+        }
+      }
+      changed.notify_all();
+    }
+    closeSocket(socket);
+
+    // Without nodes left the remaining shards are given up
+    std::lock_guard<std::mutex> lock(mutex);
+    if (--numAlive == 0) {
+      numPending = 0;
+    }
+    changed.notify_all();
+  };
+
+  std::vector<std::thread> threads;
+  for (const auto &node : options.nodes) {
+    threads.emplace_back(serveNode, node);
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  return results;
+}
+
+} // namespace
+
+std::unique_ptr<llvm::Module>
+liftFunctionsDistributed(llvm::LLVMContext &context, const Image &image,
+                         const std::vector<uint64_t> &entries,
+                         const ClusterOptions &options) {
+  if (options.nodes.empty()) {
+    llvm::errs() << "No nodes to lift on\n";
+    return nullptr;
+  }
+
+  auto output = std::make_unique<llvm::Module>("lifted", context);
+  auto shardSize = std::max<size_t>(1, options.shardSize);
+  std::set<uint64_t> queued(entries.begin(), entries.end());
+  std::vector<uint64_t> round(queued.begin(), queued.end());
+  size_t numShards = 0;
+  size_t numFailed = 0;
+  size_t numFunctions = 0;
+  while (!round.empty()) {
+    std::vector<std::vector<uint64_t>> shards;
+    for (size_t i = 0; i < round.size(); i += shardSize) {
+      auto end = std::min(round.size(), i + shardSize);
+      shards.emplace_back(round.begin() + i, round.begin() + end);
+    }
+    auto results = runShards(shards, options);
+    numShards += shards.size();
+
+    std::set<uint64_t> next;
+    for (size_t i = 0; i < shards.size(); i++) {
+      if (!results[i]) {
+        numFailed++;
+        continue;
+      }
+      llvm::MemoryBufferRef buffer(*results[i], "shard");
+      auto part = llvm::parseBitcodeFile(buffer, context);
+      if (!part) {
+        llvm::errs() << "Failed to parse shard " << i << ": "
+                     << llvm::toString(part.takeError()) << "\n";
+        numFailed++;
+        continue;
+      }
+
+      for (const auto &function : **part) {
+        auto address = BlockLifter::functionAddress(function.getName());
+        if (!address) {
+          continue;
+        }
+        if (!function.isDeclaration()) {
+          numFunctions++;
+        } else if (options.followCalls && !image.bytesAt(*address).empty() &&
+                   queued.insert(*address).second) {
+          next.insert(*address);
+        }
+      }
+      if (!linkExtracted(*output, std::move(*part))) {
+        return nullptr;
+      }
+    }
+    round.assign(next.begin(), next.end());
+  }
+
+  if (numFunctions == 0) {
+    llvm::errs() << "Nothing was lifted\n";
+    return nullptr;
+  }
+  llvm::outs() << "Lifted " << numFunctions << " functions in " << numShards
+               << " shards (" << numFailed << " failed) on "
+               << options.nodes.size() << " nodes\n";
+  return output;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "image.hpp"
+
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+
+struct ClusterOptions {
+  // Addresses of the remill-server nodes (see connectSocket)
+  std::vector<std::string> nodes;
+  std::string arch = "amd64";
+  // The image as the nodes open it: raw or object, the base of raw images
+  // and a path every node can read
+  std::string imageFormat = "raw";
+  uint64_t imageBase = 0;
+  std::string imagePath;
+  // Functions lifted by one request
+  size_t shardSize = 64;
+  // A shard is given up after failing this many times
+  unsigned maxAttempts = 3;
+  // Also lift the targets of direct calls
+  bool followCalls = true;
+};
+
+/// Lift whole functions on remill-server nodes, starting from entries.
+///
+/// The coordinator partitions the functions into shards of shardSize entries
+/// (in address order) that the nodes pull over one connection each. A shard
+/// that fails, or is lost with its node, is queued again for any node until
+/// maxAttempts, so one bad node does not fail the job. With followCalls, the
+/// lifted_<target> declarations of a round of shards that are mapped in image
+/// become the next round, until the call graph is exhausted.
+///
+/// Shards are linked in round and shard order and the functions are named by
+/// their address (see BlockLifter::functionName), so the merged module does
+/// not depend on which node lifted what. linkExtracted keeps the first copy
+/// of the semantic helpers every shard carries.
+std::unique_ptr<llvm::Module>
+liftFunctionsDistributed(llvm::LLVMContext &context, const Image &image,
+                         const std::vector<uint64_t> &entries,
+                         const ClusterOptions &options);
@@ -0,0 +1,79 @@
+#include "constmem.hpp"
+#include "metrics.hpp"
+
+#include <llvm/ADT/APFloat.h>
+#include <llvm/ADT/APInt.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/Instructions.h>
+
+static const char kReadMemoryPrefix[] = "__remill_read_memory_";
+
+/// The value of bytes (guest byte order) as a constant of type, nullptr for
+/// types other than integers and IEEE floats.
+static llvm::Constant *constantOf(llvm::Type *type, std::string_view bytes,
+                                  bool littleEndian) {
+  auto numBits = static_cast<unsigned>(bytes.size() * 8);
+  llvm::APInt value(numBits, 0);
+  for (size_t i = 0; i < bytes.size(); i++) {
+    auto index = littleEndian ? i : bytes.size() - 1 - i;
+    llvm::APInt byte(numBits, static_cast<uint8_t>(bytes[index]));
+    value |= byte.shl(static_cast<unsigned>(i * 8));
+  }
+
+  if (type->isIntegerTy(numBits)) {
+    return llvm::ConstantInt::get(type, value);
+  }
+  if ((type->isHalfTy() || type->isFloatTy() || type->isDoubleTy()) &&
+      type->getPrimitiveSizeInBits() == numBits) {
+    return llvm::ConstantFP::get(
+        type->getContext(), llvm::APFloat(type->getFltSemantics(), value));
+  }
+  return nullptr;
+}
+
+llvm::PreservedAnalyses
+ConstantMemoryPass::run(llvm::Function &function,
+                        llvm::FunctionAnalysisManager &fam) {
+  if (!image || function.isDeclaration()) {
+    return llvm::PreservedAnalyses::all();
+  }
+
+  const auto &dataLayout = function.getParent()->getDataLayout();
+  llvm::SmallVector<std::pair<llvm::CallInst *, llvm::Constant *>, 16> folds;
+  for (auto &instruction : llvm::instructions(function)) {
+    auto call = llvm::dyn_cast<llvm::CallInst>(&instruction);
+    auto callee = call ? call->getCalledFunction() : nullptr;
+    if (!callee || call->arg_size() != 2 ||
+        callee->getName().str().rfind(kReadMemoryPrefix, 0) != 0) {
+      continue;
+    }
+    auto address = llvm::dyn_cast<llvm::ConstantInt>(call->getArgOperand(1));
+    auto type = call->getType();
+    if (!address || !type->isSized()) {
+      continue;
+    }
+
+    uint64_t size = dataLayout.getTypeStoreSize(type);
+    auto bytes = image->readOnlyBytes(address->getZExtValue(), size);
+    if (bytes.empty()) {
+      continue;
+    }
+    if (auto constant = constantOf(type, bytes, dataLayout.isLittleEndian())) {
+      folds.push_back({call, constant});
+    }
+  }
+
+  for (auto [call, constant] : folds) {
+    call->replaceAllUsesWith(constant);
+    call->eraseFromParent();
+  }
+  if (folds.empty()) {
+    return llvm::PreservedAnalyses::all();
+  }
+  Metrics::add(Counter::FoldedReads, folds.size());
+  llvm::PreservedAnalyses preserved;
+  preserved.preserveSet<llvm::CFGAnalyses>();
+  return preserved;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "image.hpp"
+
+#include <llvm/IR/Function.h>
+#include <llvm/IR/PassManager.h>
+
+/// Replace the reads of read-only image memory at constant addresses with
+/// their value.
+///
+/// Lifted code reads everything through __remill_read_memory_*, so a load from
+/// .rodata or .text stays an opaque call even when the optimizer knows the
+/// address. The bytes of read-only segments (see ImageSegment::readOnly) never
+/// change, so these calls fold to constants of the bytes in the image, which
+/// in turn resolves jump tables and the bytecode fetches of VM handlers.
+///
+/// Runs on lifted functions after the semantics are inlined (the intrinsic
+/// calls are visible) and before the helpers are linked in. Every fold can
+/// make more addresses constant, so it alternates with the pipeline.
+class ConstantMemoryPass : public llvm::PassInfoMixin<ConstantMemoryPass> {
+public:
+  explicit ConstantMemoryPass(const Image *image) : image(image) {}
+
+  llvm::PreservedAnalyses run(llvm::Function &function,
+                              llvm::FunctionAnalysisManager &fam);
+
+private:
+  const Image *image = nullptr;
+};
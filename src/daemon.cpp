@@ -0,0 +1,394 @@
+#include "daemon.hpp"
+#include "decoder.hpp"
+#include "extract.hpp"
+#include "image.hpp"
+#include "lifter.hpp"
+#include "metrics.hpp"
+#include "optimizer.hpp"
+#include "patches.hpp"
+#include "semantics.hpp"
+#include "socket.hpp"
+
+#include <algorithm>
+#include <mutex>
+#include <thread>
+
+#include <remill/Arch/Arch.h>
+
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/Support/raw_ostream.h>
+
+// Upper bound of the guest code in one request
+static constexpr uint64_t kMaxRequestSize = 64 << 20;
+// Upper bound of a request line, a functions request lists all its entries
+static constexpr size_t kMaxLineSize = 1 << 20;
+
+/// The canonical path of the image a client asked for, empty when it is not
+/// below root (or does not exist).
+static std::filesystem::path imagePath(const std::filesystem::path &root,
+                                       llvm::StringRef requested) {
+  std::error_code ec;
+  auto path = std::filesystem::canonical(root / requested.str(), ec);
+  if (ec) {
+    return {};
+  }
+  auto below = std::mismatch(root.begin(), root.end(), path.begin(),
+                             path.end())
+                   .first == root.end();
+  return below ? path : std::filesystem::path();
+}
+
+struct LiftDaemon::ArchInstance {
+  // Serializes the requests for the architecture, none of the state below is
+  // thread-safe
+  std::mutex mutex;
+  llvm::LLVMContext context;
+  remill::ArchPtr arch;
+  std::unique_ptr<llvm::Module> semantics;
+  std::unique_ptr<DecodeCache> decodeCache;
+  std::unique_ptr<IncrementalOptimizer> optimizer;
+  bool foldConstantMemory = false;
+  // Hotpatches applied on top of the semantics, watched in patchDir
+  std::unique_ptr<PatchManager> patches;
+  std::filesystem::path patchDir;
+};
+
+LiftDaemon::~LiftDaemon() {
+  {
+    std::lock_guard<std::mutex> lock(watcherMutex);
+    stopping = true;
+  }
+  watcherStop.notify_all();
+  if (patchWatcher.joinable()) {
+    patchWatcher.join();
+  }
+
+  // Connections blocked in reading a request see EOF, the ones lifting answer
+  // the current request first
+  std::vector<std::thread> threads;
+  {
+    std::unique_lock<std::mutex> lock(connectionsMutex);
+    for (auto &[socket, thread] : connections) {
+      shutdownSocket(socket);
+    }
+    connectionsDone.wait(lock, [this] { return connections.empty(); });
+    threads = std::move(finishedConnections);
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+std::unique_ptr<LiftDaemon> LiftDaemon::create(const DaemonOptions &options) {
+  const auto &lift = options.lift;
+  std::unique_ptr<LiftDaemon> daemon(new LiftDaemon());
+  daemon->patchPollInterval = options.patchPollInterval;
+  if (!options.imageRoot.empty()) {
+    std::error_code ec;
+    daemon->imageRoot = std::filesystem::canonical(options.imageRoot, ec);
+    if (ec) {
+      llvm::errs() << "Invalid image root " << options.imageRoot.string()
+                   << ": " << ec.message() << "\n";
+      return nullptr;
+    }
+  }
+  for (const auto &name : options.archs) {
+    auto instance = std::make_unique<ArchInstance>();
+    instance->arch = remill::Arch::Get(instance->context, lift.os, name);
+    if (!instance->arch) {
+      llvm::errs() << "Failed to get architecture " << name << "\n";
+      return nullptr;
+    }
+
+    auto semanticsOptions = lift.semantics;
+    if (auto dir = helpersArchDir(name)) {
+      semanticsOptions.hotpatchPath =
+          options.helpersDir / dir / "RemillHotpatch.bc";
+    }
+    instance->semantics =
+        loadSemantics(instance->arch.get(), semanticsOptions);
+    if (!instance->semantics) {
+      llvm::errs() << "Failed to load the semantics of " << name << "\n";
+      return nullptr;
+    }
+    if (lift.decodeCache) {
+      instance->decodeCache =
+          std::make_unique<DecodeCache>(instance->arch.get());
+    }
+    if (lift.incrementalOptimizer) {
+      auto &optimizer = instance->optimizer;
+      optimizer = std::make_unique<IncrementalOptimizer>();
+      if (!optimizer->setPipeline(lift.pipeline, lift.pipelineText)) {
+        return nullptr;
+      }
+      optimizer->setScalarizeState(lift.scalarizeState);
+      optimizer->setFreezeUndefined(lift.freezeUndefined);
+      if (lift.eliminateFlags) {
+        optimizer->setFlagElimination(instance->arch.get());
+      }
+      instance->foldConstantMemory = lift.foldConstantMemory;
+    }
+    // Released patch functions have to be dropped from the optimizer cache
+    if (auto dir = helpersArchDir(name); dir && !options.patchDir.empty()) {
+      instance->patchDir = options.patchDir / dir;
+      instance->patches = std::make_unique<PatchManager>(
+          *instance->semantics, instance->optimizer.get());
+      if (std::filesystem::is_directory(instance->patchDir)) {
+        instance->patches->sync(instance->patchDir);
+      }
+    }
+    daemon->instances.emplace(name, std::move(instance));
+  }
+  return daemon;
+}
+
+bool LiftDaemon::lift(const LiftRequest &request,
+                      llvm::SmallVector<char, 0> &bitcode,
+                      std::string &error) {
+  auto found = instances.find(request.arch);
+  if (found == instances.end()) {
+    error = "unknown architecture " + request.arch;
+    return false;
+  }
+  if (request.kind == LiftRequest::Kind::Functions && !request.image) {
+    error = "no image to lift functions from";
+    return false;
+  }
+  auto &instance = *found->second;
+  std::lock_guard<std::mutex> lock(instance.mutex);
+
+  // Decoded instructions keep views of the bytes, the image owns a copy
+  auto image = request.image;
+  std::unique_ptr<Image> bytes;
+  if (!image) {
+    bytes = Image::fromBuffer(
+        llvm::MemoryBuffer::getMemBufferCopy(request.bytes, "request"),
+        request.address);
+    image = bytes.get();
+  }
+  BlockLifter lifter(instance.arch.get(), instance.semantics.get());
+  lifter.setDecodeCache(instance.decodeCache.get());
+  std::vector<llvm::Function *> functions;
+  if (request.kind == LiftRequest::Kind::Functions) {
+    for (auto entry : request.entries) {
+      auto lifted = lifter.liftFunction(*image, entry);
+      if (lifted.function) {
+        functions.push_back(lifted.function);
+      }
+    }
+  } else if (request.kind == LiftRequest::Kind::Function) {
+    auto lifted = lifter.liftFunction(*image, request.address);
+    if (lifted.function) {
+      functions.push_back(lifted.function);
+    }
+  } else {
+    LiftRange range{request.address, request.address + request.bytes.size()};
+    for (const auto &block : lifter.liftRange(*image, range)) {
+      functions.push_back(block.function);
+    }
+  }
+  if (functions.empty()) {
+    error = "nothing lifted at 0x" + llvm::utohexstr(request.address);
+    return false;
+  }
+
+  // Only the image of the request can be folded, set it for this request
+  if (instance.foldConstantMemory) {
+    instance.optimizer->setConstantMemory(image);
+  }
+  optimizeLifted(instance.arch.get(), instance.semantics.get(), functions,
+                 instance.optimizer.get());
+  if (instance.foldConstantMemory) {
+    instance.optimizer->setConstantMemory(nullptr);
+  }
+  {
+    PhaseTimer timer(Phase::Output);
+    auto extracted = extractFunctions(*instance.semantics, functions);
+    bitcode = writeBitcode(*extracted);
+  }
+
+  // The semantics module is shared by all the requests, keep it from growing
+  for (auto function : functions) {
+    if (instance.optimizer) {
+      instance.optimizer->forget(function);
+    }
+    function->eraseFromParent();
+  }
+  // Including the callees of the functions
+  BlockLifter::eraseUnusedDeclarations(*instance.semantics);
+  return true;
+}
+
+static bool writeResponse(int socket, llvm::StringRef payload) {
+  return writeAll(socket, "ok " + std::to_string(payload.size()) + "\n") &&
+         writeAll(socket, payload);
+}
+
+static bool writeError(int socket, llvm::StringRef message) {
+  return writeAll(socket, ("error " + message + "\n").str());
+}
+
+bool LiftDaemon::serve(const std::string &address) {
+  auto listener = listenSocket(address);
+  if (listener < 0) {
+    return false;
+  }
+
+  auto watched = llvm::any_of(instances, [](const auto &instance) {
+    return instance.second->patches != nullptr;
+  });
+  if (watched && !patchWatcher.joinable() && patchPollInterval.count() > 0) {
+    patchWatcher = std::thread(&LiftDaemon::watchPatches, this);
+  }
+
+  llvm::errs() << "Listening on " << address << "\n";
+  int connection = -1;
+  while ((connection = acceptSocket(listener)) >= 0) {
+    std::vector<std::thread> threads;
+    {
+      // The thread cannot finish before it is in connections
+      std::lock_guard<std::mutex> lock(connectionsMutex);
+      threads = std::move(finishedConnections);
+      finishedConnections.clear();
+      connections.emplace(connection, std::thread([this, connection] {
+                            serveConnection(connection);
+                            std::lock_guard<std::mutex> lock(connectionsMutex);
+                            auto node = connections.extract(connection);
+                            finishedConnections.push_back(
+                                std::move(node.mapped()));
+                            closeSocket(connection);
+                            connectionsDone.notify_all();
+                          }));
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+  }
+  closeSocket(listener);
+  return false;
+}
+
+void LiftDaemon::watchPatches() {
+  std::unique_lock<std::mutex> stop(watcherMutex);
+  while (!watcherStop.wait_for(stop, patchPollInterval,
+                               [this] { return stopping; })) {
+    for (auto &[name, instance] : instances) {
+      if (!instance->patches ||
+          !std::filesystem::is_directory(instance->patchDir)) {
+        continue;
+      }
+      std::lock_guard<std::mutex> lock(instance->mutex);
+      instance->patches->sync(instance->patchDir);
+    }
+  }
+}
+
+void LiftDaemon::serveConnection(int connection) {
+  // Set by the image request, for the functions requests that follow it
+  std::unique_ptr<Image> image;
+  std::string line;
+  while (readLine(connection, line, kMaxLineSize)) {
+    llvm::SmallVector<llvm::StringRef, 4> fields;
+    llvm::StringRef(line).split(fields, ' ', 3, /*KeepEmpty=*/false);
+    if (fields.empty()) {
+      continue;
+    }
+
+    if (fields[0] == "archs") {
+      std::string names;
+      for (const auto &[name, instance] : instances) {
+        names += name + "\n";
+      }
+      if (!writeResponse(connection, names)) {
+        return;
+      }
+      continue;
+    }
+
+    // image <raw|object> <base> <path>
+    if (fields[0] == "image") {
+      uint64_t base = 0;
+      if (fields.size() != 4 || fields[2].getAsInteger(0, base)) {
+        writeError(connection, "malformed request: " + line);
+        return;
+      }
+      // Clients must not get to read files outside of the image root
+      image = nullptr;
+      if (imageRoot.empty()) {
+        if (!writeError(connection, "image requests are disabled")) {
+          return;
+        }
+        continue;
+      }
+      auto path = imagePath(imageRoot, fields[3]);
+      if (path.empty()) {
+        if (!writeError(connection, "no image " + fields[3].str() +
+                                        " below the image root")) {
+          return;
+        }
+        continue;
+      }
+      if (fields[1] == "raw") {
+        image = Image::open(path.string(), base);
+      } else if (fields[1] == "object") {
+        image = Image::openObject(path.string());
+      }
+      auto sent = image ? writeResponse(connection, {})
+                        : writeError(connection, "failed to open image " +
+                                                     fields[3].str());
+      if (!sent) {
+        return;
+      }
+      continue;
+    }
+
+    LiftRequest request;
+    uint64_t size = 0;
+    if (fields[0] == "functions" && fields.size() == 3) {
+      // functions <arch> <entry>,<entry>,...
+      request.kind = LiftRequest::Kind::Functions;
+      request.image = image.get();
+      llvm::SmallVector<llvm::StringRef, 64> entries;
+      fields[2].split(entries, ',', -1, /*KeepEmpty=*/false);
+      for (auto entry : entries) {
+        uint64_t address = 0;
+        if (entry.getAsInteger(0, address)) {
+          writeError(connection, "malformed request: " + line);
+          return;
+        }
+        request.entries.push_back(address);
+      }
+    } else if ((fields[0] == "range" || fields[0] == "function") &&
+               fields.size() == 4) {
+      // range|function <arch> <address> <size>, then size bytes
+      request.kind = fields[0] == "range" ? LiftRequest::Kind::Range
+                                          : LiftRequest::Kind::Function;
+      if (fields[2].getAsInteger(0, request.address) ||
+          fields[3].getAsInteger(0, size) || size > kMaxRequestSize) {
+        writeError(connection, "malformed request: " + line);
+        return;
+      }
+    } else {
+      writeError(connection, "unknown request: " + line);
+      return;
+    }
+    request.arch = fields[1].str();
+    request.bytes.resize(size);
+    if (!readAll(connection, request.bytes.data(), size)) {
+      return;
+    }
+
+    llvm::SmallVector<char, 0> bitcode;
+    std::string error;
+    auto sent = lift(request, bitcode, error)
+                    ? writeResponse(connection,
+                                    {bitcode.data(), bitcode.size()})
+                    : writeError(connection, error);
+    if (!sent) {
+      return;
+    }
+  }
+}
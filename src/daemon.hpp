@@ -0,0 +1,123 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "engine.hpp"
+#include "image.hpp"
+
+#include <llvm/ADT/SmallVector.h>
+
+struct DaemonOptions {
+  // remill architectures to keep warm, all of them built by add_helper
+  std::vector<std::string> archs = {"amd64", "x86", "aarch64"};
+  // Directory with the helpers/<arch> build outputs, every architecture gets
+  // the RemillHotpatch.bc of its directory applied to its semantics
+  std::filesystem::path helpersDir;
+  // Optimizer and semantics settings of every architecture (arch, numWorkers
+  // and queueCapacity are ignored)
+  EngineOptions lift;
+  // Directory with a helpers/<arch> style subdirectory of hotpatches for
+  // every architecture, watched for changes (disabled when empty)
+  std::filesystem::path patchDir;
+  std::chrono::milliseconds patchPollInterval{1000};
+  // Directory the image requests of clients can open files in, image
+  // requests are refused when empty
+  std::filesystem::path imageRoot;
+};
+
+/// What a client asks the daemon to lift.
+struct LiftRequest {
+  enum class Kind {
+    // All the basic blocks of bytes (see BlockLifter::liftRange)
+    Range,
+    // The function at address (see BlockLifter::liftFunction)
+    Function,
+    // The functions at entries of image
+    Functions,
+  };
+
+  Kind kind = Kind::Range;
+  std::string arch;
+  // Guest address of the first byte of bytes
+  uint64_t address = 0;
+  std::string bytes;
+  std::vector<uint64_t> entries;
+  const Image *image = nullptr;
+};
+
+/// A long-running lifter that keeps a remill::Arch, the hotpatched semantics
+/// and an optimizer warm for every architecture, so a request only pays for
+/// decoding, lifting and optimizing its own bytes.
+///
+/// Clients connect to a Unix or TCP socket (see listenSocket) and send any
+/// number of requests, each a header line (followed by size bytes of guest
+/// code for range and function):
+///
+///   range <arch> <address> <size>\n<bytes>
+///   function <arch> <address> <size>\n<bytes>
+///   image <raw|object> <base> <path>\n
+///   functions <arch> <entry>,<entry>,...\n
+///   archs\n
+///
+/// image opens a file below the imageRoot of the daemon (shared storage on
+/// other nodes) for the functions requests of the connection, which lift
+/// several functions without sending any guest code. Paths are resolved with
+/// their symbolic links before they are checked, there are no image requests
+/// without an imageRoot. Every request is answered with
+/// "ok <size>\n" and size bytes (the bitcode of the lifted functions, the
+/// architecture names for archs, nothing for image), or "error <message>\n".
+/// Connections are served on their own threads, requests for different
+/// architectures run concurrently. Destroying the daemon shuts the open
+/// connections down and joins their threads.
+///
+/// With a patchDir, a thread polls the hotpatches of every architecture and
+/// applies the ones that were added, modified or removed with a
+/// PatchManager. The swap holds the lock of the architecture, so a request
+/// sees either the old or the new patch. The semantics, the decode cache and
+/// the optimizer stay warm.
+class LiftDaemon {
+public:
+  static std::unique_ptr<LiftDaemon> create(const DaemonOptions &options);
+  ~LiftDaemon();
+
+  /// Lift request and write the optimized functions to bitcode. Returns false
+  /// with a message in error when nothing was lifted.
+  bool lift(const LiftRequest &request, llvm::SmallVector<char, 0> &bitcode,
+            std::string &error);
+
+  /// Accept connections on address until accepting fails. Only supported on
+  /// POSIX systems.
+  bool serve(const std::string &address);
+
+private:
+  struct ArchInstance;
+
+  LiftDaemon() = default;
+
+  void serveConnection(int connection);
+  void watchPatches();
+
+  std::map<std::string, std::unique_ptr<ArchInstance>> instances;
+  // Canonical, empty when image requests are refused
+  std::filesystem::path imageRoot;
+  std::chrono::milliseconds patchPollInterval{};
+  std::thread patchWatcher;
+  std::mutex watcherMutex;
+  std::condition_variable watcherStop;
+  bool stopping = false;
+  // The threads of the open connections by socket, and the threads of closed
+  // connections that are not joined yet
+  std::mutex connectionsMutex;
+  std::condition_variable connectionsDone;
+  std::map<int, std::thread> connections;
+  std::vector<std::thread> finishedConnections;
+};
@@ -0,0 +1,130 @@
+#include "decoder.hpp"
+
+#include <algorithm>
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/Format.h>
+
+// Registers remill's decoders keep in the DecodingContext (the Thumb mode bit
+// of AArch32), x86 and AArch64 do not use any
+static const char *const kContextRegisters[] = {"TMReg"};
+
+// Keys store the instruction length in a 64-bit mask
+static constexpr size_t kMaxCachedLength = 63;
+
+DecodeCache::DecodeCache(const remill::Arch *arch, size_t maxEntries)
+    : arch(arch), maxEntries(maxEntries) {
+  // ADRP computes its result from the page of the PC, so only addresses with
+  // the same page offset can share a decoded instruction
+  if (arch->IsAArch64()) {
+    addressClassMask = 0xfff;
+  }
+}
+
+void DecodeCache::rebase(remill::Instruction &instruction,
+                         uint64_t address) const {
+  // PC-relative operands refer to the PC and NEXT_PC registers and are
+  // resolved during lifting, only the absolute addresses need to be moved
+  auto delta = address - instruction.pc;
+  instruction.pc += delta;
+  instruction.next_pc += delta;
+  if (instruction.delayed_pc != 0) {
+    instruction.delayed_pc += delta;
+  }
+  if (instruction.IsDirectControlFlow() || instruction.IsConditionalBranch()) {
+    instruction.branch_taken_pc += delta;
+    instruction.branch_not_taken_pc += delta;
+  }
+}
+
+bool DecodeCache::decode(uint64_t address, std::string_view bytes,
+                         remill::Instruction &instruction,
+                         const remill::DecodingContext &context) {
+  llvm::SmallString<64> key;
+  auto appendValue = [&key](uint64_t value) {
+    key.append(reinterpret_cast<const char *>(&value),
+               reinterpret_cast<const char *>(&value) + sizeof(value));
+  };
+  appendValue(address & addressClassMask);
+  for (auto reg : kContextRegisters) {
+    appendValue(context.HasValueForReg(reg) ? context.GetContextValue(reg) + 1
+                                            : 0);
+  }
+
+  // Instruction encodings are prefix-free: the first cached length that
+  // matches is the length the decoder would have found
+  auto prefixSize = key.size();
+  auto maxLength = std::min(bytes.size(), kMaxCachedLength);
+  for (size_t length = 1; length <= maxLength; length++) {
+    if ((lengthMask & (1ull << length)) == 0) {
+      continue;
+    }
+
+    key.resize(prefixSize);
+    key.append(bytes.begin(), bytes.begin() + length);
+    auto found = entries.find(key);
+    if (found == entries.end()) {
+      continue;
+    }
+
+    auto &entry = found->second;
+    if (entry.instruction.pc == address) {
+      instruction = entry.instruction;
+      numHits++;
+      return true;
+    }
+    if (entry.relocation == Relocation::Fixed) {
+      break;
+    }
+
+    instruction = entry.instruction;
+    rebase(instruction, address);
+    if (entry.relocation == Relocation::Relocatable) {
+      numHits++;
+      numRebased++;
+      return true;
+    }
+
+    // Verify the first rebase against the decoder
+    remill::Instruction decoded;
+    numMisses++;
+    if (!arch->DecodeInstruction(address, bytes, decoded, context)) {
+      return false;
+    }
+    if (decoded.Serialize() == instruction.Serialize()) {
+      entry.relocation = Relocation::Relocatable;
+    } else {
+      entry.relocation = Relocation::Fixed;
+      numFixed++;
+    }
+    instruction = decoded;
+    return true;
+  }
+
+  numMisses++;
+  if (!arch->DecodeInstruction(address, bytes, instruction, context)) {
+    return false;
+  }
+
+  auto length = instruction.NumBytes();
+  if (length == 0 || length > kMaxCachedLength) {
+    return true;
+  }
+  if (entries.size() >= maxEntries) {
+    entries.clear();
+    lengthMask = 0;
+  }
+  key.resize(prefixSize);
+  key.append(bytes.begin(), bytes.begin() + length);
+  entries.try_emplace(key, Entry{instruction, Relocation::Unknown});
+  lengthMask |= 1ull << length;
+  return true;
+}
+
+void DecodeCache::printStats(llvm::raw_ostream &os) const {
+  auto total = numHits + numMisses;
+  auto hitRate = total ? 100.0 * numHits / total : 0.0;
+  os << "Decode cache: " << numHits << " hits, " << numMisses << " misses ("
+     << llvm::format("%.1f", hitRate) << "% hit rate), " << numRebased
+     << " rebased, " << numFixed << " fixed-address entries\n";
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+
+#include <remill/Arch/Arch.h>
+#include <remill/Arch/Instruction.h>
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/raw_ostream.h>
+
+/// Cache of decoded instructions keyed by their bytes.
+///
+/// The key is (instruction bytes, DecodingContext, address class). A hit
+/// returns a copy of the cached remill::Instruction with its program counters
+/// rebased to the new address. The address class is the part of the address
+/// that rebasing cannot account for, for example the page offset on AArch64
+/// where ADRP is relative to the page of the PC.
+///
+/// The first time an entry is rebased it is checked against a real decode. An
+/// entry that does not survive rebasing is only ever used at its own address.
+class DecodeCache {
+public:
+  explicit DecodeCache(const remill::Arch *arch, size_t maxEntries = 1 << 16);
+
+  /// Drop-in replacement for remill::Arch::DecodeInstruction.
+  bool decode(uint64_t address, std::string_view bytes,
+              remill::Instruction &instruction,
+              const remill::DecodingContext &context);
+
+  uint64_t getHits() const { return numHits; }
+  uint64_t getMisses() const { return numMisses; }
+
+  void printStats(llvm::raw_ostream &os) const;
+
+private:
+  enum class Relocation { Unknown, Relocatable, Fixed };
+
+  struct Entry {
+    remill::Instruction instruction;
+    Relocation relocation = Relocation::Unknown;
+  };
+
+  void rebase(remill::Instruction &instruction, uint64_t address) const;
+
+  const remill::Arch *arch = nullptr;
+  size_t maxEntries = 0;
+  uint64_t addressClassMask = 0;
+  llvm::StringMap<Entry> entries;
+  // Bit N is set when an instruction of N bytes is cached
+  uint64_t lengthMask = 0;
+  uint64_t numHits = 0;
+  uint64_t numMisses = 0;
+  uint64_t numRebased = 0;
+  uint64_t numFixed = 0;
+};
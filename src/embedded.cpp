@@ -0,0 +1,70 @@
+#include "embedded.hpp"
+#include "exepath.hpp"
+
+#include <string>
+
+#include <llvm/Support/raw_ostream.h>
+
+#if defined(REMILL_EMBEDDED_HELPERS)
+// Generated by cmake/EmbedBitcode.cmake, terminated by a null name
+extern const EmbeddedFile kEmbeddedFiles[];
+#else
+static const EmbeddedFile kEmbeddedFiles[] = {{nullptr, nullptr, 0}};
+#endif
+
+std::optional<llvm::MemoryBufferRef> embeddedFile(llvm::StringRef name) {
+  for (auto file = kEmbeddedFiles; file->name; file++) {
+    if (name == file->name) {
+      return llvm::MemoryBufferRef(llvm::StringRef(file->data, file->size),
+                                   file->name);
+    }
+  }
+  return std::nullopt;
+}
+
+/// The embedded copy of the build output at path, if it is one.
+static std::optional<llvm::MemoryBufferRef>
+embeddedCopy(const std::filesystem::path &path) {
+  std::error_code ec;
+  auto absolute = std::filesystem::absolute(path, ec);
+  if (ec) {
+    return std::nullopt;
+  }
+  auto name = absolute.lexically_normal()
+                  .lexically_relative(executableDir())
+                  .generic_string();
+  if (name.empty() || name.rfind("..", 0) == 0) {
+    return std::nullopt;
+  }
+  return embeddedFile(name);
+}
+
+/// True when the file at path was written after the executable was linked,
+/// so the embedded copy of it is stale (the helpers were rebuilt alone).
+static bool newerThanExecutable(const std::filesystem::path &path) {
+  std::error_code ec;
+  auto written = std::filesystem::last_write_time(path, ec);
+  if (ec) {
+    return false;
+  }
+  auto linked = std::filesystem::last_write_time(executablePath(), ec);
+  return !ec && written > linked;
+}
+
+llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>>
+readBitcode(const std::filesystem::path &path) {
+  if (auto embedded = embeddedCopy(path)) {
+    if (!newerThanExecutable(path)) {
+      return llvm::MemoryBuffer::getMemBuffer(
+          *embedded, /*RequiresNullTerminator=*/false);
+    }
+    llvm::errs() << "Reading " << path.string()
+                 << ", it is newer than its embedded copy\n";
+  }
+  // Null terminated, textual IR overrides go through the same path
+  return llvm::MemoryBuffer::getFile(path.string());
+}
+
+bool bitcodeExists(const std::filesystem::path &path) {
+  return embeddedCopy(path) || std::filesystem::exists(path);
+}
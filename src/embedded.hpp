@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <memory>
+#include <optional>
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/ErrorOr.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+/// A build output compiled into the executable by embed_helpers (see
+/// cmake/EmbedHelpers.cmake).
+struct EmbeddedFile {
+  // Relative to the build directory, e.g. helpers/x86_64/RemillHotpatch.bc
+  const char *name;
+  const char *data;
+  size_t size;
+};
+
+/// The embedded copy of the build output name, std::nullopt when the
+/// executable was built without it (or with EMBED_HELPERS off).
+std::optional<llvm::MemoryBufferRef> embeddedFile(llvm::StringRef name);
+
+/// Drop-in replacement for llvm::MemoryBuffer::getFile for the helpers.
+///
+/// The helpers and hotpatches next to the executable, where the build puts
+/// them, are served from their embedded copies without any file I/O and
+/// without copying (the buffer points into the read-only data of the
+/// executable). Every other path, such as a runtime override on the command
+/// line, is read from disk. So is a build output that is newer than the
+/// executable, because the helpers were rebuilt without relinking it.
+llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>>
+readBitcode(const std::filesystem::path &path);
+
+/// True when readBitcode(path) finds an embedded copy or a file.
+bool bitcodeExists(const std::filesystem::path &path);
@@ -0,0 +1,457 @@
+#include "engine.hpp"
+#include "extract.hpp"
+#include "lifter.hpp"
+#include "metrics.hpp"
+#include "optimizer.hpp"
+#include "queue.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include <remill/Arch/Arch.h>
+
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/raw_ostream.h>
+
+namespace {
+
+struct JobResult {
+  bool success = false;
+  size_t numInstructions = 0;
+  llvm::SmallVector<char, 0> bitcode;
+  // Function jobs: the entries the function calls
+  llvm::SmallVector<uint64_t, 8> callees;
+};
+
+class Worker {
+public:
+  Worker(size_t index, const Image &image, const EngineOptions &options)
+      : index(index), image(image), options(options) {}
+
+  /// An optimizeOnly worker only optimizes jobs lifted by other workers (see
+  /// optimize). It still loads the semantics, always lazily: the register
+  /// table of the arch, which the optimizer passes use, comes from them.
+  bool initialize(llvm::MemoryBufferRef semanticsBitcode,
+                  bool optimizeOnly = false) {
+    {
+      // remill initializes the global decoder tables on first use
+      static std::mutex archMutex;
+      std::lock_guard<std::mutex> lock(archMutex);
+      arch = remill::Arch::Get(context, options.os, options.arch);
+    }
+    if (!arch) {
+      llvm::errs() << "[worker " << index << "] Failed to get architecture\n";
+      return false;
+    }
+
+    semantics = parseSemantics(arch.get(), semanticsBitcode,
+                               optimizeOnly || options.semantics.lazy);
+    if (!semantics) {
+      llvm::errs() << "[worker " << index << "] Failed to load semantics\n";
+      return false;
+    }
+
+    if (options.decodeCache) {
+      decodeCache = std::make_unique<DecodeCache>(arch.get());
+    }
+    if (options.incrementalOptimizer) {
+      optimizer = std::make_unique<IncrementalOptimizer>();
+      if (!optimizer->setPipeline(options.pipeline, options.pipelineText)) {
+        return false;
+      }
+      optimizer->setScalarizeState(options.scalarizeState);
+      optimizer->setFreezeUndefined(options.freezeUndefined);
+      if (options.eliminateFlags) {
+        optimizer->setFlagElimination(arch.get());
+      }
+      if (options.foldConstantMemory) {
+        optimizer->setConstantMemory(&image);
+      }
+    }
+    return true;
+  }
+
+  const DecodeCache *getDecodeCache() const { return decodeCache.get(); }
+
+  /// Lift and optimize range. Without optimization, the bitcode still has the
+  /// semantics the functions call, so optimize() can pick it up.
+  JobResult run(const LiftRange &range, bool optimize = true) {
+    JobResult result;
+    BlockLifter lifter(arch.get(), semantics.get());
+    lifter.setDecodeCache(decodeCache.get());
+    std::vector<llvm::Function *> functions;
+    for (const auto &block : lifter.liftRange(image, range)) {
+      functions.push_back(block.function);
+      result.numInstructions += block.numInstructions;
+    }
+    finish(functions, result, optimize);
+    return result;
+  }
+
+  /// Optimize the functions of a job lifted without optimization.
+  JobResult optimize(const JobResult &lifted) {
+    JobResult result;
+    result.numInstructions = lifted.numInstructions;
+    llvm::MemoryBufferRef buffer(
+        llvm::StringRef(lifted.bitcode.data(), lifted.bitcode.size()),
+        "lifted");
+    auto module = llvm::parseBitcodeFile(buffer, context);
+    if (!module) {
+      llvm::errs() << "[worker " << index << "] Failed to parse lifted job: "
+                   << llvm::toString(module.takeError()) << "\n";
+      return result;
+    }
+
+    std::vector<llvm::Function *> functions;
+    for (auto &function : **module) {
+      if (!function.isDeclaration() &&
+          BlockLifter::functionAddress(function.getName())) {
+        functions.push_back(&function);
+      }
+    }
+    optimizeLifted(arch.get(), module->get(), functions, optimizer.get());
+    {
+      PhaseTimer timer(Phase::Output);
+      auto extracted = extractFunctions(**module, functions);
+      result.bitcode = writeBitcode(*extracted);
+    }
+    result.success = true;
+
+    // The module goes away with the job, so must everything cached about it
+    if (optimizer) {
+      for (auto &function : **module) {
+        optimizer->forget(&function);
+      }
+    }
+    return result;
+  }
+
+  JobResult runFunction(uint64_t entry) {
+    JobResult result;
+    BlockLifter lifter(arch.get(), semantics.get());
+    lifter.setDecodeCache(decodeCache.get());
+    auto lifted = lifter.liftFunction(image, entry);
+    std::vector<llvm::Function *> functions;
+    if (lifted.function) {
+      functions.push_back(lifted.function);
+      result.numInstructions = lifted.numInstructions;
+      result.callees = lifted.callees;
+    }
+    finish(functions, result);
+    if (!result.success) {
+      llvm::errs() << "[worker " << index << "] Failed to lift function at "
+                   << llvm::format_hex(entry, 1) << "\n";
+    }
+    return result;
+  }
+
+private:
+  void finish(const std::vector<llvm::Function *> &functions,
+              JobResult &result, bool optimize = true) {
+    if (functions.empty()) {
+      return;
+    }
+
+    if (optimize) {
+      optimizeLifted(arch.get(), semantics.get(), functions, optimizer.get());
+    }
+    {
+      PhaseTimer timer(Phase::Output);
+      auto extracted = extractFunctions(*semantics, functions);
+      result.bitcode = writeBitcode(*extracted);
+    }
+    result.success = true;
+
+    // Keep the semantics module from growing with every job
+    for (auto function : functions) {
+      if (optimizer) {
+        optimizer->forget(function);
+      }
+      function->eraseFromParent();
+    }
+    BlockLifter::eraseUnusedDeclarations(*semantics);
+  }
+
+  size_t index = 0;
+  const Image &image;
+  const EngineOptions &options;
+  llvm::LLVMContext context;
+  remill::ArchPtr arch;
+  std::unique_ptr<llvm::Module> semantics;
+  std::unique_ptr<DecodeCache> decodeCache;
+  std::unique_ptr<IncrementalOptimizer> optimizer;
+};
+
+/// Link the bitcode of a successful job into output.
+bool linkResult(llvm::Module &output, const JobResult &result) {
+  llvm::MemoryBufferRef buffer(
+      llvm::StringRef(result.bitcode.data(), result.bitcode.size()),
+      "lifted");
+  auto part = llvm::parseBitcodeFile(buffer, output.getContext());
+  if (!part) {
+    llvm::errs() << "Failed to parse lifted bitcode: "
+                 << llvm::toString(part.takeError()) << "\n";
+    return false;
+  }
+  return linkExtracted(output, std::move(*part));
+}
+
+void printDecodeStats(const Worker &worker, size_t index,
+                      std::mutex &outputMutex) {
+  if (auto decodeCache = worker.getDecodeCache()) {
+    std::string stats;
+    llvm::raw_string_ostream os(stats);
+    decodeCache->printStats(os);
+    std::lock_guard<std::mutex> lock(outputMutex);
+    llvm::outs() << "[worker " << index << "] " << os.str();
+  }
+}
+
+} // namespace
+
+std::unique_ptr<llvm::Module>
+liftParallel(llvm::LLVMContext &context, const Image &image,
+             const std::vector<LiftRange> &ranges,
+             llvm::MemoryBufferRef semanticsBitcode,
+             const EngineOptions &options) {
+  auto numWorkers = std::max(1u, options.numWorkers);
+  WorkStealingQueue<size_t> queue(numWorkers);
+  for (size_t i = 0; i < ranges.size(); i++) {
+    queue.push(i % numWorkers, i);
+  }
+
+  // Every job writes to its own slot, so the results need no locking
+  std::vector<JobResult> results(ranges.size());
+  std::atomic<unsigned> numInitialized = 0;
+  std::mutex outputMutex;
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i < numWorkers; i++) {
+    threads.emplace_back([&, i] {
+      Worker worker(i, image, options);
+      if (!worker.initialize(semanticsBitcode)) {
+        return;
+      }
+      numInitialized++;
+      while (auto job = queue.pop(i)) {
+        results[*job] = worker.run(ranges[*job]);
+      }
+      printDecodeStats(worker, i, outputMutex);
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  if (numInitialized == 0) {
+    return nullptr;
+  }
+
+  auto output = std::make_unique<llvm::Module>("lifted", context);
+  size_t numInstructions = 0;
+  for (const auto &result : results) {
+    if (!result.success) {
+      continue;
+    }
+    if (!linkResult(*output, result)) {
+      return nullptr;
+    }
+    numInstructions += result.numInstructions;
+  }
+
+  llvm::outs() << "Lifted " << numInstructions << " instructions on "
+               << numWorkers << " workers\n";
+  return output;
+}
+
+std::unique_ptr<llvm::Module>
+liftFunctionsParallel(llvm::LLVMContext &context, const Image &image,
+                      const std::vector<uint64_t> &entries,
+                      llvm::MemoryBufferRef semanticsBitcode,
+                      const EngineOptions &options) {
+  auto numWorkers = std::max(1u, options.numWorkers);
+  WorkStealingQueue<uint64_t> queue(numWorkers);
+
+  // Every entry is queued once. The map is ordered by address, so linking
+  // does not depend on the scheduling.
+  std::mutex resultsMutex;
+  std::map<uint64_t, JobResult> results;
+  size_t numQueued = 0;
+  for (auto entry : entries) {
+    if (results.try_emplace(entry).second) {
+      queue.push(numQueued++ % numWorkers, entry);
+    }
+  }
+
+  // Jobs queued or running. A running job queues the callees it finds before
+  // it is done, so this only reaches zero when the call graph is exhausted.
+  // Both counters are guarded by resultsMutex, idle workers wait on
+  // jobsChanged for either to change.
+  size_t numPending = numQueued;
+  size_t numPushed = numQueued;
+  std::condition_variable jobsChanged;
+  std::atomic<unsigned> numInitialized = 0;
+  std::mutex outputMutex;
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i < numWorkers; i++) {
+    threads.emplace_back([&, i] {
+      Worker worker(i, image, options);
+      if (!worker.initialize(semanticsBitcode)) {
+        return;
+      }
+      numInitialized++;
+      while (true) {
+        size_t seenPushed = 0;
+        {
+          std::lock_guard<std::mutex> lock(resultsMutex);
+          if (numPending == 0) {
+            break;
+          }
+          seenPushed = numPushed;
+        }
+        auto job = queue.pop(i);
+        if (!job) {
+          // Other workers are still running jobs that might queue more
+          std::unique_lock<std::mutex> lock(resultsMutex);
+          jobsChanged.wait(lock, [&] {
+            return numPending == 0 || numPushed != seenPushed;
+          });
+          continue;
+        }
+
+        auto result = worker.runFunction(*job);
+        std::lock_guard<std::mutex> lock(resultsMutex);
+        if (options.followCalls) {
+          for (auto callee : result.callees) {
+            if (!image.bytesAt(callee).empty() &&
+                results.try_emplace(callee).second) {
+              numPending++;
+              numPushed++;
+              queue.push(i, callee);
+            }
+          }
+        }
+        results[*job] = std::move(result);
+        numPending--;
+        jobsChanged.notify_all();
+      }
+      printDecodeStats(worker, i, outputMutex);
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  if (numInitialized == 0) {
+    return nullptr;
+  }
+
+  auto output = std::make_unique<llvm::Module>("lifted", context);
+  size_t numInstructions = 0;
+  size_t numFunctions = 0;
+  size_t numFailed = 0;
+  for (const auto &[entry, result] : results) {
+    if (!result.success) {
+      numFailed++;
+      continue;
+    }
+    if (!linkResult(*output, result)) {
+      return nullptr;
+    }
+    numInstructions += result.numInstructions;
+    numFunctions++;
+  }
+
+  llvm::outs() << "Lifted " << numFunctions << " functions ("
+               << numInstructions << " instructions) on " << numWorkers
+               << " workers";
+  if (numFailed) {
+    llvm::outs() << ", " << numFailed << " failed";
+  }
+  llvm::outs() << "\n";
+  return output;
+}
+
+std::unique_ptr<llvm::Module>
+liftPipelined(llvm::LLVMContext &context, const Image &image,
+              const std::vector<LiftRange> &ranges,
+              llvm::MemoryBufferRef semanticsBitcode,
+              const EngineOptions &options) {
+  using Job = std::pair<size_t, JobResult>;
+  BoundedQueue<Job> lifted(options.queueCapacity);
+  BoundedQueue<Job> optimized(options.queueCapacity);
+  std::atomic<bool> liftFailed = false;
+  std::mutex outputMutex;
+
+  // Lift stage: decodes and lifts one range after the other
+  std::thread lifter([&] {
+    Worker worker(0, image, options);
+    if (worker.initialize(semanticsBitcode)) {
+      for (size_t i = 0; i < ranges.size(); i++) {
+        lifted.push({i, worker.run(ranges[i], /*optimize=*/false)});
+      }
+      printDecodeStats(worker, 0, outputMutex);
+    } else {
+      liftFailed = true;
+    }
+    lifted.close();
+  });
+
+  // Optimize stage: every thread parses jobs into its own context
+  auto numOptimizers = std::max(1u, options.numWorkers);
+  std::atomic<unsigned> numRunning = numOptimizers;
+  std::vector<std::thread> optimizers;
+  for (unsigned i = 0; i < numOptimizers; i++) {
+    optimizers.emplace_back([&, i] {
+      Worker worker(i + 1, image, options);
+      auto initialized =
+          worker.initialize(semanticsBitcode, /*optimizeOnly=*/true);
+      while (auto job = lifted.pop()) {
+        if (initialized && job->second.success) {
+          job->second = worker.optimize(job->second);
+        } else {
+          job->second.success = false;
+        }
+        optimized.push(std::move(*job));
+      }
+      if (--numRunning == 0) {
+        optimized.close();
+      }
+    });
+  }
+
+  // Output stage (this thread): links the jobs in the order of ranges
+  auto output = std::make_unique<llvm::Module>("lifted", context);
+  std::map<size_t, JobResult> pending;
+  size_t next = 0;
+  size_t numInstructions = 0;
+  auto linked = true;
+  while (auto job = optimized.pop()) {
+    pending.emplace(job->first, std::move(job->second));
+    for (auto found = pending.find(next); found != pending.end();
+         found = pending.find(++next)) {
+      const auto &result = found->second;
+      if (result.success && linked) {
+        PhaseTimer timer(Phase::Output);
+        linked = linkResult(*output, result);
+        numInstructions += result.numInstructions;
+      }
+      pending.erase(found);
+    }
+  }
+
+  lifter.join();
+  for (auto &thread : optimizers) {
+    thread.join();
+  }
+  if (liftFailed || !linked) {
+    return nullptr;
+  }
+
+  llvm::outs() << "Lifted " << numInstructions << " instructions through a "
+               << "pipeline with " << numOptimizers << " optimizer threads\n";
+  return output;
+}
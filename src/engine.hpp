@@ -0,0 +1,78 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "image.hpp"
+#include "optimizer.hpp"
+#include "semantics.hpp"
+
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+struct EngineOptions {
+  std::string os = "linux";
+  std::string arch = "amd64";
+  unsigned numWorkers = 1;
+  // Give every worker its own DecodeCache
+  bool decodeCache = false;
+  // Use an IncrementalOptimizer instead of remill::OptimizeModule
+  bool incrementalOptimizer = true;
+  // Pipeline of the incremental optimizer, pipelineText is for Custom
+  PipelinePreset pipeline = PipelinePreset::Default;
+  std::string pipelineText;
+  bool scalarizeState = false;
+  bool eliminateFlags = false;
+  bool freezeUndefined = false;
+  // Fold reads of the read-only segments of the image
+  bool foldConstantMemory = true;
+  // liftFunctionsParallel: also lift the targets of direct calls
+  bool followCalls = true;
+  // liftPipelined: jobs buffered between two stages
+  unsigned queueCapacity = 4;
+  SemanticsOptions semantics;
+};
+
+/// Lift ranges of an image on several worker threads.
+///
+/// Every worker owns its LLVMContext, remill::Arch and semantics module (parsed
+/// from semanticsBitcode) and pulls whole ranges from a work-stealing queue.
+/// The optimized functions of every range are extracted into bitcode and the
+/// results are linked into one module in the order of ranges, so the output
+/// does not depend on the scheduling.
+std::unique_ptr<llvm::Module>
+liftParallel(llvm::LLVMContext &context, const Image &image,
+             const std::vector<LiftRange> &ranges,
+             llvm::MemoryBufferRef semanticsBitcode,
+             const EngineOptions &options);
+
+/// Lift whole functions (see BlockLifter::liftFunction) on several worker
+/// threads, starting from entries.
+///
+/// The workers share one work-stealing queue of function entries. With
+/// followCalls, every lifted function queues the direct call targets that
+/// were not queued before and are mapped in the image, until the call graph
+/// is exhausted. The results are linked in the order of their entries.
+/// Functions that fail to lift are reported, counted and left out.
+std::unique_ptr<llvm::Module>
+liftFunctionsParallel(llvm::LLVMContext &context, const Image &image,
+                      const std::vector<uint64_t> &entries,
+                      llvm::MemoryBufferRef semanticsBitcode,
+                      const EngineOptions &options);
+
+/// Lift ranges of an image in a pipeline of stages that run concurrently.
+///
+/// One thread lifts the ranges in order without optimizing them (decoding
+/// and lifting stay in one stage, because remill instructions are bound to
+/// the Arch and context that lift them). numWorkers threads optimize the
+/// lifted jobs, each in its own LLVMContext, and the calling thread links the
+/// results in the order of ranges. The stages are connected by BoundedQueues
+/// of queueCapacity jobs, so a fast stage waits for a slow one instead of
+/// buffering the whole image.
+std::unique_ptr<llvm::Module>
+liftPipelined(llvm::LLVMContext &context, const Image &image,
+              const std::vector<LiftRange> &ranges,
+              llvm::MemoryBufferRef semanticsBitcode,
+              const EngineOptions &options);
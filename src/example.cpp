@@ -1,8 +1,23 @@
 #include <cstdlib>
 #include <filesystem>
+#include <set>
 
+#include "cluster.hpp"
+#include "engine.hpp"
 #include "exepath.hpp"
+#include "extract.hpp"
+#include "guest.hpp"
+#include "image.hpp"
+#include "jit.hpp"
+#include "lifter.hpp"
+#include "metrics.hpp"
+#include "profile.hpp"
+#include "optimizer.hpp"
+#include "output.hpp"
+#include "semantics.hpp"
+#include "tcache.hpp"
 
+#include <gflags/gflags.h>
 #include <glog/logging.h>
 
 #include <remill/Arch/Arch.h>
@@ -19,74 +34,498 @@
 
 #include <llvm/Demangle/Demangle.h>
 #include <llvm/IR/PassManager.h>
-#include <llvm/IRReader/IRReader.h>
-#include <llvm/Linker/Linker.h>
 #include <llvm/Passes/PassBuilder.h>
-#include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
 #include <llvm/Transforms/IPO/GlobalDCE.h>
 
-/// Hotpatch remill semantics by loading a bitcode module and linking it.
-///
-/// Remill instruction selection works via ISEL_* global variables that point to
-/// semantic functions. For example, ISEL_CPUID points to the function that
-/// implements the CPUID instruction.
+DEFINE_string(image, "", "Raw binary image to lift in batch mode");
+DEFINE_uint64(image_base, 0, "Guest address of the first byte of --image");
+DEFINE_string(image_format, "raw",
+              "Format of --image: raw (mapped at --image_base) or object "
+              "(ELF, PE/COFF or Mach-O, sections mapped at their addresses)");
+DEFINE_string(read_only, "",
+              "Comma separated begin-end ranges of a raw --image the guest "
+              "cannot write to (object images carry their permissions)");
+DEFINE_bool(fold_constant_memory, true,
+            "Fold reads of read-only image memory at constant addresses "
+            "(incremental optimizer)");
+DEFINE_string(ranges, "",
+              "Comma separated entry addresses or begin-end ranges to lift "
+              "from --image (entries lift a single basic block)");
+DEFINE_bool(functions, false,
+            "Lift the --ranges entries as whole functions, one LLVM function "
+            "per guest function with a basic block per guest block");
+DEFINE_bool(follow_calls, true,
+            "With --functions, also lift the targets of direct calls");
+DEFINE_string(nodes, "",
+              "Comma separated remill-server addresses to lift --functions "
+              "on (the nodes open --image themselves)");
+DEFINE_uint64(functions_per_shard, 64,
+              "Functions every --nodes request lifts");
+DEFINE_uint32(shard_attempts, 3,
+              "Times a shard is sent to --nodes before it is given up");
+DEFINE_string(semantics_cache, "",
+              "Directory to cache the hotpatched semantics module in "
+              "(disabled when empty)");
+DEFINE_bool(lazy_semantics, false,
+            "Only materialize the semantic functions used by lifted code");
+DEFINE_uint32(workers, 1,
+              "Number of worker threads lifting --image (each with its own "
+              "LLVMContext and semantics)");
+DEFINE_bool(pipelined, false,
+            "Lift --image on one thread and optimize on --workers threads, "
+            "connected by bounded queues");
+DEFINE_uint32(queue_capacity, 4,
+              "Number of jobs --pipelined buffers between two stages");
+DEFINE_string(optimizer, "module",
+              "How lifted functions are optimized: incremental (only the new "
+              "function and the semantics it uses) or module "
+              "(remill::OptimizeModule)");
+DEFINE_string(pipeline, "default",
+              "Pipeline of the incremental optimizer: default, fast, "
+              "deobfuscate or custom (see --pipeline_text)");
+DEFINE_string(pipeline_text, "",
+              "New pass manager function pipeline for --pipeline=custom, e.g. "
+              "sroa,instcombine,dse");
+DEFINE_bool(scalarize_state, false,
+            "Promote the State accesses of lifted functions to SSA values "
+            "before the incremental optimizer's pipeline");
+DEFINE_bool(freeze_undefined, false,
+            "Lower undefined values (__remill_undefined_*) to freeze poison "
+            "in the incremental optimizer");
+DEFINE_bool(eliminate_flags, false,
+            "Remove flag computations of lifted functions that are "
+            "overwritten before they are read (incremental optimizer)");
+DEFINE_bool(decode_cache, false,
+            "Cache decoded instructions by their bytes and decoding context");
+DEFINE_string(output_dir, "",
+              "Stream every lifted function of --image as bitcode into this "
+              "directory and drop it from memory once it is written");
+DEFINE_string(metrics, "",
+              "Write phase timings and counters to this file at exit (- for "
+              "stdout, disabled when empty)");
+DEFINE_string(metrics_format, "json",
+              "Format of --metrics: json or prometheus");
+DEFINE_string(isel_profile, "",
+              "Add how often every ISEL_* semantic was lifted and what "
+              "optimizing it cost to this JSON report at exit (disabled when "
+              "empty)");
+DEFINE_bool(execute, false,
+            "Run --image natively with the JIT, lifting blocks on demand "
+            "instead of lifting --ranges");
+DEFINE_uint64(entry, 0,
+              "Guest address to start executing at (defaults to the first "
+              "range)");
+DEFINE_uint64(memory_size, 64,
+              "Size of the guest memory window at --image_base in MiB, the "
+              "stack starts at its end");
+DEFINE_uint64(max_blocks, 1000000, "Maximum number of blocks to execute");
+DEFINE_string(helpers, "",
+              "RemillHelpers.bc implementing the memory model for --execute "
+              "(defaults to the one built by the helpers target)");
+DEFINE_string(helpers_profile, "execution",
+              "Build profile --helpers defaults to: execution (vectorized and "
+              "tuned for the host CPU) or analysis (scalar, as linked for "
+              "analysis)");
+DEFINE_bool(memory_regions, false,
+            "Default --helpers to the regions flavor, which tells the "
+            "optimizer stack and image accesses do not alias");
+DEFINE_uint32(sandbox_bits, 0,
+              "Reserve a 2^N byte guest address space with guard pages and "
+              "default --helpers to the masked flavor, which wraps addresses "
+              "to N bits (0 disables the sandbox, must match "
+              "HELPERS_SANDBOX_BITS)");
+DEFINE_uint64(hot_threshold, 1000,
+              "Executions after which a quickly compiled block is lifted "
+              "again as a trace with the full pipeline (0 fully optimizes "
+              "every block right away)");
+DEFINE_string(object_cache, "",
+              "Directory to cache the object code compiled by --execute in "
+              "(disabled when empty)");
+DEFINE_uint64(shard_size, 64,
+              "Maximum size of a bitcode shard in --output_dir in MiB (0 "
+              "writes one file per function)");
+
+/// Lift ranges one block at a time and move every optimized function out of
+/// the semantics module as soon as it is done.
 ///
-/// To hotpatch an instruction:
-/// 1. Create a .cpp file with the remill runtime headers
-/// 2. Define a semantic function using DEF_SEM(name) { ... }
-/// 3. Register it with DEF_ISEL(INSTRUCTION_NAME) = semantic_function;
-/// 4. Compile to bitcode and link into the semantics module
+/// The function is cloned into its own module together with the definitions it
+/// still references, written to output and erased, so memory stays bounded by
+/// the semantics module instead of growing with the number of blocks.
+static bool liftAndDrop(const remill::Arch *arch, llvm::Module *semantics,
+                        BlockLifter &lifter, const Image &image,
+                        const std::vector<LiftRange> &ranges,
+                        IncrementalOptimizer *optimizer,
+                        LiftedOutput &output) {
+  size_t numFunctions = 0;
+  size_t numInstructions = 0;
+  for (const auto &range : ranges) {
+    auto success =
+        lifter.liftRange(image, range, [&](const LiftedBlock &block) {
+          auto function = block.function;
+          optimizeLifted(arch, semantics, {function}, optimizer);
+          PhaseTimer timer(Phase::Output);
+          auto extracted = extractFunctions(*semantics, {function});
+          if (!output.write(block.address, *extracted)) {
+            return false;
+          }
+
+          if (optimizer) {
+            optimizer->forget(function);
+          }
+          function->eraseFromParent();
+          numFunctions++;
+          numInstructions += block.numInstructions;
+          return true;
+        });
+    if (!success) {
+      return false;
+    }
+  }
+
+  if (!output.finish()) {
+    return false;
+  }
+  if (numFunctions == 0) {
+    llvm::errs() << "Nothing was lifted\n";
+    return false;
+  }
+  llvm::outs() << "Lifted " << numInstructions << " instructions into "
+               << numFunctions << " functions\n";
+  return true;
+}
+
+/// Run the image with the JIT from entry on a fresh State. Blocks are lifted
+/// from guest memory as execution reaches them, until one fails to lift.
+static bool executeImage(const remill::Arch *arch, llvm::Module *semantics,
+                         const Image &image, IncrementalOptimizer *optimizer,
+                         uint64_t entry) {
+  if (FLAGS_sandbox_bits && FLAGS_memory_regions) {
+    llvm::errs() << "--sandbox_bits cannot be combined with --memory_regions\n";
+    return false;
+  }
+  auto memory = FLAGS_sandbox_bits
+                    ? GuestMemory::createSandboxed(FLAGS_image_base,
+                                                   FLAGS_memory_size << 20,
+                                                   FLAGS_sandbox_bits)
+                    : GuestMemory::create(FLAGS_image_base,
+                                          FLAGS_memory_size << 20);
+  if (!memory) {
+    return false;
+  }
+  memory->load(image);
+
+  std::filesystem::path helpersPath = FLAGS_helpers;
+  if (helpersPath.empty()) {
+    helpersPath = executableDir() / "helpers/x86_64";
+    if (FLAGS_helpers_profile == "execution") {
+      helpersPath /= "execution";
+    } else if (FLAGS_helpers_profile != "analysis") {
+      llvm::errs() << "Unknown helpers profile: " << FLAGS_helpers_profile
+                   << "\n";
+      return false;
+    }
+    if (FLAGS_sandbox_bits) {
+      helpersPath /= "RemillHelpers-masked.bc";
+    } else if (FLAGS_memory_regions) {
+      helpersPath /= "RemillHelpers-regions.bc";
+    } else {
+      helpersPath /= "RemillHelpers.bc";
+    }
+  }
+  auto executor =
+      JitExecutor::create(arch, helpersPath, *memory, FLAGS_object_cache);
+  if (!executor) {
+    return false;
+  }
+  if (executor->hasMemoryRegions()) {
+    std::vector<AddressRange> ranges;
+    for (const auto &segment : image.getSegments()) {
+      ranges.push_back({segment.address, segment.end()});
+    }
+    executor->setImageRanges(std::move(ranges));
+  }
+  auto cache = TranslationCache::create(arch, semantics, *executor, *memory,
+                                        optimizer);
+  if (!cache) {
+    return false;
+  }
+  cache->setHotThreshold(FLAGS_hot_threshold);
+
+  GuestState state(arch);
+  state.setPc(entry);
+  auto stackPointer = arch->StackPointerRegisterName();
+  state.write(stackPointer, memory->getBase() + memory->getSize() - 0x10);
+
+  auto numBlocks = cache->run(state, FLAGS_max_blocks);
+  llvm::outs() << "Translated " << cache->getNumTranslated() << " blocks ("
+               << cache->getNumInvalidated() << " invalidated by writes, "
+               << cache->getNumPromoted() << " hot traces)\n";
+  llvm::outs() << "Executed " << numBlocks << " blocks, stopped at "
+               << llvm::format_hex(state.getPc(), 1) << " ("
+               << stackPointer << " = "
+               << llvm::format_hex(state.read(stackPointer).value_or(0), 1)
+               << ")\n";
+  if (auto objectCache = executor->getObjectCache()) {
+    objectCache->printStats(llvm::outs());
+  }
+  return true;
+}
+
+/// Lift all the requested ranges of a memory-mapped image.
 ///
-/// See helpers/x86_64/RemillHotpatch.cpp for an example.
-static bool hotpatchRemill(llvm::Module &module,
-                           const std::string &hotpatchPath) {
-  if (!std::filesystem::exists(hotpatchPath)) {
-    llvm::errs() << "Hotpatch file not found: " << hotpatchPath << "\n";
+/// Ranges are split into basic blocks, each lifted into its own function named
+/// after its guest address. All the blocks are optimized in a single call.
+static bool liftImage(const remill::Arch *arch, llvm::Module *semantics,
+                      const SemanticsOptions &semanticsOptions,
+                      IncrementalOptimizer *optimizer) {
+  std::unique_ptr<Image> image;
+  if (FLAGS_image_format == "raw") {
+    image = Image::open(FLAGS_image, FLAGS_image_base);
+  } else if (FLAGS_image_format == "object") {
+    image = Image::openObject(FLAGS_image);
+  } else {
+    llvm::errs() << "Unknown image format: " << FLAGS_image_format << "\n";
+    return false;
+  }
+  if (!image) {
     return false;
   }
 
-  llvm::SMDiagnostic error;
-  auto patchModule =
-      llvm::parseIRFile(hotpatchPath, error, module.getContext());
-  if (!patchModule) {
-    llvm::errs() << "Failed to parse hotpatch module: " << error.getMessage()
-                 << "\n";
+  std::vector<LiftRange> readOnly;
+  if (!parseLiftRanges(FLAGS_read_only, readOnly)) {
     return false;
   }
+  for (const auto &range : readOnly) {
+    if (range.end == 0) {
+      llvm::errs() << "--read_only needs begin-end ranges\n";
+      return false;
+    }
+    image->setReadOnly(range.begin, range.end);
+  }
+  if (optimizer && FLAGS_fold_constant_memory) {
+    optimizer->setConstantMemory(image.get());
+  }
+
+  std::vector<LiftRange> ranges;
+  if (!parseLiftRanges(FLAGS_ranges, ranges) || ranges.empty()) {
+    llvm::errs() << "No ranges to lift, use --ranges\n";
+    return false;
+  }
+
+  if (FLAGS_execute) {
+    if (!FLAGS_output_dir.empty()) {
+      llvm::errs() << "--execute cannot be combined with --output_dir\n";
+      return false;
+    }
+    auto entry = FLAGS_entry ? FLAGS_entry : ranges.front().begin;
+    return executeImage(arch, semantics, *image, optimizer, entry);
+  }
+
+  if (!FLAGS_nodes.empty()) {
+    if (!FLAGS_functions || !FLAGS_output_dir.empty()) {
+      llvm::errs() << "--nodes requires --functions and no --output_dir\n";
+      return false;
+    }
+    ClusterOptions options;
+    llvm::SmallVector<llvm::StringRef, 8> nodes;
+    llvm::StringRef(FLAGS_nodes).split(nodes, ',', -1, false);
+    for (auto node : nodes) {
+      options.nodes.push_back(node.trim().str());
+    }
+    options.arch = remill::GetArchName(arch->arch_name);
+    options.imageFormat = FLAGS_image_format;
+    options.imageBase = FLAGS_image_base;
+    options.imagePath = std::filesystem::absolute(FLAGS_image).string();
+    options.shardSize = FLAGS_functions_per_shard;
+    options.maxAttempts = FLAGS_shard_attempts;
+    options.followCalls = FLAGS_follow_calls;
+
+    std::vector<uint64_t> entries;
+    for (const auto &range : ranges) {
+      entries.push_back(range.begin);
+    }
+    auto lifted =
+        liftFunctionsDistributed(*arch->context, *image, entries, options);
+    if (!lifted) {
+      return false;
+    }
+    PhaseTimer timer(Phase::Output);
+    lifted->print(llvm::outs(), nullptr);
+    return true;
+  }
+
+  if (FLAGS_workers > 1 || FLAGS_pipelined) {
+    if (!FLAGS_output_dir.empty()) {
+      llvm::errs() << "--output_dir is not supported with --workers\n";
+      return false;
+    }
+    if (FLAGS_pipelined && FLAGS_functions) {
+      llvm::errs() << "--pipelined cannot be combined with --functions\n";
+      return false;
+    }
+    auto bitcode = semanticsBitcode(arch, *semantics, semanticsOptions);
+    if (!bitcode) {
+      return false;
+    }
+
+    EngineOptions options;
+    options.os = remill::GetOSName(arch->os_name);
+    options.arch = remill::GetArchName(arch->arch_name);
+    options.numWorkers = FLAGS_workers;
+    options.decodeCache = FLAGS_decode_cache;
+    options.incrementalOptimizer = optimizer != nullptr;
+    if (optimizer) {
+      options.pipeline = optimizer->getPipeline();
+      options.pipelineText = FLAGS_pipeline_text;
+      options.scalarizeState = FLAGS_scalarize_state;
+      options.eliminateFlags = FLAGS_eliminate_flags;
+      options.freezeUndefined = FLAGS_freeze_undefined;
+      options.foldConstantMemory = FLAGS_fold_constant_memory;
+    }
+    options.semantics = semanticsOptions;
+    options.followCalls = FLAGS_follow_calls;
+    options.queueCapacity = FLAGS_queue_capacity;
+    std::unique_ptr<llvm::Module> lifted;
+    if (FLAGS_functions) {
+      std::vector<uint64_t> entries;
+      for (const auto &range : ranges) {
+        entries.push_back(range.begin);
+      }
+      lifted = liftFunctionsParallel(*arch->context, *image, entries,
+                                     bitcode->getMemBufferRef(), options);
+    } else if (FLAGS_pipelined) {
+      lifted = liftPipelined(*arch->context, *image, ranges,
+                             bitcode->getMemBufferRef(), options);
+    } else {
+      lifted = liftParallel(*arch->context, *image, ranges,
+                            bitcode->getMemBufferRef(), options);
+    }
+    if (!lifted) {
+      return false;
+    }
+    PhaseTimer timer(Phase::Output);
+    lifted->print(llvm::outs(), nullptr);
+    return true;
+  }
+
+  BlockLifter lifter(arch, semantics);
+  std::unique_ptr<DecodeCache> decodeCache;
+  if (FLAGS_decode_cache) {
+    decodeCache = std::make_unique<DecodeCache>(arch);
+    lifter.setDecodeCache(decodeCache.get());
+  }
 
-  // Prepare the patch module to be compatible with the semantics module
-  patchModule->setDataLayout(module.getDataLayout());
-  patchModule->setTargetTriple(module.getTargetTriple());
-
-  // Rename existing ISEL_ globals to avoid conflicts during linking
-  // The hotpatch module's ISEL_ globals will take precedence
-  for (const auto &global : patchModule->globals()) {
-    const auto &globalName = global.getName().str();
-    // Check if this is a hotpatch ISEL global variable
-    if (globalName.rfind("ISEL_", 0) == 0) {
-      // Find and rename the existing global in the semantics module
-      auto *existingGlobal = module.getGlobalVariable(globalName);
-      if (existingGlobal) {
-        existingGlobal->setName(globalName + "_original");
-        llvm::outs() << "Hotpatching: " << globalName << "\n";
+  if (!FLAGS_output_dir.empty()) {
+    if (FLAGS_functions) {
+      llvm::errs() << "--functions is not supported with --output_dir\n";
+      return false;
+    }
+    std::unique_ptr<LiftedOutput> output;
+    if (FLAGS_shard_size == 0) {
+      output = std::make_unique<DirectoryOutput>(FLAGS_output_dir);
+    } else {
+      output = std::make_unique<ShardedOutput>(FLAGS_output_dir,
+                                               FLAGS_shard_size << 20);
+    }
+    return liftAndDrop(arch, semantics, lifter, *image, ranges, optimizer,
+                       *output);
+  }
+
+  std::vector<llvm::Function *> functions;
+  size_t numInstructions = 0;
+  if (FLAGS_functions) {
+    // Recursive descent over the call graph, every entry is lifted once
+    std::vector<uint64_t> worklist;
+    std::set<uint64_t> queued;
+    for (auto it = ranges.rbegin(); it != ranges.rend(); ++it) {
+      if (queued.insert(it->begin).second) {
+        worklist.push_back(it->begin);
+      }
+    }
+    while (!worklist.empty()) {
+      auto entry = worklist.back();
+      worklist.pop_back();
+      auto lifted = lifter.liftFunction(*image, entry);
+      if (!lifted.function) {
+        continue;
+      }
+      functions.push_back(lifted.function);
+      numInstructions += lifted.numInstructions;
+      if (!FLAGS_follow_calls) {
+        continue;
+      }
+      for (auto callee : lifted.callees) {
+        if (!image->bytesAt(callee).empty() && queued.insert(callee).second) {
+          worklist.push_back(callee);
+        }
+      }
+    }
+  } else {
+    for (const auto &range : ranges) {
+      for (const auto &block : lifter.liftRange(*image, range)) {
+        functions.push_back(block.function);
+        numInstructions += block.numInstructions;
       }
     }
   }
 
-  // Link the hotpatch module into the semantics module
-  // OverrideFromSrc ensures the hotpatch definitions take precedence
-  if (llvm::Linker::linkModules(module, std::move(patchModule),
-                                llvm::Linker::Flags::OverrideFromSrc)) {
-    llvm::errs() << "Failed to link hotpatch module\n";
+  if (functions.empty()) {
+    llvm::errs() << "Nothing was lifted\n";
     return false;
   }
 
+  llvm::outs() << "Lifted " << numInstructions << " instructions into "
+               << functions.size() << " functions\n";
+  if (decodeCache) {
+    decodeCache->printStats(llvm::outs());
+  }
+
+  optimizeLifted(arch, semantics, functions, optimizer);
+  PhaseTimer timer(Phase::Output);
+  for (auto function : functions) {
+    function->print(llvm::outs());
+  }
   return true;
 }
 
+/// Export the metrics to --metrics, registered with atexit.
+static void writeMetrics() {
+  auto format = FLAGS_metrics_format == "prometheus" ? MetricsFormat::Prometheus
+                                                     : MetricsFormat::Json;
+  std::error_code ec;
+  llvm::raw_fd_ostream os(FLAGS_metrics, ec, llvm::sys::fs::OF_Text);
+  if (ec) {
+    llvm::errs() << "Failed to open " << FLAGS_metrics << ": " << ec.message()
+                 << "\n";
+    return;
+  }
+  Metrics::write(os, format);
+}
+
+/// Export the ISEL profile to --isel_profile, registered with atexit.
+static void writeIselProfile() { IselProfile::write(FLAGS_isel_profile); }
+
 int main(int argc, char **argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
   google::InitGoogleLogging(argv[0]);
 
+  if (!FLAGS_metrics.empty()) {
+    if (FLAGS_metrics_format != "json" &&
+        FLAGS_metrics_format != "prometheus") {
+      llvm::outs() << "Unknown metrics format: " << FLAGS_metrics_format
+                   << "\n";
+      return EXIT_FAILURE;
+    }
+    Metrics::enable();
+    std::atexit(writeMetrics);
+  }
+  if (!FLAGS_isel_profile.empty()) {
+    IselProfile::enable();
+    std::atexit(writeIselProfile);
+  }
+
   llvm::LLVMContext context;
   auto arch = remill::Arch::Get(context, "linux", "amd64");
   if (!arch) {
@@ -94,12 +533,6 @@ int main(int argc, char **argv) {
     return EXIT_FAILURE;
   }
 
-  auto semantics = remill::LoadArchSemantics(arch.get());
-  if (!semantics) {
-    llvm::outs() << "Failed to load architecture semantics\n";
-    return EXIT_FAILURE;
-  }
-
   // Apply hotpatch to remill semantics
   // The hotpatch module is built by the helpers target
   // (helpers/x86_64/RemillHotpatch.cpp) It provides custom implementations for
@@ -109,14 +542,14 @@ int main(int argc, char **argv) {
     hotpatchPath = argv[1];
   }
 
-  if (std::filesystem::exists(hotpatchPath)) {
-    llvm::outs() << "Applying hotpatch from: " << hotpatchPath.string() << "\n";
-    if (!hotpatchRemill(*semantics, hotpatchPath.string())) {
-      llvm::outs() << "Warning: Failed to apply hotpatch\n";
-    }
-  } else {
-    llvm::outs() << "No hotpatch file found at: " << hotpatchPath.string()
-                 << "\n";
+  SemanticsOptions semanticsOptions;
+  semanticsOptions.hotpatchPath = hotpatchPath;
+  semanticsOptions.cacheDir = FLAGS_semantics_cache;
+  semanticsOptions.lazy = FLAGS_lazy_semantics;
+  auto semantics = loadSemantics(arch.get(), semanticsOptions);
+  if (!semantics) {
+    llvm::outs() << "Failed to load architecture semantics\n";
+    return EXIT_FAILURE;
   }
 
   auto intrinsics = arch->GetInstrinsicTable();
@@ -125,6 +558,49 @@ int main(int argc, char **argv) {
     return EXIT_FAILURE;
   }
 
+  auto pipeline = parsePipelinePreset(FLAGS_pipeline);
+  if (!pipeline) {
+    llvm::outs() << "Unknown pipeline: " << FLAGS_pipeline << "\n";
+    return EXIT_FAILURE;
+  }
+
+  std::unique_ptr<IncrementalOptimizer> optimizer;
+  if (FLAGS_optimizer == "incremental") {
+    optimizer = std::make_unique<IncrementalOptimizer>();
+    if (!optimizer->setPipeline(*pipeline, FLAGS_pipeline_text)) {
+      return EXIT_FAILURE;
+    }
+    optimizer->setScalarizeState(FLAGS_scalarize_state);
+    optimizer->setFreezeUndefined(FLAGS_freeze_undefined);
+    if (FLAGS_eliminate_flags) {
+      optimizer->setFlagElimination(arch.get());
+    }
+  } else if (FLAGS_optimizer != "module") {
+    llvm::outs() << "Unknown optimizer: " << FLAGS_optimizer << "\n";
+    return EXIT_FAILURE;
+  } else if (FLAGS_lazy_semantics) {
+    llvm::outs() << "--lazy_semantics requires --optimizer=incremental\n";
+    return EXIT_FAILURE;
+  } else if (*pipeline != PipelinePreset::Default) {
+    llvm::outs() << "--pipeline requires --optimizer=incremental\n";
+    return EXIT_FAILURE;
+  }
+
+  // Compile time and IR size of the pipeline, on stderr so the lifted code
+  // on stdout stays clean
+  auto printOptimizerStats = [&optimizer] {
+    if (optimizer && optimizer->getStats().numFunctions) {
+      optimizer->printStats(llvm::errs());
+    }
+  };
+
+  if (!FLAGS_image.empty()) {
+    auto success = liftImage(arch.get(), semantics.get(), semanticsOptions,
+                             optimizer.get());
+    printOptimizerStats();
+    return success ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
   // Example 1: Lift a simple instruction (mov rcx, 1337)
   llvm::outs() << "\n=== Lifting: mov rcx, 1337 ===\n";
   {
@@ -150,8 +626,9 @@ int main(int argc, char **argv) {
 
     llvm::IRBuilder<> ir(block);
     ir.CreateRet(remill::LoadMemoryPointer(block, *intrinsics));
+    materializeSemantics(function);
 
-    remill::OptimizeModule(arch.get(), semantics.get(), {function});
+    optimizeLifted(arch.get(), semantics.get(), {function}, optimizer.get());
     llvm::outs() << "[optimized]\n";
     function->print(llvm::outs());
   }
@@ -181,15 +658,17 @@ int main(int argc, char **argv) {
 
     llvm::IRBuilder<> ir(block);
     ir.CreateRet(remill::LoadMemoryPointer(block, *intrinsics));
+    materializeSemantics(function);
 
     // Print unoptimized to see the hotpatched implementation
     llvm::outs() << "[unoptimized]\n";
     function->print(llvm::outs());
 
-    remill::OptimizeModule(arch.get(), semantics.get(), {function});
+    optimizeLifted(arch.get(), semantics.get(), {function}, optimizer.get());
     llvm::outs() << "\n[optimized]\n";
     function->print(llvm::outs());
   }
 
+  printOptimizerStats();
   return EXIT_SUCCESS;
 }
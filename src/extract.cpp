@@ -0,0 +1,125 @@
+#include "extract.hpp"
+
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/PassManager.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/IPO/GlobalDCE.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Transforms/Utils/ValueMapper.h>
+
+/// Collect the global values referenced (possibly through constant
+/// expressions) by value.
+static void
+collectReferences(const llvm::Value *value,
+                  llvm::SmallPtrSetImpl<const llvm::Value *> &seen,
+                  llvm::SmallVectorImpl<const llvm::GlobalValue *> &worklist) {
+  if (!seen.insert(value).second) {
+    return;
+  }
+  if (auto global = llvm::dyn_cast<llvm::GlobalValue>(value)) {
+    worklist.push_back(global);
+    return;
+  }
+  if (auto constant = llvm::dyn_cast<llvm::Constant>(value)) {
+    for (const auto &operand : constant->operands()) {
+      collectReferences(operand, seen, worklist);
+    }
+  }
+}
+
+std::unique_ptr<llvm::Module>
+extractFunctions(llvm::Module &module,
+                 const std::vector<llvm::Function *> &functions) {
+  // Find all the definitions the functions transitively depend on
+  llvm::SmallPtrSet<const llvm::Value *, 64> seen;
+  llvm::SmallVector<const llvm::GlobalValue *, 64> worklist;
+  llvm::SmallPtrSet<const llvm::GlobalValue *, 64> definitions;
+  for (auto function : functions) {
+    collectReferences(function, seen, worklist);
+  }
+  while (!worklist.empty()) {
+    auto global = worklist.pop_back_val();
+    if (global->isDeclaration() || !definitions.insert(global).second) {
+      continue;
+    }
+    if (auto function = llvm::dyn_cast<llvm::Function>(global)) {
+      for (const auto &instruction : llvm::instructions(*function)) {
+        for (const auto &operand : instruction.operands()) {
+          if (llvm::isa<llvm::Constant>(operand)) {
+            collectReferences(operand, seen, worklist);
+          }
+        }
+      }
+    } else if (auto variable = llvm::dyn_cast<llvm::GlobalVariable>(global)) {
+      collectReferences(variable->getInitializer(), seen, worklist);
+    }
+  }
+
+  llvm::ValueToValueMapTy vmap;
+  auto extracted =
+      llvm::CloneModule(module, vmap, [&](const llvm::GlobalValue *global) {
+        return definitions.count(global) != 0;
+      });
+
+  // The lifted functions are the roots, keep them alive through GlobalDCE
+  for (auto function : functions) {
+    llvm::Value *clone = vmap[function];
+    llvm::cast<llvm::Function>(clone)->setLinkage(
+        llvm::GlobalValue::ExternalLinkage);
+  }
+
+  llvm::LoopAnalysisManager lam;
+  llvm::FunctionAnalysisManager fam;
+  llvm::CGSCCAnalysisManager cgam;
+  llvm::ModuleAnalysisManager mam;
+  llvm::PassBuilder pb;
+  pb.registerModuleAnalyses(mam);
+  pb.registerCGSCCAnalyses(cgam);
+  pb.registerFunctionAnalyses(fam);
+  pb.registerLoopAnalyses(lam);
+  pb.crossRegisterProxies(lam, fam, cgam, mam);
+  llvm::GlobalDCEPass().run(*extracted, mam);
+  return extracted;
+}
+
+llvm::SmallVector<char, 0> writeBitcode(const llvm::Module &module) {
+  llvm::SmallVector<char, 0> bitcode;
+  llvm::raw_svector_ostream os(bitcode);
+  llvm::WriteBitcodeToFile(module, os);
+  return bitcode;
+}
+
+bool linkExtracted(llvm::Module &output, std::unique_ptr<llvm::Module> part) {
+  for (auto &function : *part) {
+    if (function.isDeclaration() || function.hasLocalLinkage()) {
+      continue;
+    }
+    auto existing = output.getFunction(function.getName());
+    if (existing && !existing->isDeclaration()) {
+      function.deleteBody();
+    }
+  }
+  for (auto &global : part->globals()) {
+    if (global.isDeclaration() || global.hasLocalLinkage()) {
+      continue;
+    }
+    auto existing = output.getNamedGlobal(global.getName());
+    if (existing && !existing->isDeclaration()) {
+      global.setInitializer(nullptr);
+      global.setLinkage(llvm::GlobalValue::ExternalLinkage);
+      global.setComdat(nullptr);
+    }
+  }
+
+  if (llvm::Linker::linkModules(output, std::move(part))) {
+    llvm::errs() << "Failed to link lifted module\n";
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Module.h>
+
+/// Clone functions and their transitive dependencies into a new module.
+///
+/// Only the definitions reachable from functions are cloned, everything else
+/// in the source module (usually thousands of unused semantic functions) is
+/// removed with GlobalDCE. The result is self-contained: it can be serialized,
+/// linked into another module or compiled on its own.
+std::unique_ptr<llvm::Module>
+extractFunctions(llvm::Module &module,
+                 const std::vector<llvm::Function *> &functions);
+
+/// Serialize a module to bitcode in memory.
+llvm::SmallVector<char, 0> writeBitcode(const llvm::Module &module);
+
+/// Link an extracted module into output.
+///
+/// Functions and global variables that output already defines are turned into
+/// declarations in part first, so linking overlapping results keeps the first
+/// definition.
+bool linkExtracted(llvm::Module &output, std::unique_ptr<llvm::Module> part);
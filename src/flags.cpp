@@ -0,0 +1,183 @@
+#include "flags.hpp"
+#include "metrics.hpp"
+#include "scalarize.hpp"
+
+#include <vector>
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/IR/CFG.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/ValueHandle.h>
+#include <llvm/Transforms/Utils/Local.h>
+
+static const char kFlagComputationPrefix[] = "__remill_flag_computation_";
+
+// Arithmetic flags of x86/amd64 and aarch64, names the architecture does not
+// have are skipped
+static const char *const kFlagRegisters[] = {
+    "CF", "PF", "AF", "ZF", "SF", "OF", "N", "Z", "C", "V",
+};
+
+// One bit per flag
+using FlagMask = uint32_t;
+
+static bool isFlagComputation(const llvm::Instruction &instruction) {
+  auto call = llvm::dyn_cast<llvm::CallInst>(&instruction);
+  auto callee = call ? call->getCalledFunction() : nullptr;
+  return callee &&
+         callee->getName().str().rfind(kFlagComputationPrefix, 0) == 0;
+}
+
+FlagEliminationPass::FlagEliminationPass(const remill::Arch *arch) {
+  for (auto name : kFlagRegisters) {
+    auto reg = arch->RegisterByName(name);
+    if (!reg || flags.size() == sizeof(FlagMask) * 8) {
+      continue;
+    }
+    auto duplicate = llvm::any_of(flags, [reg](const Flag &flag) {
+      return flag.offset == reg->offset;
+    });
+    if (!duplicate) {
+      flags.push_back({reg->offset, reg->size});
+    }
+  }
+}
+
+llvm::PreservedAnalyses
+FlagEliminationPass::run(llvm::Function &function,
+                         llvm::FunctionAnalysisManager &fam) {
+  if (flags.empty() || function.isDeclaration() || function.arg_empty() ||
+      !function.getArg(0)->getType()->isPointerTy()) {
+    return llvm::PreservedAnalyses::all();
+  }
+
+  llvm::SmallVector<llvm::WeakTrackingVH, 32> dead;
+  std::vector<StateAccess> accesses;
+  llvm::SmallPtrSet<llvm::CallInst *, 8> calls;
+  const auto &dataLayout = function.getParent()->getDataLayout();
+  uint64_t numDeadStores = 0;
+  if (collectStateAccesses(function.getArg(0), dataLayout, accesses, calls)) {
+    // What every instruction does to the flags: the flags it reads and the
+    // flag (index) it overwrites as a whole
+    struct Effect {
+      FlagMask reads = 0;
+      int writes = -1;
+    };
+    const auto allFlags =
+        static_cast<FlagMask>((uint64_t(1) << flags.size()) - 1);
+    llvm::DenseMap<const llvm::Instruction *, Effect> effects;
+    for (const auto &access : accesses) {
+      Effect effect;
+      for (unsigned i = 0; i < flags.size(); i++) {
+        const auto &flag = flags[i];
+        if (access.offset >= flag.offset + flag.size ||
+            flag.offset >= access.offset + access.size) {
+          continue;
+        }
+        if (llvm::isa<llvm::StoreInst>(access.instruction) &&
+            access.offset == flag.offset && access.size == flag.size) {
+          effect.writes = static_cast<int>(i);
+        } else {
+          effect.reads |= FlagMask(1) << i;
+        }
+      }
+      if (effect.reads || effect.writes >= 0) {
+        effects[access.instruction] = effect;
+      }
+    }
+    for (auto call : calls) {
+      effects[call].reads = allFlags;
+    }
+
+    // Flags live at the start of block, given the flags live at its end.
+    // Collects the stores of flags that are not live after them.
+    auto transfer = [&](llvm::BasicBlock &block, FlagMask live,
+                        llvm::SmallVectorImpl<llvm::StoreInst *> *deadStores) {
+      for (auto &instruction : llvm::reverse(block)) {
+        if (llvm::isa<llvm::ReturnInst>(instruction)) {
+          live = allFlags;
+          continue;
+        }
+        auto found = effects.find(&instruction);
+        if (found == effects.end()) {
+          continue;
+        }
+        if (found->second.writes >= 0) {
+          auto bit = FlagMask(1) << found->second.writes;
+          if (deadStores && !(live & bit)) {
+            deadStores->push_back(llvm::cast<llvm::StoreInst>(&instruction));
+          }
+          live &= ~bit;
+        }
+        live |= found->second.reads;
+      }
+      return live;
+    };
+
+    auto liveOut = [&](const llvm::DenseMap<const llvm::BasicBlock *,
+                                            FlagMask> &liveIn,
+                       const llvm::BasicBlock &block) {
+      FlagMask live = 0;
+      for (auto successor : llvm::successors(&block)) {
+        live |= liveIn.lookup(successor);
+      }
+      return live;
+    };
+
+    // Sets only grow, so this terminates
+    llvm::DenseMap<const llvm::BasicBlock *, FlagMask> liveIn;
+    for (auto changed = true; changed;) {
+      changed = false;
+      for (auto &block : llvm::reverse(function)) {
+        auto live = transfer(block, liveOut(liveIn, block), nullptr);
+        if (live != liveIn.lookup(&block)) {
+          liveIn[&block] = live;
+          changed = true;
+        }
+      }
+    }
+
+    llvm::SmallVector<llvm::StoreInst *, 32> deadStores;
+    for (auto &block : function) {
+      transfer(block, liveOut(liveIn, block), &deadStores);
+    }
+    for (auto store : deadStores) {
+      if (auto value =
+              llvm::dyn_cast<llvm::Instruction>(store->getValueOperand())) {
+        dead.emplace_back(value);
+      }
+      store->eraseFromParent();
+    }
+    numDeadStores = deadStores.size();
+    llvm::RecursivelyDeleteTriviallyDeadInstructionsPermissive(dead);
+  }
+
+  // The markers do not have side effects, but nothing else knows
+  llvm::SmallVector<llvm::Instruction *, 32> markers;
+  for (auto &instruction : llvm::instructions(function)) {
+    if (isFlagComputation(instruction) && instruction.use_empty()) {
+      markers.push_back(&instruction);
+    }
+  }
+  dead.clear();
+  for (auto marker : markers) {
+    for (auto &operand : marker->operands()) {
+      if (auto value = llvm::dyn_cast<llvm::Instruction>(operand.get())) {
+        dead.emplace_back(value);
+      }
+    }
+    marker->eraseFromParent();
+  }
+  llvm::RecursivelyDeleteTriviallyDeadInstructionsPermissive(dead);
+
+  if (numDeadStores == 0 && markers.empty()) {
+    return llvm::PreservedAnalyses::all();
+  }
+  Metrics::add(Counter::DeadFlagStores, numDeadStores);
+  llvm::PreservedAnalyses preserved;
+  preserved.preserveSet<llvm::CFGAnalyses>();
+  return preserved;
+}
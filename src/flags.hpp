@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+
+#include <remill/Arch/Arch.h>
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/PassManager.h>
+
+/// Remove the flag computations of a lifted function that nothing reads.
+///
+/// Most instructions compute flags the next instruction overwrites. The
+/// semantics pass every flag through a __remill_flag_computation_* marker,
+/// which has no side effects but is a call the optimizer cannot remove, so the
+/// computation behind it stays alive after the flag store itself is gone.
+///
+/// This pass runs a backward liveness analysis over the flag fields of State
+/// (the arithmetic flag registers of the architecture). Returns and calls that
+/// receive State read every flag, any other access overlapping a flag reads
+/// it, and a store of exactly the flag overwrites it. Stores the flag is not
+/// live after are removed, together with the markers and computations only
+/// they used. Markers that were unused to begin with go as well.
+///
+/// Runs on lifted functions after the semantics are inlined (State is the
+/// first argument) and before the helpers are linked in, which replace the
+/// markers with their first argument.
+class FlagEliminationPass : public llvm::PassInfoMixin<FlagEliminationPass> {
+public:
+  explicit FlagEliminationPass(const remill::Arch *arch);
+
+  llvm::PreservedAnalyses run(llvm::Function &function,
+                              llvm::FunctionAnalysisManager &fam);
+
+private:
+  struct Flag {
+    uint64_t offset = 0;
+    uint64_t size = 0;
+  };
+
+  llvm::SmallVector<Flag, 8> flags;
+};
@@ -0,0 +1,161 @@
+#include "guest.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include <llvm/IR/DataLayout.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/Support/MathExtras.h>
+#include <llvm/Support/MemAlloc.h>
+#include <llvm/Support/Process.h>
+#include <llvm/Support/raw_ostream.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+// remill aligns vector registers in State to 16 bytes
+static constexpr size_t kStateAlignment = 16;
+
+// Largest GuestMemory::createSandboxed reservation (64 TiB), which leaves
+// room for the host in a 48-bit address space
+static constexpr unsigned kMaxSandboxBits = 46;
+
+std::unique_ptr<GuestMemory> GuestMemory::create(uint64_t base,
+                                                 uint64_t size) {
+  std::error_code ec;
+  auto block = llvm::sys::Memory::allocateMappedMemory(
+      size, nullptr, llvm::sys::Memory::MF_READ | llvm::sys::Memory::MF_WRITE,
+      ec);
+  if (ec) {
+    llvm::errs() << "Failed to allocate " << size
+                 << " bytes of guest memory: " << ec.message() << "\n";
+    return nullptr;
+  }
+  return std::unique_ptr<GuestMemory>(new GuestMemory(
+      block, static_cast<uint8_t *>(block.base()), base, size));
+}
+
+std::unique_ptr<GuestMemory>
+GuestMemory::createSandboxed(uint64_t base, uint64_t size,
+                             unsigned addressBits) {
+  if (addressBits == 0 || addressBits > kMaxSandboxBits) {
+    llvm::errs() << "Unsupported sandbox size: 2^" << addressBits << "\n";
+    return nullptr;
+  }
+  auto spaceSize = uint64_t(1) << addressBits;
+  if (size == 0 || base >= spaceSize || size > spaceSize - base) {
+    llvm::errs() << "Guest memory does not fit in a sandbox of 2^"
+                 << addressBits << " bytes\n";
+    return nullptr;
+  }
+
+  // Accesses are at most a page wide, so a single guard page covers every
+  // (wrapped) address close to the end of the space
+  uint64_t pageSize = llvm::sys::Process::getPageSizeEstimate();
+  auto reservedSize = spaceSize + pageSize;
+  auto begin = llvm::alignDown(base, pageSize);
+  auto end = llvm::alignTo(base + size, pageSize);
+#if defined(_WIN32)
+  auto reservation =
+      VirtualAlloc(nullptr, reservedSize, MEM_RESERVE, PAGE_NOACCESS);
+  auto committed =
+      reservation && VirtualAlloc(static_cast<uint8_t *>(reservation) + begin,
+                                  end - begin, MEM_COMMIT, PAGE_READWRITE);
+  if (reservation && !committed) {
+    VirtualFree(reservation, 0, MEM_RELEASE);
+  }
+#else
+  auto reservation =
+      ::mmap(nullptr, reservedSize, PROT_NONE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (reservation == MAP_FAILED) {
+    reservation = nullptr;
+  }
+  auto committed =
+      reservation && ::mprotect(static_cast<uint8_t *>(reservation) + begin,
+                                end - begin, PROT_READ | PROT_WRITE) == 0;
+  if (reservation && !committed) {
+    ::munmap(reservation, reservedSize);
+  }
+#endif
+  if (!committed) {
+    llvm::errs() << "Failed to reserve a sandbox of 2^" << addressBits
+                 << " bytes of guest memory\n";
+    return nullptr;
+  }
+
+  llvm::sys::MemoryBlock block(reservation, reservedSize);
+  std::unique_ptr<GuestMemory> memory(new GuestMemory(
+      block, static_cast<uint8_t *>(reservation) + base, base, size));
+  memory->sandboxBits = addressBits;
+  return memory;
+}
+
+GuestMemory::~GuestMemory() { llvm::sys::Memory::releaseMappedMemory(block); }
+
+uint8_t *GuestMemory::translate(uint64_t address) const {
+  if (!contains(address, 1)) {
+    return nullptr;
+  }
+  return window + (address - base);
+}
+
+bool GuestMemory::write(uint64_t address, std::string_view bytes) {
+  if (!contains(address, bytes.size())) {
+    return false;
+  }
+  std::memcpy(translate(address), bytes.data(), bytes.size());
+  return true;
+}
+
+void GuestMemory::load(const Image &image) {
+  for (const auto &segment : image.getSegments()) {
+    auto begin = std::max(segment.address, base);
+    auto end = std::min(segment.end(), base + size);
+    if (begin < end) {
+      write(begin, segment.bytes.substr(begin - segment.address, end - begin));
+    }
+  }
+}
+
+GuestState::GuestState(const remill::Arch *arch) : arch(arch) {
+  size = arch->DataLayout().getTypeAllocSize(arch->StateStructType());
+  bytes = static_cast<uint8_t *>(
+      llvm::allocate_buffer(size, kStateAlignment));
+  std::memset(bytes, 0, size);
+}
+
+GuestState::~GuestState() {
+  llvm::deallocate_buffer(bytes, size, kStateAlignment);
+}
+
+std::optional<uint64_t> GuestState::read(std::string_view name) const {
+  auto reg = arch->RegisterByName(name);
+  if (!reg || reg->size > sizeof(uint64_t)) {
+    return std::nullopt;
+  }
+  uint64_t value = 0;
+  std::memcpy(&value, bytes + reg->offset, reg->size);
+  return value;
+}
+
+bool GuestState::write(std::string_view name, uint64_t value) {
+  auto reg = arch->RegisterByName(name);
+  if (!reg || reg->size > sizeof(uint64_t)) {
+    return false;
+  }
+  std::memcpy(bytes + reg->offset, &value, reg->size);
+  return true;
+}
+
+uint64_t GuestState::getPc() const {
+  return read(arch->ProgramCounterRegisterName()).value_or(0);
+}
+
+void GuestState::setPc(uint64_t pc) {
+  write(arch->ProgramCounterRegisterName(), pc);
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string_view>
+
+#include "image.hpp"
+
+#include <remill/Arch/Arch.h>
+
+#include <llvm/Support/Memory.h>
+
+/// A window [base, base + size) of guest memory backed by anonymous host
+/// memory (pages are only committed once they are touched).
+///
+/// The RemillHelpers memory model accesses guest address a as RAM[a], so the
+/// RAM symbol of the helpers has to be bound to ramAddress(). The helpers do
+/// not check bounds: lifted code accessing guest memory outside of the window
+/// touches arbitrary host memory, unless the memory is sandboxed (see
+/// createSandboxed) and the masked flavor of the helpers is used.
+class GuestMemory {
+public:
+  static std::unique_ptr<GuestMemory> create(uint64_t base, uint64_t size);
+
+  /// Reserve the whole guest address space of 2^addressBits bytes, plus a
+  /// guard page for the accesses crossing its end, and only make the pages
+  /// of the window readable and writable.
+  ///
+  /// The masked flavor of the helpers (RemillHelpers-masked.bc) wraps every
+  /// address to addressBits, so lifted code can only reach the reservation
+  /// and accesses outside of the window fault instead of touching host
+  /// memory. Like WebAssembly, this needs no bounds checks. The window has to
+  /// be inside the address space.
+  static std::unique_ptr<GuestMemory>
+  createSandboxed(uint64_t base, uint64_t size, unsigned addressBits);
+
+  ~GuestMemory();
+
+  GuestMemory(const GuestMemory &) = delete;
+  GuestMemory &operator=(const GuestMemory &) = delete;
+
+  uint64_t getBase() const { return base; }
+  uint64_t getSize() const { return size; }
+  bool contains(uint64_t address, uint64_t length) const {
+    return address >= base && length <= size && address - base <= size - length;
+  }
+
+  /// Host pointer of a guest address, nullptr outside of the window.
+  uint8_t *translate(uint64_t address) const;
+
+  /// Copy bytes to guest memory, fails when they do not fit in the window.
+  bool write(uint64_t address, std::string_view bytes);
+
+  /// Copy all the segments of image that overlap the window.
+  void load(const Image &image);
+
+  /// Address the RAM symbol has to resolve to, such that RAM + a is the host
+  /// address of guest address a.
+  uint64_t ramAddress() const {
+    return reinterpret_cast<uintptr_t>(window) - base;
+  }
+
+  /// Address bits of a sandboxed memory, 0 when it is not sandboxed.
+  unsigned getSandboxBits() const { return sandboxBits; }
+
+private:
+  GuestMemory(llvm::sys::MemoryBlock block, uint8_t *window, uint64_t base,
+              uint64_t size)
+      : block(block), window(window), base(base), size(size) {}
+
+  // The whole mapping, for sandboxed memory the reservation
+  llvm::sys::MemoryBlock block;
+  // Host address of base
+  uint8_t *window = nullptr;
+  uint64_t base = 0;
+  uint64_t size = 0;
+  unsigned sandboxBits = 0;
+};
+
+/// The remill State structure of an architecture as an opaque buffer.
+///
+/// Registers are accessed through the offsets remill computed for them from
+/// the semantics module, so the host never needs the (guest specific)
+/// definition of State.
+class GuestState {
+public:
+  explicit GuestState(const remill::Arch *arch);
+  ~GuestState();
+
+  GuestState(const GuestState &) = delete;
+  GuestState &operator=(const GuestState &) = delete;
+
+  void *data() { return bytes; }
+  size_t getSize() const { return size; }
+
+  /// Read a register of at most 8 bytes (zero extended), std::nullopt when the
+  /// architecture has no register with that name.
+  std::optional<uint64_t> read(std::string_view name) const;
+
+  /// Write a register of at most 8 bytes (truncated to its size).
+  bool write(std::string_view name, uint64_t value);
+
+  uint64_t getPc() const;
+  void setPc(uint64_t pc);
+
+private:
+  const remill::Arch *arch = nullptr;
+  uint8_t *bytes = nullptr;
+  size_t size = 0;
+};
@@ -0,0 +1,165 @@
+#include "image.hpp"
+
+#include <algorithm>
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/BinaryFormat/COFF.h>
+#include <llvm/BinaryFormat/ELF.h>
+#include <llvm/Object/COFF.h>
+#include <llvm/Object/ELFObjectFile.h>
+#include <llvm/Object/ObjectFile.h>
+#include <llvm/Support/raw_ostream.h>
+
+std::unique_ptr<Image> Image::open(const std::string &path, uint64_t base) {
+  // Not requiring a null terminator allows LLVM to mmap the file instead of
+  // reading it into a heap allocation
+  auto buffer = llvm::MemoryBuffer::getFile(path, /*IsText=*/false,
+                                            /*RequiresNullTerminator=*/false);
+  if (!buffer) {
+    llvm::errs() << "Failed to open image " << path << ": "
+                 << buffer.getError().message() << "\n";
+    return nullptr;
+  }
+  return fromBuffer(std::move(*buffer), base);
+}
+
+std::unique_ptr<Image>
+Image::fromBuffer(std::unique_ptr<llvm::MemoryBuffer> buffer, uint64_t base) {
+  std::unique_ptr<Image> image(new Image());
+  image->buffer = std::move(buffer);
+
+  ImageSegment segment;
+  segment.address = base;
+  segment.bytes = std::string_view(image->buffer->getBufferStart(),
+                                   image->buffer->getBufferSize());
+  image->segments.push_back(segment);
+  return image;
+}
+
+std::unique_ptr<Image> Image::openObject(const std::string &path) {
+  auto buffer = llvm::MemoryBuffer::getFile(path, /*IsText=*/false,
+                                            /*RequiresNullTerminator=*/false);
+  if (!buffer) {
+    llvm::errs() << "Failed to open image " << path << ": "
+                 << buffer.getError().message() << "\n";
+    return nullptr;
+  }
+  auto object =
+      llvm::object::ObjectFile::createObjectFile((*buffer)->getMemBufferRef());
+  if (!object) {
+    llvm::errs() << "Failed to parse image " << path << ": "
+                 << llvm::toString(object.takeError()) << "\n";
+    return nullptr;
+  }
+
+  std::unique_ptr<Image> image(new Image());
+  for (const auto &section : (*object)->sections()) {
+    // BSS and other sections without bytes in the file stay zero in memory
+    if (section.isVirtual() || section.isBSS() || section.getSize() == 0) {
+      continue;
+    }
+
+    auto allocated = true;
+    auto writable = !section.isText();
+    if (llvm::isa<llvm::object::ELFObjectFileBase>(object->get())) {
+      auto flags = llvm::object::ELFSectionRef(section).getFlags();
+      allocated = flags & llvm::ELF::SHF_ALLOC;
+      writable = flags & llvm::ELF::SHF_WRITE;
+    } else if (auto coff = llvm::dyn_cast<llvm::object::COFFObjectFile>(
+                   object->get())) {
+      auto characteristics = coff->getCOFFSection(section)->Characteristics;
+      allocated = !(characteristics & llvm::COFF::IMAGE_SCN_LNK_REMOVE);
+      writable = characteristics & llvm::COFF::IMAGE_SCN_MEM_WRITE;
+    }
+    if (!allocated) {
+      continue;
+    }
+
+    auto contents = section.getContents();
+    if (!contents) {
+      llvm::errs() << "Failed to read a section of " << path << ": "
+                   << llvm::toString(contents.takeError()) << "\n";
+      return nullptr;
+    }
+    ImageSegment segment;
+    segment.address = section.getAddress();
+    segment.bytes = std::string_view(contents->data(), contents->size());
+    segment.readOnly = !writable;
+    image->segments.push_back(segment);
+  }
+  if (image->segments.empty()) {
+    llvm::errs() << "No sections to load in " << path << "\n";
+    return nullptr;
+  }
+
+  std::sort(image->segments.begin(), image->segments.end(),
+            [](const ImageSegment &a, const ImageSegment &b) {
+              return a.address < b.address;
+            });
+  // The sections point into the mapping, the object file is not needed
+  image->buffer = std::move(*buffer);
+  return image;
+}
+
+std::string_view Image::readOnlyBytes(uint64_t address, uint64_t size) const {
+  for (const auto &segment : segments) {
+    if (segment.readOnly && address >= segment.address &&
+        address < segment.end() && size <= segment.end() - address) {
+      return segment.bytes.substr(address - segment.address, size);
+    }
+  }
+  return {};
+}
+
+void Image::setReadOnly(uint64_t begin, uint64_t end) {
+  std::vector<ImageSegment> split;
+  for (const auto &segment : segments) {
+    auto from = std::clamp(begin, segment.address, segment.end());
+    auto to = std::clamp(end, from, segment.end());
+    // [address, from) [from, to) [to, end), empty parts are dropped
+    uint64_t bounds[] = {segment.address, from, to, segment.end()};
+    for (int i = 0; i < 3; i++) {
+      if (bounds[i] == bounds[i + 1]) {
+        continue;
+      }
+      ImageSegment part = segment;
+      part.address = bounds[i];
+      part.bytes = segment.bytes.substr(bounds[i] - segment.address,
+                                        bounds[i + 1] - bounds[i]);
+      part.readOnly = segment.readOnly || i == 1;
+      split.push_back(part);
+    }
+  }
+  segments = std::move(split);
+}
+
+std::string_view Image::bytesAt(uint64_t address) const {
+  for (const auto &segment : segments) {
+    if (address >= segment.address && address < segment.end()) {
+      return segment.bytes.substr(address - segment.address);
+    }
+  }
+  return {};
+}
+
+bool parseLiftRanges(std::string_view text, std::vector<LiftRange> &ranges) {
+  llvm::SmallVector<llvm::StringRef, 16> parts;
+  llvm::StringRef(text.data(), text.size()).split(parts, ',', -1, false);
+  for (auto part : parts) {
+    auto [begin, end] = part.trim().split('-');
+    LiftRange range;
+    if (begin.trim().getAsInteger(0, range.begin)) {
+      llvm::errs() << "Invalid address in range: " << part << "\n";
+      return false;
+    }
+    if (!end.empty()) {
+      if (end.trim().getAsInteger(0, range.end) || range.end <= range.begin) {
+        llvm::errs() << "Invalid end address in range: " << part << "\n";
+        return false;
+      }
+    }
+    ranges.push_back(range);
+  }
+  return true;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <llvm/Support/MemoryBuffer.h>
+
+/// A contiguous range of guest addresses backed by bytes of the image.
+struct ImageSegment {
+  uint64_t address = 0;
+  std::string_view bytes;
+  // The guest cannot write to it, so its bytes never change
+  bool readOnly = false;
+
+  uint64_t end() const { return address + bytes.size(); }
+};
+
+/// Read-only view of an input image that is memory-mapped from disk.
+///
+/// All the views handed out by bytesAt() point straight into the mapping, so
+/// they remain valid for the lifetime of the Image and no guest bytes are ever
+/// copied.
+class Image {
+public:
+  /// Map a raw binary so that its first byte is at guest address base.
+  static std::unique_ptr<Image> open(const std::string &path, uint64_t base);
+
+  /// Like open, for bytes that are already in memory (owned by the Image).
+  static std::unique_ptr<Image> fromBuffer(
+      std::unique_ptr<llvm::MemoryBuffer> buffer, uint64_t base);
+
+  /// Map the allocated sections of an ELF, PE/COFF or Mach-O file at their
+  /// addresses. Sections that are not writable are read-only segments (for
+  /// Mach-O only the code sections).
+  static std::unique_ptr<Image> openObject(const std::string &path);
+
+  /// Returns the bytes from address up to the end of its segment, or an empty
+  /// view when the address is not mapped.
+  std::string_view bytesAt(uint64_t address) const;
+
+  /// Returns the size bytes at address when all of them are in one read-only
+  /// segment, an empty view otherwise.
+  std::string_view readOnlyBytes(uint64_t address, uint64_t size) const;
+
+  /// Mark [begin, end) as read-only, splitting the segments around it. For
+  /// raw images, which carry no permissions.
+  void setReadOnly(uint64_t begin, uint64_t end);
+
+  const std::vector<ImageSegment> &getSegments() const { return segments; }
+
+private:
+  Image() = default;
+
+  std::unique_ptr<llvm::MemoryBuffer> buffer;
+  std::vector<ImageSegment> segments;
+};
+
+/// A guest address range to lift. An end of 0 lifts a single basic block.
+struct LiftRange {
+  uint64_t begin = 0;
+  uint64_t end = 0;
+};
+
+/// Parse a comma separated list of entry addresses and ranges, for example:
+/// 0x1000,0x2000-0x2400
+bool parseLiftRanges(std::string_view text, std::vector<LiftRange> &ranges);
@@ -0,0 +1,464 @@
+#include "jit.hpp"
+#include "embedded.hpp"
+#include "extract.hpp"
+#include "lifter.hpp"
+
+#include <mutex>
+
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/ExecutionEngine/Orc/CompileUtils.h>
+#include <llvm/ExecutionEngine/Orc/Core.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Intrinsics.h>
+#include <llvm/IR/PassManager.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/SHA1.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/IPO/AlwaysInliner.h>
+
+/// Run the module pipeline build creates. With a targetMachine the passes see
+/// its cost model and the vectorizers are enabled.
+static bool runPipeline(
+    llvm::Module &module,
+    llvm::function_ref<llvm::Error(llvm::PassBuilder &,
+                                   llvm::ModulePassManager &)>
+        build,
+    llvm::TargetMachine *targetMachine = nullptr) {
+  llvm::LoopAnalysisManager lam;
+  llvm::FunctionAnalysisManager fam;
+  llvm::CGSCCAnalysisManager cgam;
+  llvm::ModuleAnalysisManager mam;
+  llvm::PipelineTuningOptions tuning;
+  if (targetMachine) {
+    tuning.LoopVectorization = true;
+    tuning.SLPVectorization = true;
+  }
+  llvm::PassBuilder pb(targetMachine, tuning);
+  pb.registerModuleAnalyses(mam);
+  pb.registerCGSCCAnalyses(cgam);
+  pb.registerFunctionAnalyses(fam);
+  pb.registerLoopAnalyses(lam);
+  pb.crossRegisterProxies(lam, fam, cgam, mam);
+  llvm::ModulePassManager mpm;
+  if (auto error = build(pb, mpm)) {
+    llvm::errs() << "Invalid pipeline for " << module.getName() << ": "
+                 << llvm::toString(std::move(error)) << "\n";
+    return false;
+  }
+  mpm.run(module, mam);
+  return true;
+}
+
+/// Whether the JIT can give the remill intrinsic name a neutral body when the
+/// helpers do not implement it: nothing to order on one host thread, control
+/// flow that leaves the PC in State for the dispatcher, and undefined values.
+static bool isNeutralIntrinsic(const std::string &name) {
+  for (auto prefix :
+       {"__remill_barrier_", "__remill_delay_slot_", "__remill_undefined_"}) {
+    if (name.rfind(prefix, 0) == 0) {
+      return true;
+    }
+  }
+  for (auto neutral :
+       {"__remill_atomic_begin", "__remill_atomic_end", "__remill_jump",
+        "__remill_function_call", "__remill_function_return",
+        "__remill_missing_block"}) {
+    if (name == neutral) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/// Give the neutral remill intrinsics (see isNeutralIntrinsic) the helpers do
+/// not implement a body: return the memory pointer (their last pointer
+/// argument), zero or nothing. Every stub is reported once. Returns false
+/// when module needs any other intrinsic the helpers do not implement, such
+/// code would run without its side effects.
+static bool stubIntrinsics(llvm::Module &module,
+                           llvm::StringSet<> &reported) {
+  // The helpers use __builtin_unreachable for __remill_error, which is what
+  // the optimizer wants to see, but running into it has to stop the process
+  if (auto error = module.getFunction("__remill_error");
+      error && (!error->isDeclaration() || !error->use_empty())) {
+    if (!error->isDeclaration()) {
+      error->deleteBody();
+    }
+    auto block = llvm::BasicBlock::Create(module.getContext(), "", error);
+    llvm::IRBuilder<> ir(block);
+    ir.CreateCall(
+        llvm::Intrinsic::getDeclaration(&module, llvm::Intrinsic::trap));
+    ir.CreateUnreachable();
+    error->setLinkage(llvm::GlobalValue::InternalLinkage);
+  }
+
+  auto success = true;
+  for (auto &function : module) {
+    const auto &functionName = function.getName().str();
+    if (!function.isDeclaration() || function.isIntrinsic() ||
+        functionName.rfind("__remill_", 0) != 0 || function.use_empty()) {
+      continue;
+    }
+    if (!isNeutralIntrinsic(functionName)) {
+      llvm::errs() << "JIT: " << module.getName() << " needs "
+                   << functionName << ", which the helpers do not implement\n";
+      success = false;
+      continue;
+    }
+
+    auto returnType = function.getReturnType();
+    llvm::Value *result = nullptr;
+    if (!returnType->isVoidTy()) {
+      result = llvm::Constant::getNullValue(returnType);
+      for (auto &argument : function.args()) {
+        if (returnType->isPointerTy() && argument.getType() == returnType) {
+          result = &argument;
+        }
+      }
+    }
+
+    auto block = llvm::BasicBlock::Create(module.getContext(), "", &function);
+    llvm::IRBuilder<> ir(block);
+    result ? ir.CreateRet(result) : ir.CreateRetVoid();
+    function.setLinkage(llvm::GlobalValue::InternalLinkage);
+    if (reported.insert(functionName).second) {
+      llvm::errs() << "JIT: stubbed " << functionName << "\n";
+    }
+  }
+
+  return success;
+}
+
+std::unique_ptr<JitExecutor>
+JitExecutor::create(const remill::Arch *arch,
+                    const std::filesystem::path &helpersPath,
+                    const GuestMemory &memory,
+                    const std::filesystem::path &objectCacheDir) {
+  static std::once_flag initializeTarget;
+  std::call_once(initializeTarget, [] {
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+  });
+
+  std::unique_ptr<JitExecutor> executor(new JitExecutor());
+  executor->arch = arch;
+
+  auto helpers = readBitcode(helpersPath);
+  if (!helpers) {
+    llvm::errs() << "Failed to read helpers " << helpersPath.string() << ": "
+                 << helpers.getError().message() << "\n";
+    return nullptr;
+  }
+  executor->helpersBitcode = std::move(*helpers);
+  auto executionProfile = false;
+  {
+    llvm::LLVMContext context;
+    auto lazy = llvm::getLazyBitcodeModule(
+        executor->helpersBitcode->getMemBufferRef(), context);
+    if (!lazy) {
+      llvm::errs() << "Failed to parse helpers " << helpersPath.string()
+                   << ": " << llvm::toString(lazy.takeError()) << "\n";
+      return nullptr;
+    }
+    executor->memoryRegions = ::hasMemoryRegions(**lazy);
+    executionProfile =
+        (*lazy)->getNamedGlobal("__remill_execution_profile") != nullptr;
+
+    // Without them, atomic instructions would run without touching memory
+    for (auto size : {"8", "16", "32", "64"}) {
+      for (auto family : {"compare_exchange_memory", "fetch_and_add",
+                          "fetch_and_sub", "fetch_and_and", "fetch_and_nand",
+                          "fetch_and_or", "fetch_and_xor"}) {
+        auto name = std::string("__remill_") + family + "_" + size;
+        auto atomic = (*lazy)->getFunction(name);
+        if (!atomic || atomic->isDeclaration()) {
+          llvm::errs() << "Helpers " << helpersPath.string()
+                       << " do not implement " << name << "\n";
+          return nullptr;
+        }
+      }
+    }
+
+    // The sandbox only contains the guest with masked helpers of the same
+    // size, and the masked helpers only stay inside a sandbox
+    unsigned sandboxBits = 0;
+    if (auto bits = (*lazy)->getNamedGlobal("__remill_sandbox_bits")) {
+      if (auto value = llvm::dyn_cast_or_null<llvm::ConstantInt>(
+              bits->getInitializer())) {
+        sandboxBits = value->getZExtValue();
+      }
+    }
+    if (sandboxBits != memory.getSandboxBits()) {
+      if (sandboxBits) {
+        llvm::errs() << "Helpers " << helpersPath.string() << " mask "
+                     << "addresses to " << sandboxBits << " bits, the guest "
+                     << "memory needs a sandbox of the same size\n";
+      } else {
+        llvm::errs() << "Helpers " << helpersPath.string() << " do not mask "
+                     << "addresses, the sandboxed guest memory needs the "
+                     << "masked flavor\n";
+      }
+      return nullptr;
+    }
+  }
+
+  auto targetMachine = llvm::orc::JITTargetMachineBuilder::detectHost();
+  if (!targetMachine) {
+    llvm::errs() << "Failed to detect the host: "
+                 << llvm::toString(targetMachine.takeError()) << "\n";
+    return nullptr;
+  }
+  // RAM can be anywhere in the address space, reach it through the GOT
+  targetMachine->setRelocationModel(llvm::Reloc::PIC_);
+
+  // The execution profile of the helpers is vectorized for the host, the
+  // pipeline needs its cost model to inline and vectorize the same way
+  if (executionProfile) {
+    auto machine = targetMachine->createTargetMachine();
+    if (!machine) {
+      llvm::errs() << "Failed to create the host target machine: "
+                   << llvm::toString(machine.takeError()) << "\n";
+      return nullptr;
+    }
+    executor->targetMachine = std::move(*machine);
+  }
+
+  llvm::orc::LLJITBuilder builder;
+  if (!objectCacheDir.empty()) {
+    // Everything besides the module that changes the object code
+    llvm::SHA1 hasher;
+    hasher.update(executor->helpersBitcode->getBuffer());
+    auto salt = llvm::toHex(hasher.final(), /*LowerCase=*/true);
+    salt += " " + targetMachine->getTargetTriple().str();
+    salt += " " + targetMachine->getCPU();
+    salt += " " + targetMachine->getFeatures().getString();
+    salt += " pic llvm-" LLVM_VERSION_STRING;
+    executor->objectCache =
+        std::make_unique<DiskObjectCache>(objectCacheDir, std::move(salt));
+
+    auto cache = executor->objectCache.get();
+    builder.setCompileFunctionCreator(
+        [cache](llvm::orc::JITTargetMachineBuilder machineBuilder)
+            -> llvm::Expected<
+                std::unique_ptr<llvm::orc::IRCompileLayer::IRCompiler>> {
+          auto machine = machineBuilder.createTargetMachine();
+          if (!machine) {
+            return machine.takeError();
+          }
+          return std::make_unique<llvm::orc::TMOwningSimpleCompiler>(
+              std::move(*machine), cache);
+        });
+  }
+  auto jit =
+      builder.setJITTargetMachineBuilder(std::move(*targetMachine)).create();
+  if (!jit) {
+    llvm::errs() << "Failed to create the JIT: "
+                 << llvm::toString(jit.takeError()) << "\n";
+    return nullptr;
+  }
+  executor->jit = std::move(*jit);
+
+  if (!executor->defineSymbol("RAM", memory.ramAddress())) {
+    return nullptr;
+  }
+  return executor;
+}
+
+bool JitExecutor::defineSymbol(llvm::StringRef name, uint64_t address) {
+  llvm::orc::SymbolMap symbols;
+  symbols[jit->mangleAndIntern(name)] =
+      llvm::orc::ExecutorSymbolDef(llvm::orc::ExecutorAddr(address),
+                                   llvm::JITSymbolFlags::Exported);
+  auto &dylib = jit->getMainJITDylib();
+  if (auto error = dylib.define(llvm::orc::absoluteSymbols(symbols))) {
+    llvm::errs() << "Failed to define " << name << ": "
+                 << llvm::toString(std::move(error)) << "\n";
+    return false;
+  }
+  return true;
+}
+
+llvm::orc::ResourceTrackerSP JitExecutor::createTracker() {
+  return jit->getMainJITDylib().createResourceTracker();
+}
+
+bool JitExecutor::addModule(const llvm::Module &module,
+                            llvm::function_ref<void(llvm::Module &)> transform,
+                            llvm::orc::ResourceTrackerSP tracker,
+                            llvm::OptimizationLevel level) {
+  auto context = std::make_unique<llvm::LLVMContext>();
+  auto bitcode = writeBitcode(module);
+  llvm::MemoryBufferRef buffer(
+      llvm::StringRef(bitcode.data(), bitcode.size()), module.getName());
+  auto lifted = llvm::parseBitcodeFile(buffer, *context);
+  if (!lifted) {
+    llvm::errs() << "Failed to copy " << module.getName() << ": "
+                 << llvm::toString(lifted.takeError()) << "\n";
+    return false;
+  }
+  if (transform) {
+    transform(**lifted);
+  }
+
+  // The memory intrinsics are routed to their region while the addresses are
+  // still visible: the semantics are inlined, the helpers are not
+  if (memoryRegions) {
+    auto route = [this](llvm::PassBuilder &pb,
+                        llvm::ModulePassManager &mpm) -> llvm::Error {
+      if (auto error = pb.parsePassPipeline(
+              mpm, "always-inline,function(sroa,early-cse,instcombine)")) {
+        return error;
+      }
+      mpm.addPass(MemoryRegionPass(arch, imageRanges));
+      return llvm::Error::success();
+    };
+    auto routed = runPipeline(**lifted, route);
+    if (!routed) {
+      return false;
+    }
+  }
+
+  auto helpers =
+      llvm::parseBitcodeFile(helpersBitcode->getMemBufferRef(), *context);
+  if (!helpers) {
+    llvm::errs() << "Failed to parse helpers: "
+                 << llvm::toString(helpers.takeError()) << "\n";
+    return false;
+  }
+
+  // The guest triple only matters for the semantics, the code runs on the host.
+  // remill pads State explicitly, so its layout is the same on the host.
+  const auto &dataLayout = jit->getDataLayout();
+  const auto &triple = jit->getTargetTriple().str();
+  for (auto current : {lifted->get(), helpers->get()}) {
+    current->setDataLayout(dataLayout);
+    current->setTargetTriple(triple);
+  }
+
+  if (llvm::Linker::linkModules(**lifted, std::move(*helpers),
+                                llvm::Linker::Flags::LinkOnlyNeeded)) {
+    llvm::errs() << "Failed to link helpers into " << module.getName() << "\n";
+    return false;
+  }
+  if (!stubIntrinsics(**lifted, stubbedIntrinsics)) {
+    return false;
+  }
+
+  // The inliner only inlines helpers tuned for a CPU into functions that
+  // target at least its features, and the code runs on the host anyway. The
+  // host features also keep helpers tuned for another CPU executable.
+  if (targetMachine) {
+    auto cpu = targetMachine->getTargetCPU();
+    auto features = targetMachine->getTargetFeatureString();
+    for (auto &function : **lifted) {
+      if (!function.isDeclaration()) {
+        function.addFnAttr("target-cpu", cpu);
+        function.addFnAttr("target-features", features);
+      }
+    }
+  }
+
+  // Only the lifted functions are exported, so modules never clash over the
+  // semantics and helpers they both contain
+  for (auto &global : (*lifted)->global_values()) {
+    if (global.isDeclaration()) {
+      continue;
+    }
+    auto function = llvm::dyn_cast<llvm::Function>(&global);
+    if (!function || !BlockLifter::functionAddress(function->getName())) {
+      global.setLinkage(llvm::GlobalValue::InternalLinkage);
+    }
+  }
+  // clang assumes RAM is in the same linkage unit (the helpers are compiled
+  // without -fPIC), which does not hold for absolute symbols
+  for (auto &global : (*lifted)->globals()) {
+    if (global.isDeclaration()) {
+      global.setDSOLocal(false);
+    }
+  }
+
+  // The region helpers have to be inlined before the accesses can be tagged
+  if (memoryRegions) {
+    runPipeline(**lifted,
+                [](llvm::PassBuilder &pb, llvm::ModulePassManager &mpm) {
+                  mpm.addPass(llvm::AlwaysInlinerPass());
+                  return llvm::Error::success();
+                });
+    tagMemoryRegions(**lifted);
+    if (auto ram = (*lifted)->getNamedGlobal("RAM")) {
+      ram->setDSOLocal(false);
+    }
+  }
+
+  runPipeline(
+      **lifted,
+      [level](llvm::PassBuilder &pb, llvm::ModulePassManager &mpm) {
+        mpm = level == llvm::OptimizationLevel::O0
+                  ? pb.buildO0DefaultPipeline(level)
+                  : pb.buildPerModuleDefaultPipeline(level);
+        return llvm::Error::success();
+      },
+      targetMachine.get());
+
+  llvm::orc::ThreadSafeModule threadSafeModule(std::move(*lifted),
+                                               std::move(context));
+  auto error = tracker ? jit->addIRModule(tracker, std::move(threadSafeModule))
+                       : jit->addIRModule(std::move(threadSafeModule));
+  if (error) {
+    llvm::errs() << "Failed to add " << module.getName()
+                 << " to the JIT: " << llvm::toString(std::move(error))
+                 << "\n";
+    return false;
+  }
+  return true;
+}
+
+void *JitExecutor::lookup(uint64_t address) {
+  auto found = blocks.find(address);
+  if (found != blocks.end()) {
+    return found->second;
+  }
+
+  auto symbol = jit->lookup(BlockLifter::functionName(address));
+  if (!symbol) {
+    llvm::consumeError(symbol.takeError());
+    return nullptr;
+  }
+  auto function = symbol->toPtr<void *>();
+  blocks[address] = function;
+  return function;
+}
+
+bool JitExecutor::step(GuestState &state) {
+  auto function = lookup(state.getPc());
+  if (!function) {
+    return false;
+  }
+  call(function, state);
+  return true;
+}
+
+void JitExecutor::call(void *function, GuestState &state) {
+  // The helpers ignore the Memory pointer, guest memory is RAM
+  auto pc = state.getPc();
+  if (arch->address_size == 32) {
+    reinterpret_cast<LiftedFunction32>(function)(
+        state.data(), static_cast<uint32_t>(pc), nullptr);
+  } else {
+    reinterpret_cast<LiftedFunction64>(function)(state.data(), pc, nullptr);
+  }
+}
+
+uint64_t JitExecutor::run(GuestState &state, uint64_t maxBlocks) {
+  uint64_t numBlocks = 0;
+  while (numBlocks < maxBlocks && step(state)) {
+    numBlocks++;
+  }
+  return numBlocks;
+}
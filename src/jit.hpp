@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <vector>
+
+#include "guest.hpp"
+#include "objcache.hpp"
+#include "regions.hpp"
+
+#include <remill/Arch/Arch.h>
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/STLFunctionalExtras.h>
+#include <llvm/ADT/StringSet.h>
+#include <llvm/ExecutionEngine/Orc/LLJIT.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Passes/OptimizationLevel.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Target/TargetMachine.h>
+
+/// Compiles lifted functions with LLJIT and runs them natively.
+///
+/// Every module is linked with the RemillHelpers.bc of the architecture, which
+/// implements the memory and atomic intrinsics as RAM[address], and optimized
+/// again so the helpers are inlined. Modules that need other intrinsics with
+/// side effects the helpers do not implement are refused. RAM is an absolute
+/// symbol bound to the window of a GuestMemory. Modules are copied into their own ThreadSafeContext through
+/// bitcode, so the lifting context stays independent of the JIT.
+///
+/// With an objectCacheDir, the object code of every module is kept in a
+/// DiskObjectCache and warm runs skip the code generation.
+///
+/// Helpers built with the regions flavor (RemillHelpers-regions.bc) are
+/// detected on creation. The memory accesses of every module are then routed
+/// to the stack and image regions (MemoryRegionPass) and tagged with scoped
+/// alias metadata (tagMemoryRegions), see setImageRanges.
+///
+/// Helpers built with the execution profile (helpers/<arch>/execution) are
+/// vectorized and tuned for the host CPU. They are detected on creation too:
+/// every module is then compiled for the host CPU and features, and optimized
+/// with its cost model and the vectorizers enabled. The analysis profile
+/// keeps the generic pipeline.
+class JitExecutor {
+public:
+  static std::unique_ptr<JitExecutor>
+  create(const remill::Arch *arch, const std::filesystem::path &helpersPath,
+         const GuestMemory &memory,
+         const std::filesystem::path &objectCacheDir = {});
+
+  /// Compile the lifted functions of module (see BlockLifter::functionName).
+  /// Everything else in the module is internalized.
+  ///
+  /// transform runs on the copy of module before the helpers are linked in
+  /// (calls to the remill intrinsics are still visible). The code is owned by
+  /// tracker when one is given, so it can be removed again. level selects
+  /// the pipeline that runs after the helpers are linked in.
+  bool addModule(const llvm::Module &module,
+                 llvm::function_ref<void(llvm::Module &)> transform = {},
+                 llvm::orc::ResourceTrackerSP tracker = nullptr,
+                 llvm::OptimizationLevel level = llvm::OptimizationLevel::O2);
+
+  /// Constant addresses in these ranges are image accesses, for the modules
+  /// added after this call. Only used with the regions flavor of the helpers.
+  void setImageRanges(std::vector<AddressRange> ranges) {
+    imageRanges = std::move(ranges);
+  }
+  bool hasMemoryRegions() const { return memoryRegions; }
+
+  /// Define an absolute symbol, for host data or functions the lifted code
+  /// refers to by name.
+  bool defineSymbol(llvm::StringRef name, uint64_t address);
+
+  llvm::orc::ResourceTrackerSP createTracker();
+
+  /// Host address of the compiled block at address, nullptr when there is
+  /// none. Results are cached until forget() is called for the address.
+  void *lookup(uint64_t address);
+  void forget(uint64_t address) { blocks.erase(address); }
+
+  /// Run the block at the PC of state. Returns false when there is no
+  /// compiled block for the PC.
+  bool step(GuestState &state);
+
+  /// Run a compiled block (see lookup) on state.
+  void call(void *function, GuestState &state);
+
+  /// Run blocks until the PC has no compiled block or maxBlocks blocks ran.
+  /// Returns the number of blocks that ran.
+  uint64_t run(GuestState &state, uint64_t maxBlocks);
+
+  /// nullptr when the executor was created without an object cache.
+  const DiskObjectCache *getObjectCache() const { return objectCache.get(); }
+
+private:
+  // The lifted function type of remill: Memory *(State *, addr_t, Memory *)
+  using LiftedFunction32 = void *(*)(void *, uint32_t, void *);
+  using LiftedFunction64 = void *(*)(void *, uint64_t, void *);
+
+  JitExecutor() = default;
+
+  const remill::Arch *arch = nullptr;
+  // Declared before jit, the compiler refers to it until jit is destroyed
+  std::unique_ptr<DiskObjectCache> objectCache;
+  std::unique_ptr<llvm::orc::LLJIT> jit;
+  std::unique_ptr<llvm::MemoryBuffer> helpersBitcode;
+  // Only for the execution profile of the helpers
+  std::unique_ptr<llvm::TargetMachine> targetMachine;
+  llvm::DenseMap<uint64_t, void *> blocks;
+  llvm::StringSet<> stubbedIntrinsics;
+  bool memoryRegions = false;
+  std::vector<AddressRange> imageRanges;
+};
@@ -0,0 +1,354 @@
+#include "lifter.hpp"
+#include "metrics.hpp"
+#include "profile.hpp"
+#include "semantics.hpp"
+
+#include <set>
+
+#include <remill/Arch/Instruction.h>
+#include <remill/BC/Lifter.h>
+#include <remill/BC/Util.h>
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+
+BlockLifter::BlockLifter(const remill::Arch *arch, llvm::Module *semantics)
+    : arch(arch), semantics(semantics),
+      intrinsics(arch->GetInstrinsicTable()) {}
+
+std::string BlockLifter::functionName(uint64_t address) {
+  return "lifted_" + llvm::utohexstr(address, /*LowerCase=*/true);
+}
+
+std::optional<uint64_t> BlockLifter::functionAddress(llvm::StringRef name) {
+  uint64_t address = 0;
+  if (!name.consume_front("lifted_") || name.getAsInteger(16, address)) {
+    return std::nullopt;
+  }
+  return address;
+}
+
+void BlockLifter::eraseUnusedDeclarations(llvm::Module &module) {
+  for (auto &function : llvm::make_early_inc_range(module)) {
+    if (function.isDeclaration() && function.use_empty() &&
+        functionAddress(function.getName())) {
+      function.eraseFromParent();
+    }
+  }
+}
+
+bool BlockLifter::decode(uint64_t address, std::string_view bytes,
+                         remill::Instruction &instruction,
+                         remill::DecodingContext &context) {
+  PhaseTimer timer(Phase::Decode);
+  return decodeCache
+             ? decodeCache->decode(address, bytes, instruction, context)
+             : arch->DecodeInstruction(address, bytes, instruction, context);
+}
+
+LiftedBlock BlockLifter::liftBlock(uint64_t address, std::string_view bytes,
+                                   uint64_t end) {
+  auto result = liftBlockAs(functionName(address), address, bytes, end);
+  if (result.function) {
+    Metrics::add(Counter::Functions, 1);
+  }
+  return result;
+}
+
+LiftedBlock BlockLifter::liftBlockAs(const std::string &name, uint64_t address,
+                                     std::string_view bytes, uint64_t end) {
+  LiftedBlock result;
+  result.address = address;
+  result.nextAddress = address;
+
+  auto function = arch->DefineLiftedFunction(name, semantics);
+  auto block = &function->getEntryBlock();
+
+  remill::DecodingContext decoding_context = arch->CreateInitialContext();
+  auto maxInstructionSize = arch->MaxInstructionSize(decoding_context);
+  llvm::StringMap<uint64_t> isels;
+  size_t offset = 0;
+  while (offset < bytes.size() && (end == 0 || result.nextAddress < end)) {
+    // The view points into the caller's buffer, only clamp it to the size of
+    // the largest instruction so the decoder never looks further ahead
+    auto instr_view = bytes.substr(offset, maxInstructionSize);
+    remill::Instruction instruction;
+    if (!decode(result.nextAddress, instr_view, instruction,
+                decoding_context)) {
+      llvm::errs() << "Failed to decode instruction at "
+                   << llvm::format_hex(result.nextAddress, 1) << "\n";
+      break;
+    }
+
+    auto lifter = instruction.GetLifter();
+    remill::LiftStatus status;
+    {
+      PhaseTimer timer(Phase::Lift);
+      status = lifter->LiftIntoBlock(instruction, block);
+    }
+    if (status != remill::kLiftedInstruction) {
+      llvm::errs() << "Failed to lift instruction at "
+                   << llvm::format_hex(result.nextAddress, 1) << "\n";
+      break;
+    }
+
+    if (IselProfile::isEnabled()) {
+      isels[instruction.function]++;
+    }
+    offset += instruction.NumBytes();
+    result.nextAddress = instruction.next_pc;
+    result.numInstructions++;
+    result.successors = {instruction.next_pc};
+    if (instruction.IsControlFlow()) {
+      result.successors.clear();
+      result.call = instruction.IsFunctionCall();
+      if (instruction.IsConditionalBranch()) {
+        result.successors = {instruction.branch_taken_pc,
+                             instruction.branch_not_taken_pc};
+      } else if (instruction.IsDirectControlFlow()) {
+        result.successors = {instruction.branch_taken_pc};
+      }
+      break;
+    }
+  }
+
+  if (result.numInstructions == 0) {
+    function->eraseFromParent();
+    return result;
+  }
+
+  llvm::IRBuilder<> ir(block);
+  if (updatePc) {
+    // LiftIntoBlock keeps NEXT_PC in a local variable of the function
+    ir.CreateStore(remill::LoadNextProgramCounter(block, *intrinsics),
+                   remill::LoadProgramCounterRef(block));
+  }
+  ir.CreateRet(remill::LoadMemoryPointer(block, *intrinsics));
+  {
+    PhaseTimer timer(Phase::Lift);
+    materializeSemantics(function);
+  }
+  if (IselProfile::isEnabled()) {
+    IselProfile::tag(*function, isels);
+  }
+  result.function = function;
+  Metrics::add(Counter::Instructions, result.numInstructions);
+  return result;
+}
+
+std::vector<LiftedBlock> BlockLifter::liftRange(const Image &image,
+                                                const LiftRange &range) {
+  std::vector<LiftedBlock> blocks;
+  liftRange(image, range, [&blocks](const LiftedBlock &block) {
+    blocks.push_back(block);
+    return true;
+  });
+  return blocks;
+}
+
+bool BlockLifter::liftRange(
+    const Image &image, const LiftRange &range,
+    llvm::function_ref<bool(const LiftedBlock &)> callback) {
+  auto address = range.begin;
+  do {
+    auto bytes = image.bytesAt(address);
+    if (bytes.empty()) {
+      llvm::errs() << "Address not mapped in image: "
+                   << llvm::format_hex(address, 1) << "\n";
+      break;
+    }
+
+    auto block = liftBlock(address, bytes, range.end);
+    if (!block.function) {
+      break;
+    }
+    if (!callback(block)) {
+      return false;
+    }
+    address = block.nextAddress;
+  } while (address < range.end);
+  return true;
+}
+
+std::vector<uint64_t> BlockLifter::discoverBlocks(const Image &image,
+                                                  uint64_t entry) {
+  // Only decodes: a block ends at control flow or where decoding runs into
+  // an instruction another block already decoded, which then starts a block
+  std::set<uint64_t> leaders;
+  llvm::DenseSet<uint64_t> decoded;
+  std::vector<uint64_t> worklist{entry};
+  while (!worklist.empty() && leaders.size() < kMaxFunctionBlocks) {
+    auto address = worklist.back();
+    worklist.pop_back();
+    if (leaders.count(address)) {
+      continue;
+    }
+    leaders.insert(address);
+
+    remill::DecodingContext context = arch->CreateInitialContext();
+    auto maxInstructionSize = arch->MaxInstructionSize(context);
+    for (auto pc = address;;) {
+      if (pc != address && decoded.count(pc)) {
+        leaders.insert(pc);
+        break;
+      }
+      auto bytes = image.bytesAt(pc).substr(0, maxInstructionSize);
+      remill::Instruction instruction;
+      if (bytes.empty() || !decode(pc, bytes, instruction, context)) {
+        break;
+      }
+      decoded.insert(pc);
+
+      if (!instruction.IsControlFlow()) {
+        pc = instruction.next_pc;
+        continue;
+      }
+      if (instruction.IsFunctionCall()) {
+        worklist.push_back(instruction.next_pc);
+      } else if (instruction.IsConditionalBranch()) {
+        worklist.push_back(instruction.branch_not_taken_pc);
+        worklist.push_back(instruction.branch_taken_pc);
+      } else if (instruction.IsDirectControlFlow()) {
+        worklist.push_back(instruction.branch_taken_pc);
+      }
+      break;
+    }
+  }
+  return {leaders.begin(), leaders.end()};
+}
+
+LiftedFunction BlockLifter::liftFunction(const Image &image, uint64_t entry) {
+  LiftedFunction result;
+  result.entry = entry;
+
+  // The blocks have to leave NEXT_PC in State, the function dispatches on it
+  auto savedUpdatePc = updatePc;
+  updatePc = true;
+  std::vector<LiftedBlock> blocks;
+  auto leaders = discoverBlocks(image, entry);
+  for (size_t i = 0; i < leaders.size(); i++) {
+    auto end = i + 1 < leaders.size() ? leaders[i + 1] : 0;
+    auto block =
+        liftBlockAs(functionName(leaders[i]) + ".block", leaders[i],
+                    image.bytesAt(leaders[i]), end);
+    if (block.function) {
+      blocks.push_back(std::move(block));
+    }
+  }
+  updatePc = savedUpdatePc;
+  if (blocks.empty() || blocks.front().address != entry) {
+    for (auto &block : blocks) {
+      block.function->eraseFromParent();
+    }
+    return result;
+  }
+
+  auto &context = semantics->getContext();
+  auto head = blocks.front().function;
+  auto wordType = llvm::Type::getIntNTy(context, arch->address_size);
+  auto function =
+      llvm::Function::Create(head->getFunctionType(),
+                             llvm::GlobalValue::ExternalLinkage, "", semantics);
+  function->copyAttributesFrom(head);
+  auto state = function->getArg(0);
+  auto entryBlock = llvm::BasicBlock::Create(context, "", function);
+  auto exit = llvm::BasicBlock::Create(context, "exit", function);
+  llvm::DenseMap<uint64_t, llvm::BasicBlock *> bodies;
+  for (const auto &block : blocks) {
+    bodies[block.address] = llvm::BasicBlock::Create(
+        context, "block_" + llvm::utohexstr(block.address, true), function,
+        exit);
+  }
+
+  // The memory pointer lives in an alloca, SROA turns it into phis
+  llvm::IRBuilder<> ir(entryBlock);
+  auto memoryType = function->getReturnType();
+  auto memory = ir.CreateAlloca(memoryType, nullptr, "memory");
+  ir.CreateStore(function->getArg(2), memory);
+  ir.CreateBr(bodies[entry]);
+  ir.SetInsertPoint(exit);
+  ir.CreateRet(ir.CreateLoad(memoryType, memory));
+
+  auto calleeType = head->getFunctionType();
+  auto pc = arch->RegisterByName(arch->ProgramCounterRegisterName());
+  llvm::SmallVector<llvm::CallInst *, 64> calls;
+  for (const auto &block : blocks) {
+    ir.SetInsertPoint(bodies[block.address]);
+    auto call = ir.CreateCall(
+        block.function,
+        {state, llvm::ConstantInt::get(wordType, block.address),
+         ir.CreateLoad(memoryType, memory)});
+    ir.CreateStore(call, memory);
+    calls.push_back(call);
+
+    // Through the State argument, the PC variables of the blocks are inlined
+    auto pcRef = pc->AddressOf(state, ir.GetInsertBlock());
+    llvm::SmallVector<uint64_t, 2> successors(block.successors);
+    if (block.call) {
+      // The call leaves the target in the PC, the callee the return address
+      auto target = ir.CreateLoad(wordType, pcRef);
+      llvm::FunctionCallee callee = intrinsics->function_call;
+      if (!block.successors.empty()) {
+        auto address = block.successors.front();
+        callee =
+            semantics->getOrInsertFunction(functionName(address), calleeType);
+        if (!llvm::is_contained(result.callees, address)) {
+          result.callees.push_back(address);
+        }
+      }
+      auto returned = ir.CreateCall(
+          callee, {state, target, ir.CreateLoad(memoryType, memory)});
+      // Lifted functions are never inlined into each other
+      returned->setIsNoInline();
+      ir.CreateStore(returned, memory);
+      successors = {block.nextAddress};
+    }
+
+    auto nextPc = ir.CreateLoad(wordType, pcRef, "next_pc");
+    auto dispatch = ir.CreateSwitch(nextPc, exit, successors.size());
+    llvm::SmallDenseSet<uint64_t, 2> cases;
+    for (auto successor : successors) {
+      auto found = bodies.find(successor);
+      if (found != bodies.end() && cases.insert(successor).second) {
+        dispatch->addCase(llvm::ConstantInt::get(wordType, successor),
+                          found->second);
+      }
+    }
+    result.numInstructions += block.numInstructions;
+  }
+
+  {
+    PhaseTimer timer(Phase::Lift);
+    for (auto call : calls) {
+      llvm::InlineFunctionInfo info;
+      llvm::InlineFunction(*call, info);
+    }
+  }
+  for (auto &block : blocks) {
+    if (IselProfile::isEnabled()) {
+      IselProfile::merge(*function, *block.function);
+    }
+    block.function->eraseFromParent();
+  }
+
+  // Earlier functions may already call this one through a declaration
+  auto name = functionName(entry);
+  if (auto declaration = semantics->getFunction(name)) {
+    if (declaration->isDeclaration()) {
+      declaration->replaceAllUsesWith(function);
+      declaration->eraseFromParent();
+    }
+  }
+  function->setName(name);
+
+  result.function = function;
+  result.numBlocks = blocks.size();
+  Metrics::add(Counter::Functions, 1);
+  return result;
+}
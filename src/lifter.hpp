@@ -0,0 +1,116 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "decoder.hpp"
+#include "image.hpp"
+
+#include <remill/Arch/Arch.h>
+#include <remill/Arch/Instruction.h>
+#include <remill/BC/IntrinsicTable.h>
+
+#include <llvm/ADT/STLFunctionalExtras.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Module.h>
+
+/// The result of lifting a single basic block.
+struct LiftedBlock {
+  llvm::Function *function = nullptr;
+  uint64_t address = 0;
+  // Address of the first instruction after the block
+  uint64_t nextAddress = 0;
+  size_t numInstructions = 0;
+  // Statically known addresses the block can continue at (the fall-through
+  // and the targets of direct branches), empty for indirect control flow
+  llvm::SmallVector<uint64_t, 2> successors;
+  // Ends with a call, successors is the target of a direct call and the call
+  // returns to nextAddress
+  bool call = false;
+};
+
+/// The result of lifting a guest function with recursive descent.
+struct LiftedFunction {
+  llvm::Function *function = nullptr;
+  uint64_t entry = 0;
+  size_t numBlocks = 0;
+  size_t numInstructions = 0;
+  // Targets of the direct calls, the entries of other functions
+  llvm::SmallVector<uint64_t, 8> callees;
+};
+
+/// Lifts straight-line guest code into remill lifted functions.
+///
+/// Every instruction goes through the same DecodeInstruction -> LiftIntoBlock
+/// sequence as the examples, but instructions are lifted into the entry block
+/// of one function until a control flow instruction ends the basic block.
+class BlockLifter {
+public:
+  BlockLifter(const remill::Arch *arch, llvm::Module *semantics);
+
+  /// Lift the basic block at address. The bytes are not copied and should
+  /// start at address, decoding stops early when reaching end (if non-zero).
+  LiftedBlock liftBlock(uint64_t address, std::string_view bytes,
+                        uint64_t end = 0);
+
+  /// Lift all the basic blocks in range, stopping at the first block that
+  /// fails to lift (or is not mapped in the image).
+  std::vector<LiftedBlock> liftRange(const Image &image,
+                                     const LiftRange &range);
+
+  /// Like liftRange, but hands every block to callback as soon as it is
+  /// lifted. Lifting stops early when the callback returns false.
+  bool liftRange(const Image &image, const LiftRange &range,
+                 llvm::function_ref<bool(const LiftedBlock &)> callback);
+
+  /// Lift the function at entry into one function with an llvm::BasicBlock
+  /// per guest basic block.
+  ///
+  /// The blocks are found by recursive descent from entry over direct
+  /// branches, fall-throughs and the return addresses of calls. Every block
+  /// is lifted on its own and the function calls and inlines them in turn,
+  /// continuing with the successor the PC matches (like the traces of the
+  /// TranslationCache). Direct calls call lifted_<target>, which might be
+  /// lifted later, and indirect calls go through __remill_function_call.
+  /// Returns and indirect jumps leave the function with the PC in State.
+  LiftedFunction liftFunction(const Image &image, uint64_t entry);
+
+  /// Decode through cache instead of calling DecodeInstruction directly.
+  void setDecodeCache(DecodeCache *cache) { decodeCache = cache; }
+
+  /// Store NEXT_PC into the program counter register before returning, so
+  /// whoever executes the block knows where to continue.
+  void setUpdatePc(bool enabled) { updatePc = enabled; }
+
+  /// Deterministic name of the lifted function for a guest address.
+  static std::string functionName(uint64_t address);
+
+  /// Inverse of functionName, std::nullopt for other functions.
+  static std::optional<uint64_t> functionAddress(llvm::StringRef name);
+
+  /// Erase the declarations of lifted functions that nothing calls anymore,
+  /// which liftFunction adds to the semantics for its direct calls. For
+  /// semantics modules that outlive the functions lifted into them.
+  static void eraseUnusedDeclarations(llvm::Module &module);
+
+private:
+  // Upper bound of the basic blocks of one function
+  static constexpr size_t kMaxFunctionBlocks = 4096;
+
+  bool decode(uint64_t address, std::string_view bytes,
+              remill::Instruction &instruction,
+              remill::DecodingContext &context);
+  LiftedBlock liftBlockAs(const std::string &name, uint64_t address,
+                          std::string_view bytes, uint64_t end);
+  std::vector<uint64_t> discoverBlocks(const Image &image, uint64_t entry);
+
+  const remill::Arch *arch = nullptr;
+  llvm::Module *semantics = nullptr;
+  const remill::IntrinsicTable *intrinsics = nullptr;
+  DecodeCache *decodeCache = nullptr;
+  bool updatePc = false;
+};
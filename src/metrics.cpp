@@ -0,0 +1,63 @@
+#include "metrics.hpp"
+
+#include <iterator>
+
+#include <llvm/Support/Format.h>
+#include <llvm/Support/JSON.h>
+
+static const char *const kPhaseNames[] = {
+    "semantics_load", "hotpatch_link", "decode", "lift", "optimize", "output",
+};
+
+static const char *const kCounterNames[] = {
+    "instructions",           "functions",
+    "ir_instructions_before", "ir_instructions_after",
+    "isel_overridden",        "dead_flag_stores",
+    "folded_reads",
+};
+
+static_assert(std::size(kPhaseNames) ==
+              static_cast<size_t>(Phase::NumPhases));
+static_assert(std::size(kCounterNames) ==
+              static_cast<size_t>(Counter::NumCounters));
+
+void Metrics::write(llvm::raw_ostream &os, MetricsFormat format) {
+  auto seconds = [](uint64_t nanoseconds) { return nanoseconds / 1e9; };
+
+  if (format == MetricsFormat::Prometheus) {
+    os << "# TYPE remill_phase_seconds_total counter\n";
+    for (unsigned i = 0; i < kNumPhases; i++) {
+      os << "remill_phase_seconds_total{phase=\"" << kPhaseNames[i] << "\"} "
+         << llvm::format("%.9f", seconds(phaseNanoseconds[i].load())) << "\n";
+    }
+    os << "# TYPE remill_phase_calls_total counter\n";
+    for (unsigned i = 0; i < kNumPhases; i++) {
+      os << "remill_phase_calls_total{phase=\"" << kPhaseNames[i] << "\"} "
+         << phaseCalls[i].load() << "\n";
+    }
+    for (unsigned i = 0; i < kNumCounters; i++) {
+      os << "# TYPE remill_" << kCounterNames[i] << "_total counter\n"
+         << "remill_" << kCounterNames[i] << "_total " << counters[i].load()
+         << "\n";
+    }
+    return;
+  }
+
+  llvm::json::OStream json(os, /*IndentSize=*/2);
+  json.object([&] {
+    json.attributeObject("phases", [&] {
+      for (unsigned i = 0; i < kNumPhases; i++) {
+        json.attributeObject(kPhaseNames[i], [&] {
+          json.attribute("seconds", seconds(phaseNanoseconds[i].load()));
+          json.attribute("calls", phaseCalls[i].load());
+        });
+      }
+    });
+    json.attributeObject("counters", [&] {
+      for (unsigned i = 0; i < kNumCounters; i++) {
+        json.attribute(kCounterNames[i], counters[i].load());
+      }
+    });
+  });
+  os << "\n";
+}
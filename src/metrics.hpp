@@ -0,0 +1,101 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include <llvm/Support/raw_ostream.h>
+
+/// Phases of a lifting job that are timed when metrics are enabled.
+enum class Phase : unsigned {
+  SemanticsLoad,
+  HotpatchLink,
+  Decode,
+  Lift,
+  Optimize,
+  Output,
+  NumPhases,
+};
+
+/// Totals collected when metrics are enabled.
+enum class Counter : unsigned {
+  // Guest instructions lifted
+  Instructions,
+  // Lifted functions
+  Functions,
+  // Instructions of the lifted functions before and after optimization
+  IRInstructionsBefore,
+  IRInstructionsAfter,
+  // ISEL_* globals replaced by the hotpatch
+  IselOverridden,
+  // Flag stores removed by FlagEliminationPass
+  DeadFlagStores,
+  // Reads from read-only image memory replaced by ConstantMemoryPass
+  FoldedReads,
+  NumCounters,
+};
+
+enum class MetricsFormat { Json, Prometheus };
+
+/// Process-wide phase timers and counters.
+///
+/// Metrics are disabled by default and have to be enabled before any worker
+/// thread starts. Disabled timers do not read the clock and disabled counters
+/// are a single predictable branch. The totals are atomics, so workers can
+/// record into them without locking.
+class Metrics {
+public:
+  static void enable() { enabled = true; }
+  static bool isEnabled() { return enabled; }
+
+  static void addTime(Phase phase, std::chrono::nanoseconds duration) {
+    auto index = static_cast<unsigned>(phase);
+    phaseNanoseconds[index].fetch_add(duration.count(),
+                                      std::memory_order_relaxed);
+    phaseCalls[index].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  static void add(Counter counter, uint64_t value) {
+    if (enabled) {
+      counters[static_cast<unsigned>(counter)].fetch_add(
+          value, std::memory_order_relaxed);
+    }
+  }
+
+  static void write(llvm::raw_ostream &os, MetricsFormat format);
+
+private:
+  static constexpr auto kNumPhases = static_cast<unsigned>(Phase::NumPhases);
+  static constexpr auto kNumCounters =
+      static_cast<unsigned>(Counter::NumCounters);
+
+  static inline bool enabled = false;
+  static inline std::atomic<uint64_t> phaseNanoseconds[kNumPhases] = {};
+  static inline std::atomic<uint64_t> phaseCalls[kNumPhases] = {};
+  static inline std::atomic<uint64_t> counters[kNumCounters] = {};
+};
+
+/// Adds the time until the end of the scope to a phase.
+class PhaseTimer {
+public:
+  explicit PhaseTimer(Phase phase) : phase(phase) {
+    if (Metrics::isEnabled()) {
+      start = Clock::now();
+    }
+  }
+
+  ~PhaseTimer() {
+    if (start != Clock::time_point()) {
+      Metrics::addTime(phase, Clock::now() - start);
+    }
+  }
+
+  PhaseTimer(const PhaseTimer &) = delete;
+  PhaseTimer &operator=(const PhaseTimer &) = delete;
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  Phase phase;
+  Clock::time_point start;
+};
@@ -0,0 +1,79 @@
+#include "objcache.hpp"
+#include "extract.hpp"
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/SHA1.h>
+
+DiskObjectCache::DiskObjectCache(std::filesystem::path directory,
+                                 std::string salt)
+    : directory(std::move(directory)), salt(std::move(salt)) {}
+
+std::string DiskObjectCache::cacheKey(const llvm::Module &module) const {
+  auto bitcode = writeBitcode(module);
+  llvm::SHA1 hasher;
+  hasher.update(salt);
+  hasher.update(llvm::StringRef("\0", 1));
+  hasher.update(llvm::StringRef(bitcode.data(), bitcode.size()));
+  return llvm::toHex(hasher.final(), /*LowerCase=*/true);
+}
+
+std::unique_ptr<llvm::MemoryBuffer>
+DiskObjectCache::getObject(const llvm::Module *module) {
+  auto key = cacheKey(*module);
+  auto path = directory / (key + ".o");
+  auto buffer = llvm::MemoryBuffer::getFile(path.string(), /*IsText=*/false,
+                                            /*RequiresNullTerminator=*/false);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if (buffer) {
+    numHits++;
+    return std::move(*buffer);
+  }
+  numMisses++;
+  pending[module] = std::move(key);
+  return nullptr;
+}
+
+void DiskObjectCache::notifyObjectCompiled(const llvm::Module *module,
+                                           llvm::MemoryBufferRef object) {
+  std::string key;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = pending.find(module);
+    if (found == pending.end()) {
+      return;
+    }
+    key = std::move(found->second);
+    pending.erase(found);
+  }
+
+  std::error_code ec;
+  std::filesystem::create_directories(directory, ec);
+
+  // Write to a temporary file and rename it so concurrent processes never
+  // observe a partially written entry
+  int fd = -1;
+  llvm::SmallString<256> tempPath;
+  auto path = directory / (key + ".o");
+  auto model = path.string() + ".%%%%%%.tmp";
+  if (llvm::sys::fs::createUniqueFile(model, fd, tempPath)) {
+    llvm::errs() << "Failed to create object cache entry in "
+                 << directory.string() << "\n";
+    return;
+  }
+
+  {
+    llvm::raw_fd_ostream os(fd, /*shouldClose=*/true);
+    os << object.getBuffer();
+  }
+
+  if (llvm::sys::fs::rename(tempPath, path.string())) {
+    llvm::sys::fs::remove(tempPath);
+  }
+}
+
+void DiskObjectCache::printStats(llvm::raw_ostream &os) const {
+  os << "Object cache: " << numHits << " hits, " << numMisses << " misses\n";
+}
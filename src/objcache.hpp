@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ExecutionEngine/ObjectCache.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+
+/// On-disk cache of the object code the JIT compiles for lifted modules.
+///
+/// An entry is <directory>/<sha1>.o where the hash covers the bitcode of the
+/// module handed to the backend (the optimized lifted code with the helpers
+/// already linked in) and salt. The salt has to cover everything else that
+/// changes the generated code: the helpers, the target triple, CPU and
+/// features and the LLVM version.
+class DiskObjectCache : public llvm::ObjectCache {
+public:
+  DiskObjectCache(std::filesystem::path directory, std::string salt);
+
+  void notifyObjectCompiled(const llvm::Module *module,
+                            llvm::MemoryBufferRef object) override;
+  std::unique_ptr<llvm::MemoryBuffer>
+  getObject(const llvm::Module *module) override;
+
+  uint64_t getHits() const { return numHits; }
+  uint64_t getMisses() const { return numMisses; }
+
+  void printStats(llvm::raw_ostream &os) const;
+
+private:
+  std::string cacheKey(const llvm::Module &module) const;
+
+  std::filesystem::path directory;
+  std::string salt;
+  std::mutex mutex;
+  // Keys of the modules that missed, getObject and notifyObjectCompiled see
+  // the same module
+  llvm::DenseMap<const llvm::Module *, std::string> pending;
+  uint64_t numHits = 0;
+  uint64_t numMisses = 0;
+};
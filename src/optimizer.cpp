@@ -0,0 +1,290 @@
+#include "optimizer.hpp"
+#include "metrics.hpp"
+#include "profile.hpp"
+#include "scalarize.hpp"
+
+#include <remill/BC/Optimizer.h>
+
+#include <chrono>
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringSwitch.h>
+#include <llvm/Analysis/AssumptionCache.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/StructuralHash.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+
+// SROA first so instcombine and DSE see SSA values instead of State and
+// memory pointer allocas
+static const char kFastPipeline[] =
+    "sroa,early-cse,instcombine,dse,simplifycfg";
+
+// Runs after the O3 simplification pipeline, every round. Opaque predicates
+// and split constants of VM handlers need SCCP and GVN to fold, and each fold
+// exposes more for the next round.
+static const char kDeobfuscatePipeline[] =
+    "sccp,correlated-propagation,jump-threading,gvn,reassociate,"
+    "aggressive-instcombine,instcombine,bdce,dse,adce,simplifycfg";
+
+/// Returns the callees of function that have a body (the semantic functions and
+/// the runtime helpers they use). Calls marked noinline (between lifted
+/// functions) are skipped.
+static llvm::SmallVector<llvm::CallBase *, 32>
+definedCalls(llvm::Function *function) {
+  llvm::SmallVector<llvm::CallBase *, 32> calls;
+  for (auto &instruction : llvm::instructions(*function)) {
+    if (auto call = llvm::dyn_cast<llvm::CallBase>(&instruction)) {
+      auto callee = call->getCalledFunction();
+      if (callee && callee != function && !callee->isDeclaration() &&
+          !call->isNoInline()) {
+        calls.push_back(call);
+      }
+    }
+  }
+  return calls;
+}
+
+IncrementalOptimizer::IncrementalOptimizer() {
+  // Same as remill: keep the optimizer from introducing calls to library
+  // functions (memset, memcpy, ...) that lifted code cannot resolve
+  libraryInfo.disableAllFunctions();
+  fam.registerPass([this] { return llvm::TargetLibraryAnalysis(libraryInfo); });
+
+  pb.registerModuleAnalyses(mam);
+  pb.registerCGSCCAnalyses(cgam);
+  pb.registerFunctionAnalyses(fam);
+  pb.registerLoopAnalyses(lam);
+  pb.crossRegisterProxies(lam, fam, cgam, mam);
+
+  setPipeline(PipelinePreset::Default);
+}
+
+std::optional<PipelinePreset> parsePipelinePreset(llvm::StringRef name) {
+  return llvm::StringSwitch<std::optional<PipelinePreset>>(name)
+      .Case("default", PipelinePreset::Default)
+      .Case("fast", PipelinePreset::Fast)
+      .Case("deobfuscate", PipelinePreset::Deobfuscate)
+      .Case("custom", PipelinePreset::Custom)
+      .Default(std::nullopt);
+}
+
+llvm::StringRef pipelinePresetName(PipelinePreset preset) {
+  switch (preset) {
+  case PipelinePreset::Default:
+    return "default";
+  case PipelinePreset::Fast:
+    return "fast";
+  case PipelinePreset::Deobfuscate:
+    return "deobfuscate";
+  case PipelinePreset::Custom:
+    return "custom";
+  }
+  return "unknown";
+}
+
+bool IncrementalOptimizer::setPipeline(PipelinePreset newPreset,
+                                       llvm::StringRef text) {
+  llvm::FunctionPassManager pipeline;
+  llvm::Error error = llvm::Error::success();
+  switch (newPreset) {
+  case PipelinePreset::Default:
+    pipeline = pb.buildFunctionSimplificationPipeline(
+        llvm::OptimizationLevel::O3, llvm::ThinOrFullLTOPhase::None);
+    break;
+  case PipelinePreset::Fast:
+    error = pb.parsePassPipeline(pipeline, kFastPipeline);
+    break;
+  case PipelinePreset::Deobfuscate:
+    pipeline = pb.buildFunctionSimplificationPipeline(
+        llvm::OptimizationLevel::O3, llvm::ThinOrFullLTOPhase::None);
+    error = pb.parsePassPipeline(pipeline, kDeobfuscatePipeline);
+    break;
+  case PipelinePreset::Custom:
+    error = pb.parsePassPipeline(pipeline, text);
+    break;
+  }
+  if (error) {
+    llvm::errs() << "Invalid " << pipelinePresetName(newPreset)
+                 << " pipeline: " << llvm::toString(std::move(error)) << "\n";
+    return false;
+  }
+
+  fpm = std::move(pipeline);
+  preset = newPreset;
+  return true;
+}
+
+void IncrementalOptimizer::optimize(llvm::Function *function) {
+  auto start = std::chrono::steady_clock::now();
+  optimizeCallees(function);
+  inlineCallees(function);
+  stats.instructionsBefore += function->getInstructionCount();
+  if (freezeUndefined) {
+    UndefinedValuePass().run(*function, fam);
+  }
+  if (flagElimination) {
+    flagElimination->run(*function, fam);
+  }
+  if (scalarizeState) {
+    // Only the lifted function, State is not its first argument in the
+    // semantics
+    StateScalarizationPass().run(*function, fam);
+  }
+  runPipeline(function);
+  if (constantMemory) {
+    for (unsigned iteration = 0; iteration < kMaxIterations; iteration++) {
+      if (constantMemory->run(*function, fam).areAllPreserved()) {
+        break;
+      }
+      runPipeline(function);
+    }
+  }
+  stats.instructionsAfter += function->getInstructionCount();
+  stats.seconds += std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  stats.numFunctions++;
+}
+
+void IncrementalOptimizer::setFlagElimination(const remill::Arch *arch) {
+  flagElimination.reset();
+  if (arch) {
+    flagElimination.emplace(arch);
+  }
+}
+
+void IncrementalOptimizer::setConstantMemory(const Image *image) {
+  constantMemory.reset();
+  if (image) {
+    constantMemory.emplace(image);
+  }
+}
+
+void IncrementalOptimizer::printStats(llvm::raw_ostream &os) const {
+  auto delta = stats.instructionsBefore
+                   ? 100.0 * (static_cast<double>(stats.instructionsAfter) -
+                              static_cast<double>(stats.instructionsBefore)) /
+                         static_cast<double>(stats.instructionsBefore)
+                   : 0.0;
+  os << "Pipeline " << pipelinePresetName(preset) << ": "
+     << stats.numFunctions << " functions in "
+     << llvm::format("%.3f", stats.seconds * 1000) << " ms, "
+     << stats.instructionsBefore << " -> " << stats.instructionsAfter
+     << " IR instructions (" << llvm::format("%+.1f", delta) << "%)\n";
+}
+
+void IncrementalOptimizer::forget(llvm::Function *function) {
+  optimizedCallees.erase(function);
+  fam.clear(*function, function->getName());
+}
+
+void IncrementalOptimizer::optimizeCallees(llvm::Function *function) {
+  // Post-order over the semantic call graph, so every callee is simplified
+  // (and already has its own callees inlined) before it gets inlined
+  for (auto call : definedCalls(function)) {
+    auto callee = call->getCalledFunction();
+    if (!optimizedCallees.insert(callee).second) {
+      continue;
+    }
+    optimizeCallees(callee);
+    inlineCallees(callee);
+    runPipeline(callee);
+  }
+}
+
+void IncrementalOptimizer::inlineCallees(llvm::Function *function) {
+  auto getAssumptionCache =
+      [this](llvm::Function &f) -> llvm::AssumptionCache & {
+    return fam.getResult<llvm::AssumptionAnalysis>(f);
+  };
+
+  // Semantics are not recursive, the limit only guards against broken patches
+  for (int iteration = 0; iteration < 16; iteration++) {
+    auto calls = definedCalls(function);
+    if (calls.empty()) {
+      break;
+    }
+    for (auto call : calls) {
+      llvm::InlineFunctionInfo info(nullptr, getAssumptionCache);
+      llvm::InlineFunction(*call, info);
+    }
+  }
+}
+
+void IncrementalOptimizer::runPipeline(llvm::Function *function) {
+  // The function was changed outside of the pass manager
+  fam.invalidate(*function, llvm::PreservedAnalyses::none());
+  if (preset != PipelinePreset::Deobfuscate) {
+    fpm.run(*function, fam);
+    return;
+  }
+
+  auto hash = llvm::StructuralHash(*function, /*DetailedHash=*/true);
+  for (unsigned iteration = 0; iteration < kMaxIterations; iteration++) {
+    fpm.run(*function, fam);
+    auto next = llvm::StructuralHash(*function, /*DetailedHash=*/true);
+    if (next == hash) {
+      break;
+    }
+    hash = next;
+  }
+}
+
+void optimizeLifted(const remill::Arch *arch, llvm::Module *semantics,
+                    const std::vector<llvm::Function *> &functions,
+                    IncrementalOptimizer *incremental) {
+  auto countInstructions = [&functions](Counter counter) {
+    if (Metrics::isEnabled()) {
+      uint64_t count = 0;
+      for (auto function : functions) {
+        count += function->getInstructionCount();
+      }
+      Metrics::add(counter, count);
+    }
+  };
+
+  // The incremental optimizer charges the semantics of every function with
+  // its own time, OptimizeModule with the time of all of them
+  auto profile = IselProfile::isEnabled();
+  std::vector<IselUses> isels;
+  if (profile) {
+    for (auto function : functions) {
+      isels.push_back(IselProfile::take(*function));
+    }
+  }
+  using Clock = std::chrono::steady_clock;
+
+  countInstructions(Counter::IRInstructionsBefore);
+  {
+    PhaseTimer timer(Phase::Optimize);
+    if (incremental) {
+      for (size_t i = 0; i < functions.size(); i++) {
+        auto start = profile ? Clock::now() : Clock::time_point();
+        incremental->optimize(functions[i]);
+        if (profile) {
+          IselProfile::record(isels[i], Clock::now() - start,
+                              functions[i]->getInstructionCount());
+        }
+      }
+    } else {
+      auto start = profile ? Clock::now() : Clock::time_point();
+      remill::OptimizeModule(arch, semantics, functions);
+      if (profile) {
+        auto elapsed = Clock::now() - start;
+        IselUses all;
+        uint64_t numInstructions = 0;
+        for (size_t i = 0; i < functions.size(); i++) {
+          for (const auto &use : isels[i]) {
+            all[use.getKey()].count += use.getValue().count;
+            all[use.getKey()].weight += use.getValue().weight;
+          }
+          numInstructions += functions[i]->getInstructionCount();
+        }
+        IselProfile::record(all, elapsed, numInstructions);
+      }
+    }
+  }
+  countInstructions(Counter::IRInstructionsAfter);
+}
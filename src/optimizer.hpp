@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "constmem.hpp"
+#include "flags.hpp"
+#include "undefined.hpp"
+
+#include <remill/Arch/Arch.h>
+
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/Analysis/CGSCCPassManager.h>
+#include <llvm/Analysis/LoopAnalysisManager.h>
+#include <llvm/Analysis/TargetLibraryInfo.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/PassManager.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/raw_ostream.h>
+
+/// Function pipelines the IncrementalOptimizer can run.
+enum class PipelinePreset {
+  // The O3 function simplification pipeline
+  Default,
+  // SROA, instcombine and DSE only, for bulk lifting throughput
+  Fast,
+  // An aggressive pipeline, repeated until the IR stops changing (VM handlers)
+  Deobfuscate,
+  // A textual new pass manager function pipeline
+  Custom,
+};
+
+std::optional<PipelinePreset> parsePipelinePreset(llvm::StringRef name);
+llvm::StringRef pipelinePresetName(PipelinePreset preset);
+
+/// What the optimizer did to the lifted functions it was given.
+struct OptimizerStats {
+  uint64_t numFunctions = 0;
+  double seconds = 0;
+  // Instructions after inlining the semantics and after the pipeline
+  uint64_t instructionsBefore = 0;
+  uint64_t instructionsAfter = 0;
+};
+
+/// Optimize lifted functions one at a time with the new pass manager.
+///
+/// remill::OptimizeModule runs its pipeline over the whole semantics module,
+/// which grows with every lifted function. This optimizer instead runs the
+/// function simplification pipeline on the semantic callees a lifted function
+/// reaches (once, the first time they are used), inlines them and then runs
+/// the pipeline on the lifted function. The analysis managers live as long as
+/// the optimizer, so results for the semantic functions stay cached between
+/// calls.
+///
+/// It never visits functions that were not reached, which also makes it safe
+/// to use on lazily loaded semantics modules.
+///
+/// Between inlining and the pipeline, UndefinedValuePass lowers undefined
+/// values to freeze poison (see setFreezeUndefined), FlagEliminationPass
+/// removes the flag computations nothing reads (see setFlagElimination) and
+/// StateScalarizationPass promotes the State accesses of the lifted function
+/// (see setScalarizeState). After the pipeline, ConstantMemoryPass folds reads
+/// of read-only image memory (see setConstantMemory) and the pipeline runs
+/// again, until nothing folds.
+class IncrementalOptimizer {
+public:
+  IncrementalOptimizer();
+
+  /// Replace the pipeline (PipelinePreset::Default until then). text is
+  /// the pipeline for PipelinePreset::Custom, e.g. "sroa,instcombine,dse".
+  /// Returns false when it does not parse.
+  bool setPipeline(PipelinePreset preset, llvm::StringRef text = "");
+  PipelinePreset getPipeline() const { return preset; }
+
+  /// Run StateScalarizationPass on lifted functions (off by default).
+  void setScalarizeState(bool enable) { scalarizeState = enable; }
+
+  /// Run UndefinedValuePass on lifted functions (off by default, the calls to
+  /// __remill_undefined_* stay and the helpers define them).
+  void setFreezeUndefined(bool enable) { freezeUndefined = enable; }
+
+  /// Run FlagEliminationPass with the flags of arch on lifted functions,
+  /// nullptr (the default) disables it.
+  void setFlagElimination(const remill::Arch *arch);
+
+  /// Run ConstantMemoryPass with the read-only segments of image on lifted
+  /// functions, nullptr (the default) disables it. image has to outlive the
+  /// optimizer.
+  void setConstantMemory(const Image *image);
+
+  void optimize(llvm::Function *function);
+
+  /// Drop the cached analyses of function, call this before erasing it.
+  void forget(llvm::Function *function);
+
+  const OptimizerStats &getStats() const { return stats; }
+  void printStats(llvm::raw_ostream &os) const;
+
+private:
+  // Upper bound of the fixed points (deobfuscate pipeline, constant memory)
+  static constexpr unsigned kMaxIterations = 8;
+
+  void optimizeCallees(llvm::Function *function);
+  void inlineCallees(llvm::Function *function);
+  void runPipeline(llvm::Function *function);
+
+  llvm::TargetLibraryInfoImpl libraryInfo;
+  llvm::LoopAnalysisManager lam;
+  llvm::FunctionAnalysisManager fam;
+  llvm::CGSCCAnalysisManager cgam;
+  llvm::ModuleAnalysisManager mam;
+  llvm::PassBuilder pb;
+  llvm::FunctionPassManager fpm;
+  PipelinePreset preset = PipelinePreset::Default;
+  bool scalarizeState = false;
+  bool freezeUndefined = false;
+  std::optional<FlagEliminationPass> flagElimination;
+  std::optional<ConstantMemoryPass> constantMemory;
+  llvm::SmallPtrSet<llvm::Function *, 256> optimizedCallees;
+  OptimizerStats stats;
+};
+
+/// Optimize freshly lifted functions, with remill::OptimizeModule when no
+/// incremental optimizer is passed.
+///
+/// A lazily loaded semantics module cannot go through remill::OptimizeModule,
+/// because its pipeline would also visit the unmaterialized semantic functions.
+void optimizeLifted(const remill::Arch *arch, llvm::Module *semantics,
+                    const std::vector<llvm::Function *> &functions,
+                    IncrementalOptimizer *incremental);
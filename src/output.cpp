@@ -0,0 +1,112 @@
+#include "output.hpp"
+#include "extract.hpp"
+#include "lifter.hpp"
+
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Format.h>
+
+DirectoryOutput::DirectoryOutput(std::filesystem::path directory)
+    : directory(std::move(directory)) {}
+
+bool DirectoryOutput::write(uint64_t address, const llvm::Module &module) {
+  std::error_code ec;
+  std::filesystem::create_directories(directory, ec);
+
+  auto path = directory / (BlockLifter::functionName(address) + ".bc");
+  llvm::raw_fd_ostream os(path.string(), ec, llvm::sys::fs::OF_None);
+  if (ec) {
+    llvm::errs() << "Failed to open " << path.string() << ": " << ec.message()
+                 << "\n";
+    return false;
+  }
+  llvm::WriteBitcodeToFile(module, os);
+  return true;
+}
+
+ShardedOutput::ShardedOutput(std::filesystem::path directory,
+                             uint64_t maxShardSize)
+    : directory(std::move(directory)), maxShardSize(maxShardSize) {}
+
+bool ShardedOutput::openShard() {
+  if (shard) {
+    shard->close();
+    shardIndex++;
+  }
+
+  shardName.clear();
+  llvm::raw_string_ostream(shardName)
+      << llvm::format("shard-%04u.bc", shardIndex);
+
+  auto path = (directory / shardName).string();
+  std::error_code ec;
+  shard = std::make_unique<llvm::raw_fd_ostream>(path, ec,
+                                                 llvm::sys::fs::OF_None);
+  if (ec) {
+    llvm::errs() << "Failed to open " << path << ": " << ec.message() << "\n";
+    shard.reset();
+    return false;
+  }
+  return true;
+}
+
+bool ShardedOutput::write(uint64_t address, const llvm::Module &module) {
+  if (!index) {
+    std::error_code ec;
+    std::filesystem::create_directories(directory, ec);
+
+    auto path = (directory / "index.txt").string();
+    index = std::make_unique<llvm::raw_fd_ostream>(path, ec,
+                                                   llvm::sys::fs::OF_Text);
+    if (ec) {
+      llvm::errs() << "Failed to open " << path << ": " << ec.message()
+                   << "\n";
+      index.reset();
+      return false;
+    }
+    if (!openShard()) {
+      return false;
+    }
+  }
+  if (!shard) {
+    return false;
+  }
+
+  auto bitcode = writeBitcode(module);
+  auto offset = shard->tell();
+  if (offset != 0 && offset + bitcode.size() > maxShardSize) {
+    if (!openShard()) {
+      return false;
+    }
+    offset = 0;
+  }
+
+  // The bitcode reader requires 4-byte aligned buffers
+  shard->write(bitcode.data(), bitcode.size());
+  while (shard->tell() % 4 != 0) {
+    *shard << '\0';
+  }
+  *index << llvm::format_hex(address, 1) << ' ' << shardName << ' ' << offset
+         << ' ' << bitcode.size() << '\n';
+  return !shard->has_error();
+}
+
+bool ShardedOutput::finish() {
+  if (shard) {
+    shard->close();
+    if (shard->has_error()) {
+      llvm::errs() << "Failed to write " << shardName << "\n";
+      shard->clear_error();
+      return false;
+    }
+  }
+  if (index) {
+    index->close();
+    if (index->has_error()) {
+      llvm::errs() << "Failed to write the shard index\n";
+      index->clear_error();
+      return false;
+    }
+  }
+  return true;
+}
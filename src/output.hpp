@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <string>
+
+#include <llvm/IR/Module.h>
+#include <llvm/Support/raw_ostream.h>
+
+/// Destination for lifted functions extracted into their own module.
+class LiftedOutput {
+public:
+  virtual ~LiftedOutput() = default;
+
+  /// Serialize the module holding the lifted function at address.
+  virtual bool write(uint64_t address, const llvm::Module &module) = 0;
+
+  /// Called once after the last function was written.
+  virtual bool finish() { return true; }
+};
+
+/// Writes every module to <directory>/lifted_<address>.bc
+class DirectoryOutput : public LiftedOutput {
+public:
+  explicit DirectoryOutput(std::filesystem::path directory);
+
+  bool write(uint64_t address, const llvm::Module &module) override;
+
+private:
+  std::filesystem::path directory;
+};
+
+/// Streams modules as bitcode into size-bounded shard files.
+///
+/// Every module is appended to <directory>/shard-<N>.bc at a 4-byte aligned
+/// offset, a new shard is started when the current one would grow past
+/// maxShardSize. <directory>/index.txt has one line per module:
+///
+///   <address> <shard file> <offset> <size>
+///
+/// so a consumer can mmap a shard and parse a single module with
+/// llvm::parseBitcodeFile on the [offset, offset + size) slice.
+class ShardedOutput : public LiftedOutput {
+public:
+  ShardedOutput(std::filesystem::path directory, uint64_t maxShardSize);
+
+  bool write(uint64_t address, const llvm::Module &module) override;
+  bool finish() override;
+
+private:
+  bool openShard();
+
+  std::filesystem::path directory;
+  uint64_t maxShardSize = 0;
+  unsigned shardIndex = 0;
+  std::string shardName;
+  std::unique_ptr<llvm::raw_fd_ostream> shard;
+  std::unique_ptr<llvm::raw_fd_ostream> index;
+};
@@ -0,0 +1,229 @@
+#include "patches.hpp"
+#include "metrics.hpp"
+#include "optimizer.hpp"
+#include "semantics.hpp"
+
+#include <algorithm>
+#include <set>
+
+#include <llvm/IR/Constants.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Utils/ModuleUtils.h>
+
+static std::filesystem::file_time_type
+modifiedTime(const std::filesystem::path &path) {
+  std::error_code ec;
+  auto time = std::filesystem::last_write_time(path, ec);
+  return ec ? std::filesystem::file_time_type() : time;
+}
+
+bool PatchManager::load(const std::filesystem::path &path) {
+  PhaseTimer timer(Phase::HotpatchLink);
+  auto modified = modifiedTime(path);
+  auto patchModule = parsePatch(semantics, path.string());
+  if (!patchModule) {
+    failed[path] = modified;
+    return false;
+  }
+
+  // Name the ISEL_* globals of this version apart from the semantics and the
+  // other versions, the linker would merge them otherwise
+  auto suffix = ".patch" + std::to_string(nextVersion++);
+  std::vector<std::string> names;
+  for (auto &global : patchModule->globals()) {
+    const auto &name = global.getName().str();
+    if (name.rfind("ISEL_", 0) != 0 || !global.hasInitializer()) {
+      continue;
+    }
+    if (!semantics.getGlobalVariable(name, /*AllowInternal=*/true)) {
+      llvm::errs() << "Hotpatch " << path.string() << " defines unknown "
+                   << name << "\n";
+      continue;
+    }
+    names.push_back(name);
+  }
+  // Everything else the patch defines becomes internal, so no version ever
+  // clashes with or overrides a definition that is already in use
+  for (auto &global : patchModule->global_values()) {
+    // llvm.used and friends have to keep their appending linkage
+    if (!global.isDeclaration() && !global.hasLocalLinkage() &&
+        !global.hasAppendingLinkage()) {
+      if (auto object = llvm::dyn_cast<llvm::GlobalObject>(&global)) {
+        object->setComdat(nullptr);
+      }
+      global.setLinkage(llvm::GlobalValue::InternalLinkage);
+    }
+  }
+  // The functions get the suffix too, so the linker keeps their names and
+  // they can be found again to release them
+  std::vector<std::string> functionNames;
+  for (auto &function : *patchModule) {
+    if (!function.isDeclaration()) {
+      function.setName(function.getName() + suffix);
+      functionNames.push_back(function.getName().str());
+    }
+  }
+  for (const auto &name : names) {
+    auto global = patchModule->getGlobalVariable(name, /*AllowInternal=*/true);
+    global->setName(name + suffix);
+    global->setLinkage(llvm::GlobalValue::ExternalLinkage);
+  }
+
+  if (llvm::Linker::linkModules(semantics, std::move(patchModule))) {
+    llvm::errs() << "Failed to link hotpatch " << path.string() << "\n";
+    failed[path] = modified;
+    return false;
+  }
+  failed.erase(path);
+
+  Patch patch;
+  patch.path = path;
+  patch.modified = modified;
+  std::set<std::string> affected;
+  for (const auto &name : names) {
+    auto global = semantics.getGlobalVariable(name + suffix, true);
+    // Keep it from being removed as unused before it is released
+    llvm::appendToCompilerUsed(semantics, {global});
+    patch.isels[name] = global;
+    affected.insert(name);
+  }
+  for (const auto &name : functionNames) {
+    if (auto function = semantics.getFunction(name)) {
+      patch.functions.push_back(function);
+    }
+  }
+
+  auto existing =
+      std::find_if(patches.begin(), patches.end(),
+                   [&](const Patch &loaded) { return loaded.path == path; });
+  // A reloaded patch counts as loaded last, like a new one
+  Patch previous;
+  if (existing != patches.end()) {
+    previous = std::move(*existing);
+    patches.erase(existing);
+    for (const auto &[name, global] : previous.isels) {
+      affected.insert(name);
+    }
+  }
+  patches.push_back(std::move(patch));
+  for (const auto &name : affected) {
+    activate(name);
+  }
+  release(previous);
+  return true;
+}
+
+void PatchManager::unload(const std::filesystem::path &path) {
+  failed.erase(path);
+  auto existing =
+      std::find_if(patches.begin(), patches.end(),
+                   [&](const Patch &loaded) { return loaded.path == path; });
+  if (existing == patches.end()) {
+    return;
+  }
+  auto patch = std::move(*existing);
+  patches.erase(existing);
+  for (const auto &[name, global] : patch.isels) {
+    activate(name);
+  }
+  release(patch);
+  llvm::outs() << "Unloaded hotpatch " << path.string() << "\n";
+}
+
+bool PatchManager::sync(const std::filesystem::path &dir) {
+  std::set<std::filesystem::path> files;
+  std::error_code ec;
+  for (const auto &entry : std::filesystem::directory_iterator(dir, ec)) {
+    auto extension = entry.path().extension();
+    if (entry.is_regular_file() && (extension == ".bc" || extension == ".ll")) {
+      files.insert(entry.path());
+    }
+  }
+  if (ec) {
+    llvm::errs() << "Failed to list hotpatches in " << dir.string() << ": "
+                 << ec.message() << "\n";
+    return false;
+  }
+
+  std::vector<std::filesystem::path> removed;
+  for (const auto &patch : patches) {
+    if (!files.count(patch.path)) {
+      removed.push_back(patch.path);
+    }
+  }
+  for (const auto &path : removed) {
+    unload(path);
+  }
+
+  auto success = true;
+  for (const auto &path : files) {
+    auto modified = modifiedTime(path);
+    auto loaded =
+        std::find_if(patches.begin(), patches.end(),
+                     [&](const Patch &patch) { return patch.path == path; });
+    auto failure = failed.find(path);
+    if ((loaded != patches.end() && loaded->modified == modified) ||
+        (failure != failed.end() && failure->second == modified)) {
+      continue;
+    }
+    llvm::outs() << (loaded != patches.end() ? "Reloading" : "Loading")
+                 << " hotpatch " << path.string() << "\n";
+    success &= load(path);
+  }
+  return success;
+}
+
+void PatchManager::activate(const std::string &name) {
+  auto isel = semantics.getGlobalVariable(name, /*AllowInternal=*/true);
+  auto unpatchedName = name + ".unpatched";
+  auto unpatched = semantics.getGlobalVariable(unpatchedName, true);
+  if (!unpatched) {
+    unpatched = new llvm::GlobalVariable(
+        semantics, isel->getValueType(), /*isConstant=*/true,
+        llvm::GlobalValue::ExternalLinkage, isel->getInitializer(),
+        unpatchedName);
+    llvm::appendToCompilerUsed(semantics, {unpatched});
+  }
+
+  auto target = unpatched->getInitializer();
+  for (auto patch = patches.rbegin(); patch != patches.rend(); ++patch) {
+    auto found = patch->isels.find(name);
+    if (found != patch->isels.end()) {
+      target = found->second->getInitializer();
+      break;
+    }
+  }
+  if (isel->getInitializer() != target) {
+    isel->setInitializer(target);
+    llvm::outs() << "Hotpatching: " << name << "\n";
+  }
+}
+
+void PatchManager::release(const Patch &patch) {
+  for (const auto &[name, global] : patch.isels) {
+    llvm::removeFromUsedLists(semantics, [global = global](llvm::Constant *c) {
+      return c == global;
+    });
+    if (global->use_empty()) {
+      global->eraseFromParent();
+    }
+  }
+
+  // Erasing a function can leave the ones it called unused
+  auto functions = patch.functions;
+  for (auto changed = true; changed;) {
+    changed = false;
+    for (auto &function : functions) {
+      if (!function || !function->use_empty()) {
+        continue;
+      }
+      if (optimizer) {
+        optimizer->forget(function);
+      }
+      function->eraseFromParent();
+      function = nullptr;
+      changed = true;
+    }
+  }
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <filesystem>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/Module.h>
+
+class IncrementalOptimizer;
+
+/// Loads, reloads and unloads hotpatches on a semantics module that is
+/// already in use.
+///
+/// hotpatchRemill links a single patch into the semantics before anything is
+/// lifted. The manager instead links only the functions of a patch and then
+/// repoints the initializers of the ISEL_* globals the patch defines, so
+/// every other ISEL_* and everything cached about its semantics stays as it
+/// was. Every version of a patch keeps its globals as ISEL_<name>.patch<N>
+/// and the initializer before the first patch is kept in
+/// ISEL_<name>.unpatched, so removing a patch restores whatever it replaced.
+/// When patches disagree, the one loaded last wins.
+///
+/// Everything else a patch defines is internalized before it is linked, so
+/// versions never clash and no definition in use is overridden. Once a
+/// version is replaced or unloaded, its functions that nothing uses any more
+/// are forgotten by the optimizer and erased, so the module does not grow
+/// with every reload. Functions still used (by lifted code that was not
+/// erased yet) stay. Patches can only replace ISEL_* globals the semantics
+/// define.
+class PatchManager {
+public:
+  /// optimizer is the IncrementalOptimizer that caches the semantics, if any.
+  explicit PatchManager(llvm::Module &semantics,
+                        IncrementalOptimizer *optimizer = nullptr)
+      : semantics(semantics), optimizer(optimizer) {}
+
+  /// Link the patch at path, replacing the version loaded before (which
+  /// stays active when this one fails to load).
+  bool load(const std::filesystem::path &path);
+
+  /// Remove the patch at path, its ISEL_* globals go back to the previous
+  /// patch or the semantics.
+  void unload(const std::filesystem::path &path);
+
+  /// Bring the loaded patches in line with the .bc and .ll files in dir:
+  /// load new files in name order, reload modified ones and unload the ones
+  /// that were removed. A file that fails to load is retried once it is
+  /// modified again. Returns false when any patch failed to load.
+  bool sync(const std::filesystem::path &dir);
+
+private:
+  struct Patch {
+    std::filesystem::path path;
+    std::filesystem::file_time_type modified;
+    // ISEL_* name to its global in this version
+    std::map<std::string, llvm::GlobalVariable *> isels;
+    // Everything else the version defined
+    std::vector<llvm::Function *> functions;
+  };
+
+  void activate(const std::string &name);
+  void release(const Patch &patch);
+
+  llvm::Module &semantics;
+  IncrementalOptimizer *optimizer = nullptr;
+  std::vector<Patch> patches;
+  // Modification time of the files that failed to load
+  std::map<std::filesystem::path, std::filesystem::file_time_type> failed;
+  unsigned nextVersion = 0;
+};
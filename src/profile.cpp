@@ -0,0 +1,178 @@
+#include "profile.hpp"
+
+#include <algorithm>
+#include <optional>
+#include <vector>
+
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/Metadata.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+
+static const char *const kIselsMetadata = "remill.isels";
+
+IselUses IselProfile::read(const llvm::Function &function) {
+  IselUses uses;
+  auto tuple = function.getMetadata(kIselsMetadata);
+  if (!tuple) {
+    return uses;
+  }
+  for (const auto &operand : tuple->operands()) {
+    auto entry = llvm::cast<llvm::MDTuple>(operand);
+    auto &use = uses[llvm::cast<llvm::MDString>(entry->getOperand(0))
+                         ->getString()];
+    use.count +=
+        llvm::mdconst::extract<llvm::ConstantInt>(entry->getOperand(1))
+            ->getZExtValue();
+    use.weight +=
+        llvm::mdconst::extract<llvm::ConstantInt>(entry->getOperand(2))
+            ->getZExtValue();
+  }
+  return uses;
+}
+
+void IselProfile::attach(llvm::Function &function, const IselUses &uses) {
+  auto &context = function.getContext();
+  auto int64 = llvm::Type::getInt64Ty(context);
+  llvm::SmallVector<llvm::Metadata *, 16> entries;
+  for (const auto &use : uses) {
+    entries.push_back(llvm::MDTuple::get(
+        context,
+        {llvm::MDString::get(context, use.getKey()),
+         llvm::ConstantAsMetadata::get(
+             llvm::ConstantInt::get(int64, use.getValue().count)),
+         llvm::ConstantAsMetadata::get(
+             llvm::ConstantInt::get(int64, use.getValue().weight))}));
+  }
+  function.setMetadata(kIselsMetadata, llvm::MDTuple::get(context, entries));
+}
+
+void IselProfile::tag(llvm::Function &function,
+                      const llvm::StringMap<uint64_t> &counts) {
+  auto module = function.getParent();
+  IselUses uses;
+  for (const auto &count : counts) {
+    // The ISEL_ global points to the semantic function (or the hotpatch)
+    uint64_t size = 1;
+    auto isel = module->getGlobalVariable(("ISEL_" + count.getKey()).str(),
+                                          /*AllowInternal=*/true);
+    if (isel && isel->hasInitializer()) {
+      if (auto semantic = llvm::dyn_cast<llvm::Function>(
+              isel->getInitializer()->stripPointerCasts())) {
+        size = std::max<uint64_t>(size, semantic->getInstructionCount());
+      }
+    }
+    auto &use = uses[count.getKey()];
+    use.count = count.getValue();
+    use.weight = count.getValue() * size;
+  }
+  attach(function, uses);
+}
+
+void IselProfile::merge(llvm::Function &into, const llvm::Function &from) {
+  auto uses = read(into);
+  for (const auto &use : read(from)) {
+    auto &total = uses[use.getKey()];
+    total.count += use.getValue().count;
+    total.weight += use.getValue().weight;
+  }
+  attach(into, uses);
+}
+
+IselUses IselProfile::take(llvm::Function &function) {
+  auto uses = read(function);
+  function.setMetadata(kIselsMetadata, nullptr);
+  return uses;
+}
+
+void IselProfile::record(const IselUses &uses,
+                         std::chrono::nanoseconds elapsed,
+                         uint64_t irInstructions) {
+  uint64_t totalWeight = 0;
+  for (const auto &use : uses) {
+    totalWeight += use.getValue().weight;
+  }
+  if (totalWeight == 0) {
+    return;
+  }
+
+  auto seconds = std::chrono::duration<double>(elapsed).count();
+  std::lock_guard<std::mutex> lock(mutex);
+  for (const auto &use : uses) {
+    auto share = static_cast<double>(use.getValue().weight) / totalWeight;
+    auto &cost = costs[use.getKey()];
+    cost.lifted += use.getValue().count;
+    cost.seconds += seconds * share;
+    cost.irInstructions += irInstructions * share;
+  }
+}
+
+bool IselProfile::write(const std::string &path) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto totals = costs;
+
+  // Accumulate into the report of the previous runs
+  if (auto buffer = llvm::MemoryBuffer::getFile(path)) {
+    auto previous = llvm::json::parse((*buffer)->getBuffer());
+    if (!previous) {
+      llvm::errs() << "Failed to parse ISEL profile " << path << ": "
+                   << llvm::toString(previous.takeError()) << "\n";
+      return false;
+    }
+    auto report = previous->getAsObject();
+    auto isels = report ? report->getArray("isels") : nullptr;
+    if (!isels) {
+      llvm::errs() << "Not an ISEL profile: " << path << "\n";
+      return false;
+    }
+    for (const auto &value : *isels) {
+      auto entry = value.getAsObject();
+      auto name = entry ? entry->getString("isel") : std::nullopt;
+      if (!name) {
+        continue;
+      }
+      auto &cost = totals[*name];
+      cost.lifted += entry->getInteger("lifted").value_or(0);
+      cost.seconds += entry->getNumber("optimize_seconds").value_or(0);
+      cost.irInstructions += entry->getNumber("ir_instructions").value_or(0);
+    }
+  }
+
+  std::vector<const llvm::StringMapEntry<Cost> *> ranked;
+  for (const auto &entry : totals) {
+    ranked.push_back(&entry);
+  }
+  std::sort(ranked.begin(), ranked.end(), [](auto left, auto right) {
+    if (left->getValue().seconds != right->getValue().seconds) {
+      return left->getValue().seconds > right->getValue().seconds;
+    }
+    return left->getKey() < right->getKey();
+  });
+
+  std::error_code ec;
+  llvm::raw_fd_ostream os(path, ec, llvm::sys::fs::OF_Text);
+  if (ec) {
+    llvm::errs() << "Failed to open " << path << ": " << ec.message() << "\n";
+    return false;
+  }
+  llvm::json::OStream json(os, /*IndentSize=*/2);
+  json.object([&] {
+    json.attributeArray("isels", [&] {
+      for (auto entry : ranked) {
+        const auto &cost = entry->getValue();
+        json.object([&] {
+          json.attribute("isel", entry->getKey());
+          json.attribute("lifted", cost.lifted);
+          json.attribute("optimize_seconds", cost.seconds);
+          json.attribute("ir_instructions", cost.irInstructions);
+        });
+      }
+    });
+  });
+  os << "\n";
+  return true;
+}
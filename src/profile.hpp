@@ -0,0 +1,71 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/IR/Function.h>
+
+/// How one ISEL_* semantic was used by some lifted code.
+struct IselUse {
+  // Guest instructions lifted with the semantic
+  uint64_t count = 0;
+  // count times the IR instructions of the semantic function, the share of
+  // the optimization the semantic is charged with
+  uint64_t weight = 0;
+};
+
+/// Uses of the semantics by their ISEL_* name (without the prefix).
+using IselUses = llvm::StringMap<IselUse>;
+
+/// Process-wide profile of which ISEL_* semantics the lifted code is made of
+/// and what optimizing it cost, to find the semantics worth hotpatching.
+///
+/// The profile is disabled by default and has to be enabled before any
+/// worker thread starts. The lifter tags every lifted function with the
+/// semantics of its instructions (remill.isels metadata, which survives
+/// extraction into bitcode), and optimizeLifted takes the tag off and charges
+/// the optimization time and the optimized IR instructions to the semantics
+/// in proportion to their weight. Both are estimates: the pipeline works on
+/// the inlined code of all the instructions at once.
+class IselProfile {
+public:
+  static void enable() { enabled = true; }
+  static bool isEnabled() { return enabled; }
+
+  /// Tag function with counts of the instructions lifted into it, weighed by
+  /// the semantic functions of its module.
+  static void tag(llvm::Function &function,
+                  const llvm::StringMap<uint64_t> &counts);
+
+  /// Add the tag of from to the tag of into.
+  static void merge(llvm::Function &into, const llvm::Function &from);
+
+  /// Remove the tag of function and return it.
+  static IselUses take(llvm::Function &function);
+
+  /// Charge lifted code that took elapsed to optimize into irInstructions.
+  static void record(const IselUses &uses, std::chrono::nanoseconds elapsed,
+                     uint64_t irInstructions);
+
+  /// Add the profile to the one in path (if there is one) and write them
+  /// back as JSON, ranked by optimization time. Running over a whole corpus
+  /// with the same path accumulates one report.
+  static bool write(const std::string &path);
+
+private:
+  struct Cost {
+    uint64_t lifted = 0;
+    double seconds = 0;
+    double irInstructions = 0;
+  };
+
+  static IselUses read(const llvm::Function &function);
+  static void attach(llvm::Function &function, const IselUses &uses);
+
+  static inline bool enabled = false;
+  static inline std::mutex mutex;
+  static inline llvm::StringMap<Cost> costs;
+};
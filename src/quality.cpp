@@ -0,0 +1,429 @@
+#include <cstdlib>
+#include <map>
+#include <optional>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "exepath.hpp"
+#include "lifter.hpp"
+#include "optimizer.hpp"
+#include "semantics.hpp"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <remill/Arch/Arch.h>
+#include <remill/Arch/Name.h>
+#include <remill/Version/Version.h>
+
+#include <llvm/Analysis/ValueTracking.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+
+DEFINE_string(archs, "amd64,x86,aarch64",
+              "Comma separated remill architectures to measure");
+DEFINE_string(helpers_dir, "",
+              "Directory with the helpers/<arch> build outputs, whose "
+              "RemillHotpatch.bc is applied (defaults to the helpers "
+              "directory next to the executable)");
+DEFINE_string(optimizer, "module",
+              "Optimizer to measure: module (remill::OptimizeModule) or "
+              "incremental");
+DEFINE_string(pipeline, "default",
+              "Pipeline of the incremental optimizer: default, fast, "
+              "deobfuscate or custom");
+DEFINE_string(pipeline_text, "",
+              "New pass manager function pipeline for --pipeline=custom");
+DEFINE_bool(scalarize_state, false,
+            "Promote State accesses to SSA values in the incremental "
+            "optimizer");
+DEFINE_bool(freeze_undefined, false,
+            "Lower undefined values (__remill_undefined_*) to freeze poison "
+            "in the incremental optimizer");
+DEFINE_bool(eliminate_flags, false,
+            "Remove dead flag computations in the incremental optimizer");
+DEFINE_string(output, "-", "Where to write the JSON report (- for stdout)");
+DEFINE_string(baseline, "",
+              "Report of an earlier run to compare against, exits with an "
+              "error when any count grew");
+DEFINE_double(tolerance, 0,
+              "Percentage a count may grow over --baseline before it counts "
+              "as a regression");
+
+/// Guest code of one instruction class. Only the last instruction may end the
+/// block, so every class lifts into one function.
+struct CorpusClass {
+  const char *name;
+  std::string bytes;
+  size_t numInstructions;
+};
+
+/// The curated corpus of every architecture, by instruction class.
+static std::vector<CorpusClass> qualityCorpus(remill::ArchName arch) {
+  switch (arch) {
+  case remill::kArchAMD64:
+    return {
+        {"alu",
+         {"\x48\x01\xd8"                  // add rax, rbx
+          "\x48\x29\xd1"                  // sub rcx, rdx
+          "\x48\x0f\xaf\xca"              // imul rcx, rdx
+          "\x48\xc1\xe0\x03"              // shl rax, 3
+          "\x48\x8d\x14\x88"              // lea rdx, [rax + 4*rcx]
+          "\x25\xff\x00\x00\x00"          // and eax, 0xff
+          "\x48\xc7\xc1\x39\x05\x00\x00", // mov rcx, 1337
+          30},
+         7},
+        {"flags",
+         {"\x48\x83\xf8\x10" // cmp rax, 16
+          "\x0f\x95\xc0"     // setne al
+          "\x85\xc9"         // test ecx, ecx
+          "\x48\x0f\x44\xc3" // cmovz rax, rbx
+          "\x48\x11\xd8"     // adc rax, rbx
+          "\x48\x19\xd1",    // sbb rcx, rdx
+          19},
+         6},
+        {"simd",
+         {"\xf3\x0f\x6f\x07"  // movdqu xmm0, [rdi]
+          "\x66\x0f\xfe\xc1"  // paddd xmm0, xmm1
+          "\x66\x0f\xef\xd2"  // pxor xmm2, xmm2
+          "\x0f\x58\xc1"      // addps xmm0, xmm1
+          "\xf2\x0f\x59\xc1"  // mulsd xmm0, xmm1
+          "\xf3\x0f\x7f\x06", // movdqu [rsi], xmm0
+          23},
+         6},
+        {"string",
+         {"\xa4"      // movsb
+          "\xab"      // stosd
+          "\xac"      // lodsb
+          "\xa6"      // cmpsb
+          "\xae"      // scasb
+          "\xf3\xa4", // rep movsb
+          7},
+         6},
+    };
+  case remill::kArchX86:
+    return {
+        {"alu",
+         {"\x01\xd8"              // add eax, ebx
+          "\x29\xd1"              // sub ecx, edx
+          "\x0f\xaf\xca"          // imul ecx, edx
+          "\xc1\xe0\x03"          // shl eax, 3
+          "\x8d\x14\x88"          // lea edx, [eax + 4*ecx]
+          "\x25\xff\x00\x00\x00"  // and eax, 0xff
+          "\xb9\x39\x05\x00\x00", // mov ecx, 1337
+          23},
+         7},
+        {"flags",
+         {"\x83\xf8\x10" // cmp eax, 16
+          "\x0f\x95\xc0" // setne al
+          "\x85\xc9"     // test ecx, ecx
+          "\x0f\x44\xc3" // cmovz eax, ebx
+          "\x11\xd8"     // adc eax, ebx
+          "\x19\xd1",    // sbb ecx, edx
+          15},
+         6},
+        {"simd",
+         {"\xf3\x0f\x6f\x07"  // movdqu xmm0, [edi]
+          "\x66\x0f\xfe\xc1"  // paddd xmm0, xmm1
+          "\x66\x0f\xef\xd2"  // pxor xmm2, xmm2
+          "\x0f\x58\xc1"      // addps xmm0, xmm1
+          "\xf2\x0f\x59\xc1"  // mulsd xmm0, xmm1
+          "\xf3\x0f\x7f\x06", // movdqu [esi], xmm0
+          23},
+         6},
+        {"string",
+         {"\xa4"      // movsb
+          "\xab"      // stosd
+          "\xac"      // lodsb
+          "\xa6"      // cmpsb
+          "\xae"      // scasb
+          "\xf3\xa4", // rep movsb
+          7},
+         6},
+    };
+  case remill::kArchAArch64LittleEndian:
+    // AArch64 has no string instructions
+    return {
+        {"alu",
+         {"\x20\x00\x02\x8b"  // add x0, x1, x2
+          "\x25\xa7\x80\xd2"  // mov x5, #1337
+          "\x07\xf0\x7d\xd3"  // lsl x7, x0, #3
+          "\x28\x0c\x02\x9b"  // madd x8, x1, x2, x3
+          "\x29\x1c\x00\x12"  // and w9, w1, #0xff
+          "\x2a\x08\xc2\x9a"  // udiv x10, x1, x2
+          "\xff\x83\x00\xd1", // sub sp, sp, #32
+          28},
+         7},
+        {"flags",
+         {"\x1f\x40\x00\xf1"  // cmp x0, #16
+          "\x26\x00\x82\x9a"  // csel x6, x1, x2, eq
+          "\x20\x00\x02\xab"  // adds x0, x1, x2
+          "\xe0\x07\x9f\x1a"  // cset w0, ne
+          "\x24\x18\x40\xfa"  // ccmp x1, #0, #4, ne
+          "\x24\x00\x02\x9a", // adc x4, x1, x2
+          24},
+         6},
+        {"simd",
+         {"\x00\x00\xc0\x3d"  // ldr q0, [x0]
+          "\x00\x84\xa1\x4e"  // add v0.4s, v0.4s, v1.4s
+          "\x42\x1c\x22\x6e"  // eor v2.16b, v2.16b, v2.16b
+          "\x00\xd4\x21\x4e"  // fadd v0.4s, v0.4s, v1.4s
+          "\x00\x08\x61\x1e"  // fmul d0, d0, d1
+          "\x20\x00\x80\x3d", // str q0, [x1]
+          24},
+         6},
+    };
+  default:
+    return {};
+  }
+}
+
+/// What is left of the lifted code of a class after optimization.
+struct QualityCounts {
+  uint64_t irInstructions = 0;
+  // Calls to the __remill_* memory intrinsics
+  uint64_t memoryIntrinsics = 0;
+  // Loads and stores based on the State argument
+  uint64_t stateLoads = 0;
+  uint64_t stateStores = 0;
+};
+
+/// Count names and values in the order of the JSON report.
+using CountField = std::pair<const char *, uint64_t QualityCounts::*>;
+static const CountField kCountFields[] = {
+    {"ir_instructions", &QualityCounts::irInstructions},
+    {"memory_intrinsics", &QualityCounts::memoryIntrinsics},
+    {"state_loads", &QualityCounts::stateLoads},
+    {"state_stores", &QualityCounts::stateStores},
+};
+
+static bool isMemoryIntrinsic(llvm::StringRef name) {
+  for (auto prefix :
+       {"__remill_read_memory_", "__remill_write_memory_",
+        "__remill_compare_exchange_memory_", "__remill_fetch_and_"}) {
+    if (name.str().rfind(prefix, 0) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static QualityCounts countResidual(llvm::Function &function) {
+  QualityCounts counts;
+  auto state = function.getArg(0);
+  auto isState = [state](const llvm::Value *pointer) {
+    return llvm::getUnderlyingObject(pointer, /*MaxLookup=*/0) == state;
+  };
+  for (auto &instruction : llvm::instructions(function)) {
+    counts.irInstructions++;
+    if (auto load = llvm::dyn_cast<llvm::LoadInst>(&instruction)) {
+      counts.stateLoads += isState(load->getPointerOperand());
+    } else if (auto store = llvm::dyn_cast<llvm::StoreInst>(&instruction)) {
+      counts.stateStores += isState(store->getPointerOperand());
+    } else if (auto call = llvm::dyn_cast<llvm::CallInst>(&instruction)) {
+      auto callee = call->getCalledFunction();
+      counts.memoryIntrinsics += callee && isMemoryIntrinsic(callee->getName());
+    }
+  }
+  return counts;
+}
+
+/// Counts of every class, by arch/class.
+using QualityReport = std::map<std::string, QualityCounts>;
+
+/// Lift and optimize the corpus of one architecture.
+static bool measureArch(const std::string &name, QualityReport &report) {
+  llvm::LLVMContext context;
+  auto arch = remill::Arch::Get(context, "linux", name);
+  if (!arch) {
+    llvm::errs() << "Failed to get architecture " << name << "\n";
+    return false;
+  }
+  auto corpus = qualityCorpus(arch->arch_name);
+  if (corpus.empty()) {
+    llvm::errs() << "No corpus for architecture " << name << "\n";
+    return false;
+  }
+
+  SemanticsOptions semanticsOptions;
+  if (auto dir = helpersArchDir(name)) {
+    auto helpersDir = FLAGS_helpers_dir.empty()
+                          ? executableDir() / "helpers"
+                          : std::filesystem::path(FLAGS_helpers_dir);
+    semanticsOptions.hotpatchPath = helpersDir / dir / "RemillHotpatch.bc";
+  }
+  auto semantics = loadSemantics(arch.get(), semanticsOptions);
+  if (!semantics) {
+    llvm::errs() << "Failed to load semantics of " << name << "\n";
+    return false;
+  }
+
+  std::unique_ptr<IncrementalOptimizer> optimizer;
+  if (FLAGS_optimizer == "incremental") {
+    optimizer = std::make_unique<IncrementalOptimizer>();
+    auto pipeline = parsePipelinePreset(FLAGS_pipeline);
+    if (!pipeline) {
+      llvm::errs() << "Unknown pipeline: " << FLAGS_pipeline << "\n";
+      return false;
+    }
+    if (!optimizer->setPipeline(*pipeline, FLAGS_pipeline_text)) {
+      return false;
+    }
+    optimizer->setScalarizeState(FLAGS_scalarize_state);
+    optimizer->setFreezeUndefined(FLAGS_freeze_undefined);
+    if (FLAGS_eliminate_flags) {
+      optimizer->setFlagElimination(arch.get());
+    }
+  } else if (FLAGS_optimizer != "module") {
+    llvm::errs() << "Unknown optimizer: " << FLAGS_optimizer << "\n";
+    return false;
+  }
+
+  // Every class on its own, so the semantics of one cannot clean up another
+  BlockLifter lifter(arch.get(), semantics.get());
+  for (const auto &corpusClass : corpus) {
+    auto block = lifter.liftBlock(0x1000, corpusClass.bytes);
+    if (!block.function ||
+        block.numInstructions != corpusClass.numInstructions) {
+      llvm::errs() << "Failed to lift the " << corpusClass.name
+                   << " class of " << name << "\n";
+      return false;
+    }
+    optimizeLifted(arch.get(), semantics.get(), {block.function},
+                   optimizer.get());
+    report[name + "/" + corpusClass.name] = countResidual(*block.function);
+    if (optimizer) {
+      optimizer->forget(block.function);
+    }
+    block.function->eraseFromParent();
+  }
+  return true;
+}
+
+/// Compare report to --baseline, printing every count that grew by more than
+/// --tolerance. Returns false on regressions.
+static bool compareBaseline(const QualityReport &report) {
+  auto buffer = llvm::MemoryBuffer::getFile(FLAGS_baseline);
+  if (!buffer) {
+    llvm::errs() << "Failed to open " << FLAGS_baseline << ": "
+                 << buffer.getError().message() << "\n";
+    return false;
+  }
+  auto baseline = llvm::json::parse((*buffer)->getBuffer());
+  if (!baseline) {
+    llvm::errs() << "Failed to parse " << FLAGS_baseline << ": "
+                 << llvm::toString(baseline.takeError()) << "\n";
+    return false;
+  }
+  auto root = baseline->getAsObject();
+  auto results = root ? root->getArray("results") : nullptr;
+  if (!results) {
+    llvm::errs() << "Not a quality report: " << FLAGS_baseline << "\n";
+    return false;
+  }
+  auto optimizer = root->getString("optimizer");
+  if (optimizer && *optimizer != FLAGS_optimizer) {
+    llvm::errs() << "The baseline was measured with --optimizer="
+                 << *optimizer << "\n";
+    return false;
+  }
+
+  auto regressed = false;
+  std::set<std::string> compared;
+  for (const auto &value : *results) {
+    auto entry = value.getAsObject();
+    auto arch = entry ? entry->getString("arch") : std::nullopt;
+    auto corpusClass = entry ? entry->getString("class") : std::nullopt;
+    if (!arch || !corpusClass) {
+      continue;
+    }
+    auto key = (*arch + "/" + *corpusClass).str();
+    auto found = report.find(key);
+    if (found == report.end()) {
+      // Architectures left out of --archs are not compared
+      continue;
+    }
+    compared.insert(key);
+    for (const auto &[field, member] : kCountFields) {
+      auto expected = entry->getInteger(field);
+      if (!expected) {
+        continue;
+      }
+      auto actual = found->second.*member;
+      auto limit = *expected * (1 + FLAGS_tolerance / 100);
+      if (actual > limit) {
+        llvm::errs() << key << ": " << field << " regressed from "
+                     << *expected << " to " << actual << "\n";
+        regressed = true;
+      }
+    }
+  }
+  // New classes (or a baseline that was never recorded) pass, but say so
+  for (const auto &[key, counts] : report) {
+    if (!compared.count(key)) {
+      llvm::errs() << key << ": not in " << FLAGS_baseline << "\n";
+    }
+  }
+  return !regressed;
+}
+
+int main(int argc, char **argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  llvm::SmallVector<llvm::StringRef, 4> archNames;
+  llvm::StringRef(FLAGS_archs).split(archNames, ',', -1, false);
+  QualityReport report;
+  for (auto archName : archNames) {
+    if (!measureArch(archName.trim().str(), report)) {
+      return EXIT_FAILURE;
+    }
+  }
+
+  std::error_code ec;
+  llvm::raw_fd_ostream os(FLAGS_output, ec, llvm::sys::fs::OF_Text);
+  if (ec) {
+    llvm::errs() << "Failed to open " << FLAGS_output << ": " << ec.message()
+                 << "\n";
+    return EXIT_FAILURE;
+  }
+
+  llvm::json::OStream json(os, /*IndentSize=*/2);
+  json.object([&] {
+    json.attribute("remill", remill::version::HasVersionData()
+                                 ? remill::version::GetCommitHash()
+                                 : std::string("unknown"));
+    json.attribute("llvm", LLVM_VERSION_STRING);
+    json.attribute("optimizer", FLAGS_optimizer);
+    json.attribute("pipeline", FLAGS_pipeline);
+    json.attribute("scalarize_state", FLAGS_scalarize_state);
+    json.attribute("eliminate_flags", FLAGS_eliminate_flags);
+    json.attribute("freeze_undefined", FLAGS_freeze_undefined);
+    json.attributeArray("results", [&] {
+      for (const auto &[key, counts] : report) {
+        auto [arch, corpusClass] = llvm::StringRef(key).split('/');
+        json.object([&] {
+          json.attribute("arch", arch);
+          json.attribute("class", corpusClass);
+          for (const auto &[field, member] : kCountFields) {
+            json.attribute(field, counts.*member);
+          }
+        });
+      }
+    });
+  });
+  os << "\n";
+  os.flush();
+
+  if (!FLAGS_baseline.empty() && !compareBaseline(report)) {
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+/// Per-worker job queues with work stealing.
+///
+/// Every worker pops jobs from the front of its own queue. Once that runs dry
+/// it steals from the back of the other queues, so the workers that got cheap
+/// jobs end up helping with the expensive ones.
+template <typename T> class WorkStealingQueue {
+public:
+  explicit WorkStealingQueue(size_t numWorkers) : queues(numWorkers) {}
+
+  void push(size_t worker, T job) {
+    auto &queue = queues[worker % queues.size()];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.jobs.push_back(std::move(job));
+  }
+
+  std::optional<T> pop(size_t worker) {
+    {
+      auto &queue = queues[worker];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (!queue.jobs.empty()) {
+        auto job = std::move(queue.jobs.front());
+        queue.jobs.pop_front();
+        return job;
+      }
+    }
+
+    for (size_t i = 1; i < queues.size(); i++) {
+      auto &victim = queues[(worker + i) % queues.size()];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.jobs.empty()) {
+        auto job = std::move(victim.jobs.back());
+        victim.jobs.pop_back();
+        return job;
+      }
+    }
+    return std::nullopt;
+  }
+
+private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<T> jobs;
+  };
+  std::vector<Queue> queues;
+};
+
+/// A blocking FIFO with a fixed capacity, between the stages of a pipeline.
+///
+/// push() waits while the queue is full, which holds the producing stage back
+/// to the pace of the consuming one. pop() waits for a job and returns
+/// std::nullopt once the queue is closed and drained.
+template <typename T> class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t capacity)
+      : capacity(std::max<size_t>(1, capacity)) {}
+
+  void push(T job) {
+    std::unique_lock<std::mutex> lock(mutex);
+    notFull.wait(lock, [this] { return jobs.size() < capacity; });
+    jobs.push_back(std::move(job));
+    notEmpty.notify_one();
+  }
+
+  std::optional<T> pop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    notEmpty.wait(lock, [this] { return !jobs.empty() || closed; });
+    if (jobs.empty()) {
+      return std::nullopt;
+    }
+    auto job = std::move(jobs.front());
+    jobs.pop_front();
+    notFull.notify_one();
+    return job;
+  }
+
+  /// No more jobs will be pushed, wakes up every waiting pop().
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    notEmpty.notify_all();
+  }
+
+private:
+  size_t capacity = 1;
+  std::mutex mutex;
+  std::condition_variable notFull;
+  std::condition_variable notEmpty;
+  std::deque<T> jobs;
+  bool closed = false;
+};
@@ -0,0 +1,484 @@
+#include "regions.hpp"
+
+#include <optional>
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Analysis/CFG.h>
+#include <llvm/Analysis/ValueTracking.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/MDBuilder.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+
+static const char kRemillPrefix[] = "__remill_";
+
+// Probed by hasMemoryRegions, every flavor of the helpers has the 8-bit read
+static const char kRegionProbe[] = "__remill_stack_read_memory_8";
+
+static const struct {
+  MemoryRegion region;
+  const char *helperPrefix;
+  const char *ram;
+  const char *scope;
+} kRegions[] = {
+    {MemoryRegion::Stack, "__remill_stack_", "RAM_STACK", "stack"},
+    {MemoryRegion::Image, "__remill_image_", "RAM_IMAGE", "image"},
+};
+
+/// __remill_read_memory_* and __remill_write_memory_*
+static bool isMemoryIntrinsic(llvm::StringRef name) {
+  return name.consume_front(kRemillPrefix) &&
+         (name.consume_front("read_memory_") ||
+          name.consume_front("write_memory_"));
+}
+
+// Largest constant a stack address may be away from a load of the stack
+// pointer. Stack frames are smaller, larger offsets are no stack accesses.
+static const int64_t kStackWindow = 64 * 1024;
+
+// Largest access of the memory intrinsics, __remill_*_memory_f128
+static const uint64_t kMaxAccessSize = 16;
+
+namespace {
+
+/// Follows an address back to the stack pointer or to a constant.
+///
+/// A load of the stack pointer is only a stack base when nothing that might
+/// have set the stack pointer to something else (a call given the state or a
+/// store of an address that is not on the stack) can run before it. Together
+/// with the bounded offsets every stack access of the function is then within
+/// stackMargin of the stack pointer at entry.
+class RegionClassifier {
+public:
+  RegionClassifier(llvm::Function &function,
+                   const remill::Register *stackPointer,
+                   const std::vector<AddressRange> &image,
+                   const llvm::DataLayout &dataLayout)
+      : state(function.getArg(0)), stackPointer(stackPointer), image(image),
+        dataLayout(dataLayout) {
+    // A loop could move the stack pointer any distance
+    llvm::SmallVector<
+        std::pair<const llvm::BasicBlock *, const llvm::BasicBlock *>, 4>
+        backedges;
+    llvm::FindFunctionBackedges(function, backedges);
+    stackUsable = backedges.empty();
+
+    llvm::SmallVector<llvm::StoreInst *, 8> stores;
+    for (auto &instruction : llvm::instructions(function)) {
+      if (auto store = llvm::dyn_cast<llvm::StoreInst>(&instruction)) {
+        auto size = dataLayout.getTypeStoreSize(
+            store->getValueOperand()->getType());
+        switch (stateAccess(store->getPointerOperand(), size)) {
+        case StateAccess::StackPointer:
+          stores.push_back(store);
+          break;
+        case StateAccess::Unknown:
+          clobbers.push_back(store);
+          break;
+        case StateAccess::None:
+          break;
+        }
+      } else if (auto call = llvm::dyn_cast<llvm::CallBase>(&instruction)) {
+        for (auto &argument : call->args()) {
+          if (llvm::getUnderlyingObject(argument) == state) {
+            clobbers.push_back(call);
+            break;
+          }
+        }
+      } else if (llvm::isa<llvm::AtomicRMWInst, llvm::AtomicCmpXchgInst>(
+                     instruction) &&
+                 llvm::getUnderlyingObject(instruction.getOperand(0)) ==
+                     state) {
+        clobbers.push_back(&instruction);
+      }
+    }
+
+    // Until no more stores turn out to clobber the stack pointer, every one
+    // found makes the loads after it unusable
+    for (auto changed = stackUsable; changed;) {
+      changed = false;
+      for (auto &store : stores) {
+        if (store &&
+            classify(store->getValueOperand()) != MemoryRegion::Stack) {
+          clobbers.push_back(store);
+          store = nullptr;
+          changed = true;
+        }
+      }
+    }
+    for (auto store : stores) {
+      if (store) {
+        stackStores++;
+      }
+    }
+  }
+
+  MemoryRegion classify(llvm::Value *address) {
+    visited.clear();
+    return walk(address, 0).value_or(MemoryRegion::Unknown);
+  }
+
+  /// Distance from the stack pointer at entry every stack access of the
+  /// function stays within, std::nullopt when the entry check would not fit
+  /// into the address space.
+  std::optional<uint64_t> stackMargin() const {
+    auto margin = kStackWindow * (stackStores + 1) + kMaxAccessSize;
+    auto bits = stackPointer->size * 8;
+    for (const auto &range : image) {
+      auto length = range.end - range.begin;
+      if (length + 2 * margin < length ||
+          (bits < 64 && length + 2 * margin >= (uint64_t(1) << bits))) {
+        return std::nullopt;
+      }
+    }
+    return margin;
+  }
+
+private:
+  enum class StateAccess { None, StackPointer, Unknown };
+
+  /// How an access of size bytes through pointer touches the stack pointer.
+  StateAccess stateAccess(llvm::Value *pointer, uint64_t size) const {
+    if (llvm::getUnderlyingObject(pointer) != state) {
+      return StateAccess::None;
+    }
+    llvm::APInt offset(
+        dataLayout.getIndexTypeSizeInBits(pointer->getType()), 0);
+    auto base = pointer->stripAndAccumulateConstantOffsets(
+        dataLayout, offset, /*AllowNonInbounds=*/true);
+    if (base != state) {
+      return StateAccess::Unknown;
+    }
+    auto begin = offset.getZExtValue();
+    if (begin == stackPointer->offset && size == stackPointer->size) {
+      return StateAccess::StackPointer;
+    }
+    if (begin + size <= stackPointer->offset ||
+        begin >= stackPointer->offset + stackPointer->size) {
+      return StateAccess::None;
+    }
+    return StateAccess::Unknown;
+  }
+
+  // std::nullopt for values already on the path at the same offset (cycles
+  // through phis), which do not change the region of the value they feed.
+  // offset is the constant added to value on the way to the address.
+  std::optional<MemoryRegion> walk(llvm::Value *value, int64_t offset) {
+    auto [previous, inserted] = visited.try_emplace(value, offset);
+    if (!inserted) {
+      // The value changes on every trip around the cycle
+      if (previous->second != offset) {
+        return MemoryRegion::Unknown;
+      }
+      return std::nullopt;
+    }
+
+    if (auto constant = llvm::dyn_cast<llvm::ConstantInt>(value)) {
+      if (constant->getBitWidth() > 64) {
+        return MemoryRegion::Unknown;
+      }
+      auto address = constant->getZExtValue() + uint64_t(offset);
+      for (const auto &range : image) {
+        if (address >= range.begin && address < range.end) {
+          return MemoryRegion::Image;
+        }
+      }
+      return MemoryRegion::Unknown;
+    }
+
+    if (llvm::isa<llvm::ZExtInst, llvm::SExtInst, llvm::TruncInst>(value)) {
+      return walk(llvm::cast<llvm::Instruction>(value)->getOperand(0),
+                  offset);
+    }
+
+    if (auto binary = llvm::dyn_cast<llvm::BinaryOperator>(value)) {
+      auto opcode = binary->getOpcode();
+      auto lhs = binary->getOperand(0);
+      auto rhs = binary->getOperand(1);
+      if (opcode == llvm::Instruction::Add &&
+          llvm::isa<llvm::ConstantInt>(lhs)) {
+        std::swap(lhs, rhs);
+      }
+      auto constant = llvm::dyn_cast<llvm::ConstantInt>(rhs);
+      if ((opcode != llvm::Instruction::Add &&
+           opcode != llvm::Instruction::Sub) ||
+          !constant || constant->getBitWidth() > 64) {
+        return MemoryRegion::Unknown;
+      }
+      auto step = constant->getSExtValue();
+      if (step < -kStackWindow || step > kStackWindow) {
+        return MemoryRegion::Unknown;
+      }
+      offset += opcode == llvm::Instruction::Add ? step : -step;
+      if (offset < -kStackWindow || offset > kStackWindow) {
+        return MemoryRegion::Unknown;
+      }
+      return walk(lhs, offset);
+    }
+
+    if (auto phi = llvm::dyn_cast<llvm::PHINode>(value)) {
+      return combine(phi->incoming_values(), offset);
+    }
+    if (auto select = llvm::dyn_cast<llvm::SelectInst>(value)) {
+      llvm::Value *values[] = {select->getTrueValue(),
+                               select->getFalseValue()};
+      return combine(values, offset);
+    }
+
+    if (auto load = llvm::dyn_cast<llvm::LoadInst>(value)) {
+      auto size = dataLayout.getTypeStoreSize(load->getType());
+      if (stackUsable &&
+          stateAccess(load->getPointerOperand(), size) ==
+              StateAccess::StackPointer &&
+          !clobbered(load)) {
+        return MemoryRegion::Stack;
+      }
+    }
+    return MemoryRegion::Unknown;
+  }
+
+  template <typename Range>
+  std::optional<MemoryRegion> combine(Range &&values, int64_t offset) {
+    std::optional<MemoryRegion> result;
+    for (llvm::Value *value : values) {
+      auto region = walk(value, offset);
+      if (!region) {
+        continue;
+      }
+      if (result && *result != *region) {
+        return MemoryRegion::Unknown;
+      }
+      result = region;
+    }
+    return result;
+  }
+
+  /// True when a clobber of the stack pointer might run before load.
+  bool clobbered(llvm::LoadInst *load) const {
+    for (auto clobber : clobbers) {
+      if (llvm::isPotentiallyReachable(clobber, load)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  llvm::Argument *state;
+  const remill::Register *stackPointer;
+  const std::vector<AddressRange> &image;
+  const llvm::DataLayout &dataLayout;
+  bool stackUsable = false;
+  llvm::SmallVector<llvm::Instruction *, 8> clobbers;
+  uint64_t stackStores = 0;
+  llvm::SmallDenseMap<llvm::Value *, int64_t, 16> visited;
+};
+
+} // namespace
+
+/// Enters unrouted instead of function when the stack pointer at entry is
+/// within margin of one of the image ranges, so the routed stack accesses
+/// never overlap an image access.
+static void guardStackPointer(llvm::Function &function,
+                              llvm::Function &unrouted,
+                              const remill::Register *stackPointer,
+                              const std::vector<AddressRange> &image,
+                              uint64_t margin) {
+  auto &entry = function.getEntryBlock();
+  auto position = entry.getFirstInsertionPt();
+  while (llvm::isa<llvm::AllocaInst>(*position)) {
+    ++position;
+  }
+  llvm::IRBuilder<> ir(&entry, position);
+  auto bits = stackPointer->size * 8;
+  auto type = ir.getIntNTy(bits);
+  auto mask = bits < 64 ? (uint64_t(1) << bits) - 1 : ~uint64_t(0);
+  auto constant = [&](uint64_t value) {
+    return llvm::ConstantInt::get(type, value & mask);
+  };
+
+  auto address = ir.CreateConstInBoundsGEP1_64(
+      ir.getInt8Ty(), function.getArg(0), stackPointer->offset);
+  llvm::Value *stack = ir.CreateLoad(type, address);
+  llvm::Value *nearImage = ir.getFalse();
+  for (const auto &range : image) {
+    // begin - margin <= stack < end + margin, wrapping around like the guest
+    auto distance = ir.CreateSub(stack, constant(range.begin - margin));
+    nearImage = ir.CreateOr(
+        nearImage,
+        ir.CreateICmpULT(distance,
+                         constant(range.end - range.begin + 2 * margin)));
+  }
+
+  auto fallback =
+      llvm::SplitBlockAndInsertIfThen(nearImage, &*position,
+                                      /*Unreachable=*/true);
+  ir.SetInsertPoint(fallback);
+  llvm::SmallVector<llvm::Value *, 4> arguments;
+  for (auto &argument : function.args()) {
+    arguments.push_back(&argument);
+  }
+  auto call = ir.CreateCall(&unrouted, arguments);
+  call->setTailCall();
+  if (function.getReturnType()->isVoidTy()) {
+    ir.CreateRetVoid();
+  } else {
+    ir.CreateRet(call);
+  }
+  fallback->eraseFromParent();
+}
+
+MemoryRegionPass::MemoryRegionPass(const remill::Arch *arch,
+                                   std::vector<AddressRange> image)
+    : arch(arch), image(std::move(image)) {}
+
+llvm::PreservedAnalyses
+MemoryRegionPass::run(llvm::Module &module, llvm::ModuleAnalysisManager &mam) {
+  auto stackPointer = arch->RegisterByName(arch->StackPointerRegisterName());
+  if (!stackPointer) {
+    return llvm::PreservedAnalyses::all();
+  }
+
+  // The unrouted copies are added to the module on the way
+  llvm::SmallVector<llvm::Function *, 16> functions;
+  for (auto &function : module) {
+    if (!function.isDeclaration() && !function.arg_empty()) {
+      functions.push_back(&function);
+    }
+  }
+
+  auto changed = false;
+  for (auto function : functions) {
+    RegionClassifier classifier(*function, stackPointer, image,
+                                module.getDataLayout());
+    llvm::SmallVector<std::pair<llvm::CallInst *, MemoryRegion>, 16> routes;
+    auto usesStack = false;
+    for (auto &instruction : llvm::instructions(*function)) {
+      auto call = llvm::dyn_cast<llvm::CallInst>(&instruction);
+      auto callee = call ? call->getCalledFunction() : nullptr;
+      if (!callee || call->arg_size() < 2 ||
+          !isMemoryIntrinsic(callee->getName())) {
+        continue;
+      }
+      auto region = classifier.classify(call->getArgOperand(1));
+      if (region != MemoryRegion::Unknown) {
+        routes.push_back({call, region});
+        usesStack |= region == MemoryRegion::Stack;
+      }
+    }
+
+    // The stack accesses are only routed when the function checks the stack
+    // pointer first and leaves everything unknown for a stack near the image
+    std::optional<uint64_t> margin;
+    if (usesStack) {
+      margin = classifier.stackMargin();
+    }
+    if (usesStack && !margin) {
+      llvm::erase_if(routes, [](const auto &route) {
+        return route.second == MemoryRegion::Stack;
+      });
+    }
+    if (routes.empty()) {
+      continue;
+    }
+    if (margin) {
+      llvm::ValueToValueMapTy mapping;
+      auto unrouted = llvm::CloneFunction(function, mapping);
+      unrouted->setName(function->getName() + ".unrouted");
+      unrouted->setLinkage(llvm::GlobalValue::InternalLinkage);
+      guardStackPointer(*function, *unrouted, stackPointer, image, *margin);
+    }
+
+    for (auto [call, region] : routes) {
+      for (const auto &info : kRegions) {
+        if (info.region != region) {
+          continue;
+        }
+        // __remill_read_memory_64 -> __remill_stack_read_memory_64
+        auto callee = call->getCalledFunction();
+        auto name = info.helperPrefix +
+                    callee->getName().substr(sizeof(kRemillPrefix) - 1).str();
+        auto helper = module.getFunction(name);
+        if (!helper) {
+          helper = llvm::Function::Create(callee->getFunctionType(),
+                                          llvm::GlobalValue::ExternalLinkage,
+                                          name, module);
+          helper->copyAttributesFrom(callee);
+        }
+        call->setCalledFunction(helper);
+      }
+    }
+    changed = true;
+  }
+
+  return changed ? llvm::PreservedAnalyses::none()
+                 : llvm::PreservedAnalyses::all();
+}
+
+void tagMemoryRegions(llvm::Module &module) {
+  auto &context = module.getContext();
+  llvm::MDBuilder builder(context);
+  auto domain = builder.createAnonymousAliasScopeDomain("guest memory");
+
+  llvm::SmallVector<llvm::GlobalVariable *, 2> globals;
+  llvm::SmallVector<llvm::MDNode *, 2> scopes;
+  for (const auto &info : kRegions) {
+    globals.push_back(module.getNamedGlobal(info.ram));
+    scopes.push_back(builder.createAnonymousAliasScope(domain, info.scope));
+  }
+
+  // Every region is in its own scope and does not alias the other regions
+  for (auto &function : module) {
+    for (auto &instruction : llvm::instructions(function)) {
+      llvm::Value *pointer = nullptr;
+      if (auto load = llvm::dyn_cast<llvm::LoadInst>(&instruction)) {
+        pointer = load->getPointerOperand();
+      } else if (auto store = llvm::dyn_cast<llvm::StoreInst>(&instruction)) {
+        pointer = store->getPointerOperand();
+      } else {
+        continue;
+      }
+
+      auto base = llvm::getUnderlyingObject(pointer);
+      for (size_t i = 0; i < globals.size(); i++) {
+        if (!globals[i] || base != globals[i]) {
+          continue;
+        }
+        llvm::SmallVector<llvm::Metadata *, 2> others;
+        for (size_t j = 0; j < scopes.size(); j++) {
+          if (j != i) {
+            others.push_back(scopes[j]);
+          }
+        }
+        instruction.setMetadata(llvm::LLVMContext::MD_alias_scope,
+                                llvm::MDNode::get(context, {scopes[i]}));
+        instruction.setMetadata(llvm::LLVMContext::MD_noalias,
+                                llvm::MDNode::get(context, others));
+      }
+    }
+  }
+
+  // The regions are views of the same memory, only RAM is bound
+  auto ram = module.getNamedGlobal("RAM");
+  for (auto global : globals) {
+    if (!global) {
+      continue;
+    }
+    if (!ram) {
+      ram = new llvm::GlobalVariable(module, global->getValueType(),
+                                     /*isConstant=*/false,
+                                     llvm::GlobalValue::ExternalLinkage,
+                                     nullptr, "RAM");
+    }
+    global->replaceAllUsesWith(ram);
+    global->eraseFromParent();
+  }
+}
+
+bool hasMemoryRegions(const llvm::Module &helpers) {
+  return helpers.getFunction(kRegionProbe) != nullptr;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <remill/Arch/Arch.h>
+
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/PassManager.h>
+
+/// Guest memory regions lifted code can tell apart statically.
+enum class MemoryRegion { Unknown, Stack, Image };
+
+struct AddressRange {
+  uint64_t begin = 0;
+  uint64_t end = 0;
+};
+
+/// Route the remill memory intrinsics of a lifted function to the helpers of
+/// the region their address is in.
+///
+/// Addresses derived from the stack pointer (loaded from State, plus or minus
+/// small constants) are on the stack, constant addresses in one of the image
+/// ranges are in the image. Those calls go to __remill_stack_* and
+/// __remill_image_*, which the regions flavor of RemillHelpers.bc implements
+/// on the RAM_STACK and RAM_IMAGE aliases of RAM. Everything else stays
+/// unknown.
+///
+/// Stack accesses are only routed in functions without loops, and only through
+/// loads of the stack pointer no call given the state and no other store of the
+/// stack pointer can run before. Such a function first checks that the stack
+/// pointer is far enough from every image range for its stack accesses to
+/// never reach the image, and otherwise runs an unrouted copy of itself.
+///
+/// Runs after the semantics are inlined and before the helpers are, see
+/// tagMemoryRegions for the second half.
+class MemoryRegionPass : public llvm::PassInfoMixin<MemoryRegionPass> {
+public:
+  MemoryRegionPass(const remill::Arch *arch, std::vector<AddressRange> image);
+
+  llvm::PreservedAnalyses run(llvm::Module &module,
+                              llvm::ModuleAnalysisManager &mam);
+
+private:
+  const remill::Arch *arch = nullptr;
+  std::vector<AddressRange> image;
+};
+
+/// After the helpers are inlined: give every access through RAM_STACK and
+/// RAM_IMAGE scoped alias metadata of its region and replace both with RAM.
+///
+/// Stack and image accesses never alias each other, unknown accesses (no
+/// metadata) may alias anything, so DSE and GVN can move stack traffic past
+/// image accesses and the other way around.
+void tagMemoryRegions(llvm::Module &module);
+
+/// True when helpers implements the region flavor of the memory intrinsics.
+bool hasMemoryRegions(const llvm::Module &helpers);
@@ -0,0 +1,191 @@
+#include "scalarize.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <iterator>
+#include <vector>
+
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/IR/DataLayout.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/Operator.h>
+#include <llvm/Support/Alignment.h>
+#include <llvm/Support/MathExtras.h>
+
+namespace {
+
+// Ranges start at this alignment, so offsets into an alloca keep the
+// alignment they had in State
+constexpr uint64_t kRangeAlignment = 16;
+
+struct Range {
+  uint64_t begin = 0;
+  uint64_t end = 0;
+  bool written = false;
+  llvm::AllocaInst *alloca = nullptr;
+};
+
+/// Merge the accesses into disjoint ranges, every access is in exactly one.
+std::vector<Range> mergeRanges(std::vector<StateAccess> &accesses) {
+  std::sort(accesses.begin(), accesses.end(),
+            [](const StateAccess &a, const StateAccess &b) {
+              return a.offset < b.offset;
+            });
+  std::vector<Range> ranges;
+  for (const auto &access : accesses) {
+    auto begin = llvm::alignDown(access.offset, kRangeAlignment);
+    auto end = access.offset + access.size;
+    if (ranges.empty() || begin >= ranges.back().end) {
+      ranges.push_back({begin, end});
+    } else {
+      ranges.back().end = std::max(ranges.back().end, end);
+    }
+    ranges.back().written |= llvm::isa<llvm::StoreInst>(access.instruction);
+  }
+  return ranges;
+}
+
+} // namespace
+
+bool collectStateAccesses(llvm::Argument *state,
+                          const llvm::DataLayout &dataLayout,
+                          std::vector<StateAccess> &accesses,
+                          llvm::SmallPtrSetImpl<llvm::CallInst *> &calls) {
+  llvm::SmallVector<std::pair<llvm::Value *, uint64_t>, 64> worklist;
+  worklist.emplace_back(state, 0);
+  while (!worklist.empty()) {
+    auto [pointer, offset] = worklist.pop_back_val();
+    for (auto user : pointer->users()) {
+      if (auto load = llvm::dyn_cast<llvm::LoadInst>(user)) {
+        if (!load->isSimple()) {
+          return false;
+        }
+        accesses.push_back(
+            {load, offset, dataLayout.getTypeStoreSize(load->getType())});
+      } else if (auto store = llvm::dyn_cast<llvm::StoreInst>(user)) {
+        if (!store->isSimple() || store->getValueOperand() == pointer) {
+          return false;
+        }
+        auto type = store->getValueOperand()->getType();
+        accesses.push_back({store, offset, dataLayout.getTypeStoreSize(type)});
+      } else if (auto gep = llvm::dyn_cast<llvm::GEPOperator>(user)) {
+        llvm::APInt gepOffset(dataLayout.getIndexTypeSizeInBits(gep->getType()),
+                              0);
+        if (!gep->accumulateConstantOffset(dataLayout, gepOffset) ||
+            gepOffset.isNegative()) {
+          return false;
+        }
+        worklist.emplace_back(gep, offset + gepOffset.getZExtValue());
+      } else if (auto cast = llvm::dyn_cast<llvm::BitCastOperator>(user)) {
+        worklist.emplace_back(cast, offset);
+      } else if (auto call = llvm::dyn_cast<llvm::CallInst>(user)) {
+        calls.insert(call);
+      } else {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+llvm::PreservedAnalyses
+StateScalarizationPass::run(llvm::Function &function,
+                            llvm::FunctionAnalysisManager &fam) {
+  if (function.isDeclaration() || function.arg_empty() ||
+      !function.getArg(0)->getType()->isPointerTy()) {
+    return llvm::PreservedAnalyses::all();
+  }
+
+  auto state = function.getArg(0);
+  const auto &dataLayout = function.getParent()->getDataLayout();
+  std::vector<StateAccess> accesses;
+  llvm::SmallPtrSet<llvm::CallInst *, 8> calls;
+  if (!collectStateAccesses(state, dataLayout, accesses, calls) ||
+      accesses.empty()) {
+    return llvm::PreservedAnalyses::all();
+  }
+  auto ranges = mergeRanges(accesses);
+
+  auto &context = function.getContext();
+  auto int8Type = llvm::Type::getInt8Ty(context);
+  llvm::Align alignment(kRangeAlignment);
+  llvm::IRBuilder<> ir(&*function.getEntryBlock().getFirstInsertionPt());
+  for (auto &range : ranges) {
+    range.alloca =
+        ir.CreateAlloca(llvm::ArrayType::get(int8Type, range.end - range.begin),
+                        nullptr, "state.range");
+    range.alloca->setAlignment(alignment);
+  }
+
+  // Copy between State and the allocas: in at entry and after the calls,
+  // out (only what the function writes) before the calls and the returns
+  auto copy = [&](bool toState) {
+    for (const auto &range : ranges) {
+      if (toState && !range.written) {
+        continue;
+      }
+      auto pointer =
+          ir.CreateConstInBoundsGEP1_64(int8Type, state, range.begin);
+      auto size = range.end - range.begin;
+      toState ? ir.CreateMemCpy(pointer, alignment, range.alloca, alignment,
+                                size)
+              : ir.CreateMemCpy(range.alloca, alignment, pointer, alignment,
+                                size);
+    }
+  };
+  copy(/*toState=*/false);
+
+  for (auto call : calls) {
+    ir.SetInsertPoint(call);
+    copy(/*toState=*/true);
+    // Nothing can follow a musttail call but the return, and the caller
+    // does not look at the allocas after that
+    if (!call->isMustTailCall()) {
+      ir.SetInsertPoint(call->getNextNode());
+      copy(/*toState=*/false);
+    }
+  }
+  for (auto &instruction : llvm::instructions(function)) {
+    if (llvm::isa<llvm::ReturnInst>(instruction)) {
+      auto ret = &instruction;
+      if (auto previous = llvm::dyn_cast_or_null<llvm::CallInst>(
+              ret->getPrevNode());
+          previous && previous->isMustTailCall()) {
+        continue;
+      }
+      ir.SetInsertPoint(ret);
+      copy(/*toState=*/true);
+    }
+  }
+
+  // Ranges are sorted and disjoint, so the range of an access is the last one
+  // starting at or before it
+  for (const auto &access : accesses) {
+    auto range = std::prev(std::upper_bound(
+        ranges.begin(), ranges.end(), access.offset,
+        [](uint64_t offset, const Range &range) {
+          return offset < range.begin;
+        }));
+    auto relative = access.offset - range->begin;
+    ir.SetInsertPoint(access.instruction);
+    auto pointer =
+        ir.CreateConstInBoundsGEP1_64(int8Type, range->alloca, relative);
+
+    auto accessAlignment = llvm::commonAlignment(alignment, relative);
+    if (auto load = llvm::dyn_cast<llvm::LoadInst>(access.instruction)) {
+      load->setOperand(load->getPointerOperandIndex(), pointer);
+      load->setAlignment(std::min(load->getAlign(), accessAlignment));
+    } else {
+      auto store = llvm::cast<llvm::StoreInst>(access.instruction);
+      store->setOperand(store->getPointerOperandIndex(), pointer);
+      store->setAlignment(std::min(store->getAlign(), accessAlignment));
+    }
+  }
+
+  llvm::PreservedAnalyses preserved;
+  preserved.preserveSet<llvm::CFGAnalyses>();
+  return preserved;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/IR/DataLayout.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/PassManager.h>
+
+/// A load or store on State at a constant offset.
+struct StateAccess {
+  llvm::Instruction *instruction = nullptr;
+  uint64_t offset = 0;
+  uint64_t size = 0;
+};
+
+/// Collect the loads and stores on state (through constant GEPs and casts)
+/// and the calls that receive it. Returns false when state escapes in any
+/// other way.
+bool collectStateAccesses(llvm::Argument *state,
+                          const llvm::DataLayout &dataLayout,
+                          std::vector<StateAccess> &accesses,
+                          llvm::SmallPtrSetImpl<llvm::CallInst *> &calls);
+
+/// Promote the State accesses of a lifted function to SSA values.
+///
+/// Lifted code reads and writes every register through loads and stores on
+/// the State argument, and the optimizer cannot keep a register in a value
+/// across an instruction that might see State. This pass gives every range of
+/// State the function touches its own alloca. The range is copied in at entry
+/// and after every call that receives State, and copied back before those
+/// calls and at the returns, if the function writes to it. SROA then turns the
+/// allocas into SSA values, including the accesses to sub-registers.
+///
+/// Only valid for functions whose State (the first argument) is not accessed
+/// through any other pointer, which holds for lifted functions after the
+/// semantics are inlined. Functions where State escapes in other ways than
+/// call arguments are left alone.
+class StateScalarizationPass
+    : public llvm::PassInfoMixin<StateScalarizationPass> {
+public:
+  llvm::PreservedAnalyses run(llvm::Function &function,
+                              llvm::FunctionAnalysisManager &fam);
+};
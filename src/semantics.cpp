@@ -0,0 +1,309 @@
+#include "semantics.hpp"
+#include "embedded.hpp"
+#include "metrics.hpp"
+
+#include <optional>
+
+#include <remill/Arch/Name.h>
+#include <remill/BC/Util.h>
+#include <remill/OS/OS.h>
+#include <remill/Version/Version.h>
+
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IRReader/IRReader.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/SHA1.h>
+#include <llvm/Support/SmallVectorMemoryBuffer.h>
+#include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/raw_ostream.h>
+
+std::unique_ptr<llvm::Module> parsePatch(llvm::Module &module,
+                                         const std::string &patchPath) {
+  auto buffer = readBitcode(patchPath);
+  if (!buffer) {
+    llvm::errs() << "Failed to read hotpatch " << patchPath << ": "
+                 << buffer.getError().message() << "\n";
+    return nullptr;
+  }
+
+  // The linker materializes the patch functions it moves into the module
+  llvm::SMDiagnostic error;
+  auto patchModule =
+      llvm::getLazyIRModule(std::move(*buffer), error, module.getContext());
+  if (!patchModule) {
+    llvm::errs() << "Failed to parse hotpatch module: " << error.getMessage()
+                 << "\n";
+    return nullptr;
+  }
+
+  // Prepare the patch module to be compatible with the semantics module
+  patchModule->setDataLayout(module.getDataLayout());
+  patchModule->setTargetTriple(module.getTargetTriple());
+  return patchModule;
+}
+
+bool hotpatchRemill(llvm::Module &module, const std::string &hotpatchPath) {
+  PhaseTimer timer(Phase::HotpatchLink);
+  auto patchModule = parsePatch(module, hotpatchPath);
+  if (!patchModule) {
+    return false;
+  }
+
+  // Rename existing ISEL_ globals to avoid conflicts during linking
+  // The hotpatch module's ISEL_ globals will take precedence
+  for (const auto &global : patchModule->globals()) {
+    const auto &globalName = global.getName().str();
+    // Check if this is a hotpatch ISEL global variable
+    if (globalName.rfind("ISEL_", 0) == 0) {
+      // Find and rename the existing global in the semantics module
+      auto *existingGlobal = module.getGlobalVariable(globalName);
+      if (existingGlobal) {
+        existingGlobal->setName(globalName + "_original");
+        llvm::outs() << "Hotpatching: " << globalName << "\n";
+        Metrics::add(Counter::IselOverridden, 1);
+      }
+    }
+  }
+
+  // Link the hotpatch module into the semantics module
+  // OverrideFromSrc ensures the hotpatch definitions take precedence
+  if (llvm::Linker::linkModules(module, std::move(patchModule),
+                                llvm::Linker::Flags::OverrideFromSrc)) {
+    llvm::errs() << "Failed to link hotpatch module\n";
+    return false;
+  }
+
+  return true;
+}
+
+const char *helpersArchDir(const std::string &arch) {
+  // Also covers the _avx and _avx512 variants
+  if (arch.rfind("amd64", 0) == 0) {
+    return "x86_64";
+  }
+  if (arch.rfind("x86", 0) == 0) {
+    return "x86_32";
+  }
+  if (arch.rfind("aarch64", 0) == 0) {
+    return "aarch64";
+  }
+  return nullptr;
+}
+
+/// Hash everything that influences the contents of the hotpatched semantics.
+static std::string
+semanticsCacheKey(const remill::Arch *arch,
+                  const std::filesystem::path &hotpatchPath) {
+  llvm::SHA1 hasher;
+  auto addField = [&hasher](llvm::StringRef value) {
+    hasher.update(value);
+    hasher.update(llvm::StringRef("\0", 1));
+  };
+
+  addField(remill::version::HasVersionData()
+               ? remill::version::GetCommitHash()
+               : std::string("unknown"));
+  addField(LLVM_VERSION_STRING);
+  addField(remill::GetArchName(arch->arch_name));
+  addField(remill::GetOSName(arch->os_name));
+
+  if (auto buffer = readBitcode(hotpatchPath)) {
+    addField((*buffer)->getBuffer());
+  } else {
+    addField("");
+  }
+
+  return llvm::toHex(hasher.final(), /*LowerCase=*/true);
+}
+
+/// Finish parsing semantics bitcode the same way LoadArchSemantics does.
+static std::unique_ptr<llvm::Module>
+initSemantics(const remill::Arch *arch,
+              llvm::Expected<std::unique_ptr<llvm::Module>> module,
+              llvm::StringRef identifier) {
+  if (!module) {
+    llvm::errs() << "Failed to parse semantics " << identifier << ": "
+                 << llvm::toString(module.takeError()) << "\n";
+    return nullptr;
+  }
+
+  arch->PrepareModule(module->get());
+  arch->InitFromSemanticsModule(module->get());
+  return std::move(*module);
+}
+
+std::unique_ptr<llvm::Module> parseSemantics(const remill::Arch *arch,
+                                             llvm::MemoryBufferRef bitcode,
+                                             bool lazy) {
+  auto module = lazy ? llvm::getLazyBitcodeModule(bitcode, *arch->context)
+                     : llvm::parseBitcodeFile(bitcode, *arch->context);
+  return initSemantics(arch, std::move(module),
+                       bitcode.getBufferIdentifier());
+}
+
+/// Parse a semantics bitcode file, lazy modules take ownership of the mapping
+/// because the function bodies are read from it later.
+static std::unique_ptr<llvm::Module>
+parseSemanticsFile(const remill::Arch *arch, const std::filesystem::path &path,
+                   bool lazy) {
+  auto buffer = llvm::MemoryBuffer::getFile(path.string(), /*IsText=*/false,
+                                            /*RequiresNullTerminator=*/false);
+  if (!buffer) {
+    return nullptr;
+  }
+
+  if (lazy) {
+    auto module =
+        llvm::getOwningLazyBitcodeModule(std::move(*buffer), *arch->context);
+    return initSemantics(arch, std::move(module), path.string());
+  }
+  return parseSemantics(arch, (*buffer)->getMemBufferRef(), /*lazy=*/false);
+}
+
+static void storeCachedSemantics(const llvm::Module &module,
+                                 const std::filesystem::path &cachePath) {
+  std::error_code ec;
+  std::filesystem::create_directories(cachePath.parent_path(), ec);
+
+  // Write to a temporary file and rename it so concurrent processes never
+  // observe a partially written cache entry
+  int fd = -1;
+  llvm::SmallString<256> tempPath;
+  auto model = cachePath.string() + ".%%%%%%.tmp";
+  if (llvm::sys::fs::createUniqueFile(model, fd, tempPath)) {
+    llvm::errs() << "Failed to create semantics cache entry in "
+                 << cachePath.parent_path().string() << "\n";
+    return;
+  }
+
+  {
+    llvm::raw_fd_ostream os(fd, /*shouldClose=*/true);
+    llvm::WriteBitcodeToFile(module, os);
+  }
+
+  if (llvm::sys::fs::rename(tempPath, cachePath.string())) {
+    llvm::sys::fs::remove(tempPath);
+  }
+}
+
+std::unique_ptr<llvm::Module> loadSemantics(const remill::Arch *arch,
+                                            const SemanticsOptions &options) {
+  const auto &hotpatchPath = options.hotpatchPath;
+  std::filesystem::path cachePath;
+  // The hotpatch link is timed on its own
+  std::optional<PhaseTimer> timer(std::in_place, Phase::SemanticsLoad);
+  if (!options.cacheDir.empty()) {
+    cachePath =
+        options.cacheDir / (semanticsCacheKey(arch, hotpatchPath) + ".bc");
+    if (std::filesystem::exists(cachePath)) {
+      if (auto semantics = parseSemanticsFile(arch, cachePath, options.lazy)) {
+        llvm::outs() << "Loaded cached semantics from: " << cachePath.string()
+                     << "\n";
+        return semantics;
+      }
+      llvm::errs() << "Ignoring corrupt semantics cache: "
+                   << cachePath.string() << "\n";
+    }
+  }
+
+  std::unique_ptr<llvm::Module> semantics;
+  if (options.lazy) {
+    auto path =
+        remill::FindSemanticsBitcodeFile(remill::GetArchName(arch->arch_name));
+    if (path) {
+      semantics = parseSemanticsFile(arch, *path, /*lazy=*/true);
+    }
+  } else {
+    semantics = remill::LoadArchSemantics(arch);
+  }
+  timer.reset();
+  if (!semantics) {
+    return nullptr;
+  }
+
+  if (bitcodeExists(hotpatchPath)) {
+    llvm::outs() << "Applying hotpatch from: " << hotpatchPath.string() << "\n";
+    if (!hotpatchRemill(*semantics, hotpatchPath.string())) {
+      // Do not cache a module with a partially applied hotpatch
+      llvm::outs() << "Warning: Failed to apply hotpatch\n";
+      return semantics;
+    }
+  } else {
+    llvm::outs() << "No hotpatch file found at: " << hotpatchPath.string()
+                 << "\n";
+  }
+
+  if (!cachePath.empty()) {
+    // The cache entry has to contain every function body, later (lazy) runs
+    // only read the ones they need from it
+    if (auto error = semantics->materializeAll()) {
+      llvm::errs() << "Failed to materialize semantics: "
+                   << llvm::toString(std::move(error)) << "\n";
+      return nullptr;
+    }
+    storeCachedSemantics(*semantics, cachePath);
+  }
+  return semantics;
+}
+
+std::unique_ptr<llvm::MemoryBuffer>
+semanticsBitcode(const remill::Arch *arch, llvm::Module &semantics,
+                 const SemanticsOptions &options) {
+  if (!options.cacheDir.empty()) {
+    auto cachePath = options.cacheDir /
+                     (semanticsCacheKey(arch, options.hotpatchPath) + ".bc");
+    auto buffer =
+        llvm::MemoryBuffer::getFile(cachePath.string(), /*IsText=*/false,
+                                    /*RequiresNullTerminator=*/false);
+    if (buffer) {
+      return std::move(*buffer);
+    }
+  }
+
+  if (auto error = semantics.materializeAll()) {
+    llvm::errs() << "Failed to materialize semantics: "
+                 << llvm::toString(std::move(error)) << "\n";
+    return nullptr;
+  }
+
+  llvm::SmallVector<char, 0> bitcode;
+  llvm::raw_svector_ostream os(bitcode);
+  llvm::WriteBitcodeToFile(semantics, os);
+  return std::make_unique<llvm::SmallVectorMemoryBuffer>(
+      std::move(bitcode), "semantics.bc", /*RequiresNullTerminator=*/false);
+}
+
+bool materializeSemantics(llvm::Function *function) {
+  llvm::SmallVector<llvm::Function *, 16> worklist = {function};
+  llvm::SmallPtrSet<llvm::Function *, 16> seen = {function};
+  while (!worklist.empty()) {
+    auto current = worklist.pop_back_val();
+    if (current->isMaterializable()) {
+      if (auto error = current->materialize()) {
+        llvm::errs() << "Failed to materialize " << current->getName() << ": "
+                     << llvm::toString(std::move(error)) << "\n";
+        return false;
+      }
+    }
+
+    // Semantic functions are referenced by direct calls, but also by
+    // function pointers (for example in the __remill_* intrinsic tables)
+    for (auto &instruction : llvm::instructions(*current)) {
+      for (auto &operand : instruction.operands()) {
+        auto callee =
+            llvm::dyn_cast<llvm::Function>(operand->stripPointerCasts());
+        if (callee && seen.insert(callee).second) {
+          worklist.push_back(callee);
+        }
+      }
+    }
+  }
+  return true;
+}
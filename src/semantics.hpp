@@ -0,0 +1,75 @@
+#pragma once
+
+#include <filesystem>
+#include <memory>
+#include <string>
+
+#include <remill/Arch/Arch.h>
+
+#include <llvm/IR/Module.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+/// Hotpatch remill semantics by loading a bitcode module and linking it.
+///
+/// Remill instruction selection works via ISEL_* global variables that point to
+/// semantic functions. For example, ISEL_CPUID points to the function that
+/// implements the CPUID instruction.
+///
+/// To hotpatch an instruction:
+/// 1. Create a .cpp file with the remill runtime headers
+/// 2. Define a semantic function using DEF_SEM(name) { ... }
+/// 3. Register it with DEF_ISEL(INSTRUCTION_NAME) = semantic_function;
+/// 4. Compile to bitcode and link into the semantics module
+///
+/// See helpers/x86_64/RemillHotpatch.cpp for an example.
+bool hotpatchRemill(llvm::Module &module, const std::string &hotpatchPath);
+
+/// Parse a hotpatch (bitcode or textual IR) lazily into the context of
+/// module and give it the data layout and triple of module.
+std::unique_ptr<llvm::Module> parsePatch(llvm::Module &module,
+                                         const std::string &patchPath);
+
+/// Directory of helpers/ that builds the helpers and the hotpatch of a remill
+/// architecture, nullptr for architectures without helpers.
+const char *helpersArchDir(const std::string &arch);
+
+/// How loadSemantics() obtains the semantics module.
+struct SemanticsOptions {
+  std::filesystem::path hotpatchPath;
+  // Directory to cache the hotpatched semantics in (disabled when empty)
+  std::filesystem::path cacheDir;
+  // Only materialize semantic functions once a lifted function uses them
+  bool lazy = false;
+};
+
+/// Load the semantics module of arch and apply the hotpatch (when it exists).
+///
+/// When a cache directory is configured the final, hotpatched module is stored
+/// there as bitcode. The cache key covers the remill and LLVM versions, the
+/// arch/OS names and the contents of the hotpatch, so later runs with the same
+/// inputs skip both LoadArchSemantics and the hotpatch link step.
+///
+/// In lazy mode the function bodies stay in the (memory-mapped) bitcode until
+/// materializeSemantics() is called for a lifted function that reaches them.
+std::unique_ptr<llvm::Module> loadSemantics(const remill::Arch *arch,
+                                            const SemanticsOptions &options);
+
+/// Serialize the final semantics module so it can be parsed into another
+/// LLVMContext with parseSemantics(). The cache entry is mapped instead of
+/// writing the module again when it exists.
+std::unique_ptr<llvm::MemoryBuffer>
+semanticsBitcode(const remill::Arch *arch, llvm::Module &semantics,
+                 const SemanticsOptions &options);
+
+/// Parse semantics bitcode into the context of arch and initialize arch from
+/// it. The bitcode has to outlive the module when parsing lazily.
+std::unique_ptr<llvm::Module> parseSemantics(const remill::Arch *arch,
+                                             llvm::MemoryBufferRef bitcode,
+                                             bool lazy);
+
+/// Materialize all the semantic functions transitively used by function.
+///
+/// LiftIntoBlock only emits calls to the semantic functions referenced by the
+/// ISEL_* globals, so this has to run before the lifted function is optimized.
+/// It is a no-op for modules that were not loaded lazily.
+bool materializeSemantics(llvm::Function *function);
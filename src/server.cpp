@@ -0,0 +1,120 @@
+#include <csignal>
+#include <cstdlib>
+
+#include "daemon.hpp"
+#include "exepath.hpp"
+#include "optimizer.hpp"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/raw_ostream.h>
+
+DEFINE_string(socket, "",
+              "Unix socket path or TCP host:port to serve lift requests on "
+              "(:port only listens on the loopback address)");
+DEFINE_string(image_root, "",
+              "Directory the image requests of clients can open files in "
+              "(image requests are refused when empty)");
+DEFINE_string(archs, "amd64,x86,aarch64",
+              "Comma separated remill architectures to keep warm");
+DEFINE_string(os, "linux", "remill OS of every architecture");
+DEFINE_string(helpers_dir, "",
+              "Directory with the helpers/<arch> build outputs (defaults to "
+              "the helpers directory next to the executable)");
+DEFINE_string(patch_dir, "",
+              "Directory with a subdirectory of hotpatches per architecture "
+              "(x86_64, x86_32, aarch64) that are applied and reloaded while "
+              "serving (disabled when empty)");
+DEFINE_uint32(patch_poll_interval, 1000,
+              "Milliseconds between two scans of --patch_dir");
+DEFINE_string(semantics_cache, "",
+              "Directory to cache the hotpatched semantics modules in "
+              "(disabled when empty)");
+DEFINE_bool(lazy_semantics, false,
+            "Only materialize the semantic functions used by lifted code");
+DEFINE_string(optimizer, "incremental",
+              "How lifted functions are optimized: incremental or module "
+              "(remill::OptimizeModule)");
+DEFINE_string(pipeline, "default",
+              "Pipeline of the incremental optimizer: default, fast, "
+              "deobfuscate or custom");
+DEFINE_string(pipeline_text, "",
+              "New pass manager function pipeline for --pipeline=custom");
+DEFINE_bool(scalarize_state, false,
+            "Promote State accesses to SSA values in the incremental "
+            "optimizer");
+DEFINE_bool(freeze_undefined, false,
+            "Lower undefined values (__remill_undefined_*) to freeze poison "
+            "in the incremental optimizer");
+DEFINE_bool(eliminate_flags, false,
+            "Remove dead flag computations in the incremental optimizer");
+DEFINE_bool(fold_constant_memory, true,
+            "Fold reads of the read-only segments of object images");
+DEFINE_bool(decode_cache, true,
+            "Keep a DecodeCache for every architecture across requests");
+
+int main(int argc, char **argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+
+  if (FLAGS_socket.empty()) {
+    llvm::errs() << "No socket to serve on, use --socket\n";
+    return EXIT_FAILURE;
+  }
+
+  DaemonOptions options;
+  llvm::SmallVector<llvm::StringRef, 4> archNames;
+  llvm::StringRef(FLAGS_archs).split(archNames, ',', -1, false);
+  options.archs.clear();
+  for (auto archName : archNames) {
+    options.archs.push_back(archName.trim().str());
+  }
+  options.helpersDir = FLAGS_helpers_dir.empty()
+                           ? executableDir() / "helpers"
+                           : std::filesystem::path(FLAGS_helpers_dir);
+  options.patchDir = FLAGS_patch_dir;
+  options.patchPollInterval =
+      std::chrono::milliseconds(FLAGS_patch_poll_interval);
+  options.imageRoot = FLAGS_image_root;
+
+  auto &lift = options.lift;
+  lift.os = FLAGS_os;
+  lift.decodeCache = FLAGS_decode_cache;
+  lift.semantics.cacheDir = FLAGS_semantics_cache;
+  lift.semantics.lazy = FLAGS_lazy_semantics;
+  if (FLAGS_optimizer == "module") {
+    lift.incrementalOptimizer = false;
+    if (FLAGS_lazy_semantics) {
+      llvm::errs() << "--lazy_semantics requires --optimizer=incremental\n";
+      return EXIT_FAILURE;
+    }
+  } else if (FLAGS_optimizer != "incremental") {
+    llvm::errs() << "Unknown optimizer: " << FLAGS_optimizer << "\n";
+    return EXIT_FAILURE;
+  }
+  auto pipeline = parsePipelinePreset(FLAGS_pipeline);
+  if (!pipeline) {
+    llvm::errs() << "Unknown pipeline: " << FLAGS_pipeline << "\n";
+    return EXIT_FAILURE;
+  }
+  lift.pipeline = *pipeline;
+  lift.pipelineText = FLAGS_pipeline_text;
+  lift.scalarizeState = FLAGS_scalarize_state;
+  lift.freezeUndefined = FLAGS_freeze_undefined;
+  lift.eliminateFlags = FLAGS_eliminate_flags;
+  lift.foldConstantMemory = FLAGS_fold_constant_memory;
+
+  auto daemon = LiftDaemon::create(options);
+  if (!daemon) {
+    return EXIT_FAILURE;
+  }
+
+#if !defined(_WIN32)
+  // A client that goes away mid-response must not take the daemon with it
+  std::signal(SIGPIPE, SIG_IGN);
+#endif
+  return daemon->serve(FLAGS_socket) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
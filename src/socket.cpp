@@ -0,0 +1,265 @@
+#include "socket.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+#include <llvm/Support/raw_ostream.h>
+
+#if !defined(_WIN32)
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#if defined(_WIN32)
+
+int listenSocket(const std::string &address) {
+  llvm::errs() << "Sockets are not supported on Windows\n";
+  return -1;
+}
+
+int acceptSocket(int listener) { return -1; }
+
+int connectSocket(const std::string &address) {
+  llvm::errs() << "Sockets are not supported on Windows\n";
+  return -1;
+}
+
+void closeSocket(int socket) {}
+
+void shutdownSocket(int socket) {}
+
+bool readLine(int socket, std::string &line, size_t maxSize) { return false; }
+
+bool readAll(int socket, char *data, size_t size) { return false; }
+
+bool writeAll(int socket, llvm::StringRef data) { return false; }
+
+#else
+
+/// Splits host:port, false for the path of a Unix socket.
+static bool splitHostPort(const std::string &address, std::string &host,
+                          std::string &port) {
+  auto colon = address.rfind(':');
+  if (address.find('/') != std::string::npos || colon == std::string::npos ||
+      colon + 1 == address.size()) {
+    return false;
+  }
+  host = address.substr(0, colon);
+  port = address.substr(colon + 1);
+  return port.find_first_not_of("0123456789") == std::string::npos;
+}
+
+/// Resolve a TCP address and call connect (or bind) on the first candidate
+/// that accepts it. Without a host this is the loopback address, also for
+/// listening: every other interface has to be asked for (0.0.0.0 or ::).
+template <typename F>
+static int openTcp(const std::string &host, const std::string &port,
+                   F &&attach) {
+  addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *candidates = nullptr;
+  auto status = ::getaddrinfo(host.empty() ? nullptr : host.c_str(),
+                              port.c_str(), &hints, &candidates);
+  if (status != 0) {
+    llvm::errs() << "Failed to resolve " << host << ":" << port << ": "
+                 << ::gai_strerror(status) << "\n";
+    return -1;
+  }
+
+  auto result = -1;
+  for (auto candidate = candidates; candidate && result < 0;
+       candidate = candidate->ai_next) {
+    auto fd = ::socket(candidate->ai_family, candidate->ai_socktype,
+                       candidate->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    if (attach(fd, candidate->ai_addr, candidate->ai_addrlen)) {
+      result = fd;
+    } else {
+      ::close(fd);
+    }
+  }
+  ::freeaddrinfo(candidates);
+  return result;
+}
+
+static bool unixAddress(const std::string &path, sockaddr_un &address) {
+  address = {};
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) {
+    llvm::errs() << "Socket path is too long: " << path << "\n";
+    return false;
+  }
+  std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+  return true;
+}
+
+int listenSocket(const std::string &address) {
+  std::string host;
+  std::string port;
+  auto fd = -1;
+  if (splitHostPort(address, host, port)) {
+    fd = openTcp(host, port,
+                 [](int fd, const sockaddr *address, socklen_t size) {
+                   int reuse = 1;
+                   ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse,
+                                sizeof(reuse));
+                   return ::bind(fd, address, size) == 0;
+                 });
+  } else {
+    sockaddr_un local = {};
+    if (!unixAddress(address, local)) {
+      return -1;
+    }
+    fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0) {
+      ::unlink(address.c_str());
+      if (::bind(fd, reinterpret_cast<sockaddr *>(&local),
+                 sizeof(local)) != 0) {
+        ::close(fd);
+        fd = -1;
+      }
+    }
+  }
+
+  if (fd < 0 || ::listen(fd, SOMAXCONN) != 0) {
+    llvm::errs() << "Failed to listen on " << address << ": "
+                 << std::strerror(errno) << "\n";
+    closeSocket(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int acceptSocket(int listener) {
+  std::chrono::milliseconds backoff{0};
+  while (true) {
+    auto fd = ::accept(listener, nullptr, nullptr);
+    if (fd >= 0) {
+      return fd;
+    }
+    switch (errno) {
+    case EINTR:
+    case ECONNABORTED:
+    case EPROTO:
+      continue;
+    case EMFILE:
+    case ENFILE:
+    case ENOBUFS:
+    case ENOMEM:
+      // Wait for connections to close, up to a second between the attempts
+      if (backoff.count() == 0) {
+        llvm::errs() << "Failed to accept connection, retrying: "
+                     << std::strerror(errno) << "\n";
+      }
+      backoff = std::clamp(backoff * 2, std::chrono::milliseconds(10),
+                           std::chrono::milliseconds(1000));
+      std::this_thread::sleep_for(backoff);
+      continue;
+    default:
+      llvm::errs() << "Failed to accept connection: " << std::strerror(errno)
+                   << "\n";
+      return -1;
+    }
+  }
+}
+
+int connectSocket(const std::string &address) {
+  std::string host;
+  std::string port;
+  auto fd = -1;
+  if (splitHostPort(address, host, port)) {
+    fd = openTcp(host, port,
+                 [](int fd, const sockaddr *address, socklen_t size) {
+                   return ::connect(fd, address, size) == 0;
+                 });
+  } else {
+    sockaddr_un local = {};
+    if (!unixAddress(address, local)) {
+      return -1;
+    }
+    fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && ::connect(fd, reinterpret_cast<sockaddr *>(&local),
+                             sizeof(local)) != 0) {
+      ::close(fd);
+      fd = -1;
+    }
+  }
+
+  if (fd < 0) {
+    llvm::errs() << "Failed to connect to " << address << ": "
+                 << std::strerror(errno) << "\n";
+  }
+  return fd;
+}
+
+void closeSocket(int socket) {
+  if (socket >= 0) {
+    ::close(socket);
+  }
+}
+
+void shutdownSocket(int socket) {
+  if (socket >= 0) {
+    ::shutdown(socket, SHUT_RDWR);
+  }
+}
+
+bool readLine(int socket, std::string &line, size_t maxSize) {
+  line.clear();
+  char c = 0;
+  while (true) {
+    auto n = ::read(socket, &c, 1);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    if (c == '\n') {
+      return true;
+    }
+    if (line.size() == maxSize) {
+      return false;
+    }
+    line.push_back(c);
+  }
+}
+
+bool readAll(int socket, char *data, size_t size) {
+  while (size) {
+    auto n = ::read(socket, data, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    size -= n;
+  }
+  return true;
+}
+
+bool writeAll(int socket, llvm::StringRef data) {
+  while (!data.empty()) {
+    auto n = ::write(socket, data.data(), data.size());
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    data = data.drop_front(n);
+  }
+  return true;
+}
+
+#endif
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+#include <llvm/ADT/StringRef.h>
+
+/// Minimal blocking stream sockets for the lift daemon and its clients.
+///
+/// An address of the form host:port is a TCP socket, anything else the path
+/// of a Unix socket. Functions return -1 or false on failure (after printing
+/// the reason) and are only implemented on POSIX systems.
+
+/// Listen on address, replacing a Unix socket left behind by a previous run.
+/// A TCP address without a host (:port) only listens on the loopback address.
+int listenSocket(const std::string &address);
+
+/// Wait for the next connection on listener. Retries when interrupted or the
+/// connection was aborted, and backs off while out of file descriptors or
+/// memory.
+int acceptSocket(int listener);
+
+int connectSocket(const std::string &address);
+
+void closeSocket(int socket);
+
+/// Stop reading and writing on socket, wakes up a thread blocked in reading
+/// it.
+void shutdownSocket(int socket);
+
+/// Read one line without the newline, false on EOF, error or when the line is
+/// longer than maxSize.
+bool readLine(int socket, std::string &line, size_t maxSize = 1 << 20);
+
+bool readAll(int socket, char *data, size_t size);
+
+bool writeAll(int socket, llvm::StringRef data);
@@ -0,0 +1,638 @@
+#include "tcache.hpp"
+#include "extract.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <optional>
+
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/Intrinsics.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Utils/BasicBlockUtils.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+
+static const char kWriteMemoryPrefix[] = "__remill_write_memory_";
+static const char kCompareExchangePrefix[] =
+    "__remill_compare_exchange_memory_";
+static const char kFetchAndPrefix[] = "__remill_fetch_and_";
+
+/// Number of bytes written by __remill_write_memory_<bits> (or f<bits>) and
+/// the atomic __remill_compare_exchange_memory_<bits> and
+/// __remill_fetch_and_<op>_<bits>, 0 for other functions. All of them take
+/// the address as their second argument.
+static uint64_t writeSize(llvm::StringRef name) {
+  if (name.consume_front(kWriteMemoryPrefix)) {
+    name.consume_front("f");
+  } else if (name.consume_front(kFetchAndPrefix)) {
+    name = name.substr(name.rfind('_') + 1);
+  } else if (!name.consume_front(kCompareExchangePrefix)) {
+    return 0;
+  }
+  uint64_t bits = 0;
+  if (name.getAsInteger(10, bits)) {
+    return 0;
+  }
+  return bits / 8;
+}
+
+static llvm::GlobalVariable *externalGlobal(llvm::Module &module,
+                                            llvm::StringRef name,
+                                            llvm::Type *type) {
+  if (auto global = module.getNamedGlobal(name)) {
+    return global;
+  }
+  return new llvm::GlobalVariable(module, type, /*isConstant=*/false,
+                                  llvm::GlobalValue::ExternalLinkage, nullptr,
+                                  name);
+}
+
+std::unique_ptr<TranslationCache>
+TranslationCache::create(const remill::Arch *arch, llvm::Module *semantics,
+                         JitExecutor &executor, GuestMemory &memory,
+                         IncrementalOptimizer *optimizer) {
+  std::unique_ptr<TranslationCache> cache(
+      new TranslationCache(arch, semantics, executor, memory, optimizer));
+  cache->lifter.setUpdatePc(true);
+
+  // One entry per page of the guest memory and a last one that is never set,
+  // lifted code clamps the index of any page outside the memory to it
+  cache->codePages.resize((memory.getSize() >> kPageShift) + 2);
+
+  // The symbols are per executor, so there is one cache per JitExecutor
+  auto address = [](const void *pointer) {
+    return static_cast<uint64_t>(reinterpret_cast<uintptr_t>(pointer));
+  };
+  if (!executor.defineSymbol("__tcache_code_pages",
+                             address(cache->codePages.data())) ||
+      !executor.defineSymbol("__tcache_chain_budget",
+                             address(&cache->chainBudget)) ||
+      !executor.defineSymbol("__tcache_context", address(cache.get())) ||
+      !executor.defineSymbol(
+          "__tcache_code_written",
+          reinterpret_cast<uintptr_t>(&TranslationCache::codeWritten)) ||
+      !executor.defineSymbol(
+          "__tcache_block_hot",
+          reinterpret_cast<uintptr_t>(&TranslationCache::blockHot))) {
+    return nullptr;
+  }
+  return cache;
+}
+
+void *TranslationCache::slotFor(uint64_t address) {
+  auto &slot = slots[address];
+  if (!slot) {
+    slot = std::make_unique<void *>(nullptr);
+    auto found = blocks.find(address);
+    if (found != blocks.end()) {
+      *slot = found->second.function;
+    }
+    auto name = "__tcache_slot_" + llvm::utohexstr(address, true);
+    executor.defineSymbol(name, reinterpret_cast<uintptr_t>(slot.get()));
+  }
+  return slot.get();
+}
+
+int64_t *TranslationCache::counterFor(uint64_t address) {
+  auto &counter = counters[address];
+  if (!counter) {
+    counter = std::make_unique<int64_t>(0);
+    auto name = "__tcache_count_" + llvm::utohexstr(address, true);
+    executor.defineSymbol(name, reinterpret_cast<uintptr_t>(counter.get()));
+  }
+  return counter.get();
+}
+
+llvm::Value *TranslationCache::programCounterRef(llvm::BasicBlock *block) {
+  // Through the State argument, so it also works in traces, where the PC
+  // variables of the blocks were inlined
+  auto pc = arch->RegisterByName(arch->ProgramCounterRegisterName());
+  return pc->AddressOf(block->getParent()->getArg(0), block);
+}
+
+void TranslationCache::emitChaining(
+    llvm::Function *function,
+    const llvm::SmallVectorImpl<uint64_t> &successors) {
+  llvm::ReturnInst *ret = nullptr;
+  for (auto &instruction : llvm::instructions(*function)) {
+    if (auto found = llvm::dyn_cast<llvm::ReturnInst>(&instruction)) {
+      ret = found;
+    }
+  }
+  if (!ret || successors.empty()) {
+    return;
+  }
+
+  auto &context = function->getContext();
+  auto &module = *function->getParent();
+  auto wordType = llvm::Type::getIntNTy(context, arch->address_size);
+  auto int64Type = llvm::Type::getInt64Ty(context);
+  auto pointerType = llvm::PointerType::get(context, 0);
+  auto budget = externalGlobal(module, "__tcache_chain_budget", int64Type);
+  auto memoryPointer = ret->getReturnValue();
+
+  // The lifter stored NEXT_PC into the PC register right before the return
+  auto block = ret->getParent();
+  auto exit = block->splitBasicBlock(ret, "chain.exit");
+  block->getTerminator()->eraseFromParent();
+  auto pcRef = programCounterRef(block);
+  llvm::IRBuilder<> ir(block);
+  auto nextPc = ir.CreateLoad(wordType, pcRef, "next_pc");
+
+  for (auto successor : successors) {
+    slotFor(successor);
+    auto slot = externalGlobal(
+        module, "__tcache_slot_" + llvm::utohexstr(successor, true),
+        pointerType);
+    auto pc = llvm::ConstantInt::get(wordType, successor);
+
+    auto check = llvm::BasicBlock::Create(context, "chain", function, exit);
+    auto call = llvm::BasicBlock::Create(context, "chain.call", function, exit);
+    auto next = llvm::BasicBlock::Create(context, "chain.next", function, exit);
+    ir.CreateCondBr(ir.CreateICmpEQ(nextPc, pc), check, next);
+
+    ir.SetInsertPoint(check);
+    auto target = ir.CreateLoad(pointerType, slot);
+    auto remaining = ir.CreateLoad(int64Type, budget);
+    ir.CreateCondBr(ir.CreateAnd(ir.CreateIsNotNull(target),
+                                 ir.CreateICmpSGT(remaining, ir.getInt64(0))),
+                    call, next);
+
+    // musttail keeps the host stack flat no matter how long the chain is
+    ir.SetInsertPoint(call);
+    ir.CreateStore(ir.CreateSub(remaining, ir.getInt64(1)), budget);
+    auto result =
+        ir.CreateCall(function->getFunctionType(), target,
+                      {function->getArg(0), pc, memoryPointer});
+    result->setTailCallKind(llvm::CallInst::TCK_MustTail);
+    ir.CreateRet(result);
+
+    ir.SetInsertPoint(next);
+  }
+  ir.CreateBr(exit);
+}
+
+void TranslationCache::emitCounting(llvm::Function *function,
+                                    uint64_t address) {
+  auto &context = function->getContext();
+  auto &module = *function->getParent();
+  auto int8Type = llvm::Type::getInt8Ty(context);
+  auto int64Type = llvm::Type::getInt64Ty(context);
+  auto counter = externalGlobal(
+      module, "__tcache_count_" + llvm::utohexstr(address, true), int64Type);
+  auto cacheContext = externalGlobal(module, "__tcache_context", int8Type);
+  auto blockHotType =
+      llvm::FunctionType::get(llvm::Type::getVoidTy(context),
+                              {cacheContext->getType(), int64Type}, false);
+  auto blockHot =
+      module.getOrInsertFunction("__tcache_block_hot", blockHotType);
+
+  // Keep the allocas in the entry block, they have to stay static
+  auto insertPoint = function->getEntryBlock().getFirstInsertionPt();
+  while (llvm::isa<llvm::AllocaInst>(*insertPoint)) {
+    ++insertPoint;
+  }
+  llvm::IRBuilder<> ir(&*insertPoint);
+  auto remaining =
+      ir.CreateSub(ir.CreateLoad(int64Type, counter), ir.getInt64(1));
+  ir.CreateStore(remaining, counter);
+  auto notify = llvm::SplitBlockAndInsertIfThen(
+      ir.CreateICmpEQ(remaining, ir.getInt64(0)), &*ir.GetInsertPoint(),
+      /*Unreachable=*/false);
+  ir.SetInsertPoint(notify);
+  ir.CreateCall(blockHot, {cacheContext, ir.getInt64(address)});
+}
+
+void TranslationCache::instrumentWrites(llvm::Module &module) {
+  llvm::SmallVector<std::pair<llvm::CallInst *, uint64_t>, 16> writes;
+  for (auto &function : module) {
+    for (auto &instruction : llvm::instructions(function)) {
+      auto call = llvm::dyn_cast<llvm::CallInst>(&instruction);
+      auto callee = call ? call->getCalledFunction() : nullptr;
+      if (callee) {
+        if (auto size = writeSize(callee->getName())) {
+          writes.emplace_back(call, size);
+        }
+      }
+    }
+  }
+  if (writes.empty()) {
+    return;
+  }
+
+  auto &context = module.getContext();
+  auto int8Type = llvm::Type::getInt8Ty(context);
+  auto int64Type = llvm::Type::getInt64Ty(context);
+  auto codePages = externalGlobal(module, "__tcache_code_pages", int8Type);
+  auto cacheContext = externalGlobal(module, "__tcache_context", int8Type);
+  auto codeWrittenType = llvm::FunctionType::get(
+      llvm::Type::getVoidTy(context),
+      {cacheContext->getType(), int64Type, int64Type}, false);
+  auto codeWritten =
+      module.getOrInsertFunction("__tcache_code_written", codeWrittenType);
+
+  auto basePage = memory.getBase() >> kPageShift;
+  auto outsidePage = this->codePages.size() - 1;
+  auto sandboxBits = memory.getSandboxBits();
+  // Index of the page of address in the bitmap, the guest picks the address
+  auto pageIndex = [&](llvm::IRBuilder<> &ir, llvm::Value *address) {
+    auto index = ir.CreateSub(ir.CreateLShr(address, kPageShift),
+                              ir.getInt64(basePage));
+    return ir.CreateBinaryIntrinsic(llvm::Intrinsic::umin, index,
+                                    ir.getInt64(outsidePage));
+  };
+
+  for (auto [call, size] : writes) {
+    llvm::IRBuilder<> ir(call->getNextNode());
+    auto address = ir.CreateZExtOrTrunc(call->getArgOperand(1), int64Type);
+    // The masked helpers write to the address wrapped into the sandbox
+    if (sandboxBits) {
+      address =
+          ir.CreateAnd(address, ir.getInt64((1ull << sandboxBits) - 1));
+    }
+    auto last = ir.CreateAdd(address, ir.getInt64(size - 1));
+    auto firstPage = ir.CreateLoad(
+        int8Type,
+        ir.CreateGEP(int8Type, codePages, pageIndex(ir, address)));
+    auto lastPage = ir.CreateLoad(
+        int8Type, ir.CreateGEP(int8Type, codePages, pageIndex(ir, last)));
+    auto isCode = ir.CreateICmpNE(ir.CreateOr(firstPage, lastPage),
+                                  ir.getInt8(0));
+
+    auto notify = llvm::SplitBlockAndInsertIfThen(isCode, &*ir.GetInsertPoint(),
+                                                  /*Unreachable=*/false);
+    ir.SetInsertPoint(notify);
+    ir.CreateCall(codeWritten, {cacheContext, address, ir.getInt64(size)});
+  }
+}
+
+LiftedBlock TranslationCache::liftAt(uint64_t address) {
+  auto bytes = memory.translate(address);
+  if (!bytes) {
+    llvm::errs() << "PC outside of guest memory: "
+                 << llvm::format_hex(address, 1) << "\n";
+    return {};
+  }
+  std::string_view view(reinterpret_cast<const char *>(bytes),
+                        memory.getBase() + memory.getSize() - address);
+  return lifter.liftBlock(address, view);
+}
+
+void *TranslationCache::translate(uint64_t address) {
+  auto lifted = liftAt(address);
+  if (!lifted.function) {
+    return nullptr;
+  }
+
+  Block block;
+  block.successors = lifted.successors;
+  for (auto page = address >> kPageShift;
+       page <= (lifted.nextAddress - 1) >> kPageShift; page++) {
+    block.pages.push_back(page);
+  }
+
+  emitChaining(lifted.function, lifted.successors);
+  void *function = nullptr;
+  if (hotThreshold) {
+    // Most blocks never get hot, skip the remill optimizer for them
+    *counterFor(address) = static_cast<int64_t>(hotThreshold);
+    emitCounting(lifted.function, address);
+    function = install(address, lifted.function, std::move(block),
+                       llvm::OptimizationLevel::O1);
+  } else {
+    block.tier = 1;
+    optimizeLifted(arch, semantics, {lifted.function}, optimizer);
+    function = install(address, lifted.function, std::move(block),
+                       llvm::OptimizationLevel::O2);
+  }
+  if (function) {
+    numTranslated++;
+  }
+  return function;
+}
+
+void *TranslationCache::install(uint64_t address, llvm::Function *function,
+                                Block block, llvm::OptimizationLevel level) {
+  auto extracted = extractFunctions(*semantics, {function});
+  if (optimizer) {
+    optimizer->forget(function);
+  }
+  function->eraseFromParent();
+
+  auto tracker = executor.createTracker();
+  auto instrument = [this](llvm::Module &module) { instrumentWrites(module); };
+  executor.forget(address);
+  if (!executor.addModule(*extracted, instrument, tracker, level)) {
+    return nullptr;
+  }
+  auto compiled = executor.lookup(address);
+  if (!compiled) {
+    return nullptr;
+  }
+
+  auto basePage = memory.getBase() >> kPageShift;
+  for (auto page : block.pages) {
+    codePages[page - basePage] = 1;
+    pageBlocks[page].push_back(address);
+  }
+  block.function = compiled;
+  block.tracker = std::move(tracker);
+  blocks[address] = std::move(block);
+
+  auto slot = slots.find(address);
+  if (slot != slots.end()) {
+    *slot->second = compiled;
+  }
+  return compiled;
+}
+
+llvm::Function *TranslationCache::liftTrace(llvm::ArrayRef<uint64_t> path,
+                                            bool loops, Block &trace) {
+  std::vector<LiftedBlock> lifted;
+  for (auto address : path) {
+    auto block = liftAt(address);
+    if (!block.function) {
+      for (auto &other : lifted) {
+        other.function->eraseFromParent();
+      }
+      return nullptr;
+    }
+
+    for (auto page = address >> kPageShift;
+         page <= (block.nextAddress - 1) >> kPageShift; page++) {
+      if (!llvm::is_contained(trace.pages, page)) {
+        trace.pages.push_back(page);
+      }
+    }
+    for (auto successor : block.successors) {
+      if (!llvm::is_contained(trace.successors, successor)) {
+        trace.successors.push_back(successor);
+      }
+    }
+    lifted.push_back(std::move(block));
+  }
+
+  auto head = lifted.front().function;
+  auto &context = head->getContext();
+  auto wordType = llvm::Type::getIntNTy(context, arch->address_size);
+  auto int64Type = llvm::Type::getInt64Ty(context);
+  auto budget = externalGlobal(*semantics, "__tcache_chain_budget", int64Type);
+
+  auto function =
+      llvm::Function::Create(head->getFunctionType(),
+                             llvm::GlobalValue::ExternalLinkage, "", semantics);
+  function->copyAttributesFrom(head);
+  auto state = function->getArg(0);
+  auto entry = llvm::BasicBlock::Create(context, "", function);
+  auto exit = llvm::BasicBlock::Create(context, "trace.exit", function);
+  llvm::SmallVector<llvm::BasicBlock *, kTraceLength> bodies;
+  for (size_t i = 0; i < lifted.size(); i++) {
+    bodies.push_back(
+        llvm::BasicBlock::Create(context, "trace", function, exit));
+  }
+
+  llvm::IRBuilder<> ir(entry);
+  ir.CreateBr(bodies.front());
+  ir.SetInsertPoint(exit);
+  auto exitMemory = ir.CreatePHI(function->getReturnType(), lifted.size());
+  ir.CreateRet(exitMemory);
+  ir.SetInsertPoint(bodies.front());
+  auto headMemory = ir.CreatePHI(function->getReturnType(), 2);
+  headMemory->addIncoming(function->getArg(2), entry);
+
+  // Every block is called with its own PC and the trace only continues with
+  // the next block when that is where the block went. Edges inside the trace
+  // are paid for from the chain budget, like chained blocks.
+  llvm::Value *memoryPointer = headMemory;
+  llvm::SmallVector<llvm::CallInst *, kTraceLength> calls;
+  for (size_t i = 0; i < lifted.size(); i++) {
+    ir.SetInsertPoint(bodies[i]);
+    auto call = ir.CreateCall(
+        lifted[i].function,
+        {state, llvm::ConstantInt::get(wordType, lifted[i].address),
+         memoryPointer});
+    calls.push_back(call);
+
+    auto isLast = i + 1 == lifted.size();
+    if (isLast && !loops) {
+      ir.CreateBr(exit);
+      exitMemory->addIncoming(call, ir.GetInsertBlock());
+      break;
+    }
+    auto next = isLast ? bodies.front() : bodies[i + 1];
+    auto nextAddress = isLast ? lifted.front().address : lifted[i + 1].address;
+
+    auto pcRef = programCounterRef(ir.GetInsertBlock());
+    auto nextPc = ir.CreateLoad(wordType, pcRef, "next_pc");
+    auto remaining = ir.CreateLoad(int64Type, budget);
+    auto edge = llvm::BasicBlock::Create(context, "trace.next", function, exit);
+    ir.CreateCondBr(
+        ir.CreateAnd(
+            ir.CreateICmpEQ(nextPc, llvm::ConstantInt::get(wordType,
+                                                           nextAddress)),
+            ir.CreateICmpSGT(remaining, ir.getInt64(0))),
+        edge, exit);
+    exitMemory->addIncoming(call, ir.GetInsertBlock());
+
+    ir.SetInsertPoint(edge);
+    ir.CreateStore(ir.CreateSub(remaining, ir.getInt64(1)), budget);
+    ir.CreateBr(next);
+    if (isLast) {
+      headMemory->addIncoming(call, edge);
+    }
+    memoryPointer = call;
+  }
+
+  for (auto call : calls) {
+    llvm::InlineFunctionInfo info;
+    llvm::InlineFunction(*call, info);
+  }
+  for (auto &block : lifted) {
+    block.function->eraseFromParent();
+  }
+  function->setName(BlockLifter::functionName(path.front()));
+  return function;
+}
+
+void *TranslationCache::promote(uint64_t address) {
+  auto found = blocks.find(address);
+  if (found == blocks.end() || found->second.tier != 0) {
+    return nullptr;
+  }
+
+  // Follow the compiled successor that ran most often (the lowest counter)
+  // until the trace is back at its head
+  llvm::SmallVector<uint64_t, kTraceLength> path{address};
+  auto loops = false;
+  while (path.size() < kTraceLength) {
+    const auto &current = blocks.find(path.back())->second;
+    std::optional<uint64_t> next;
+    auto nextCount = std::numeric_limits<int64_t>::max();
+    for (auto successor : current.successors) {
+      auto counter = counters.find(successor);
+      if (!blocks.count(successor) || counter == counters.end()) {
+        continue;
+      }
+      if (!next || *counter->second < nextCount) {
+        next = successor;
+        nextCount = *counter->second;
+      }
+    }
+
+    if (!next || llvm::is_contained(path, *next)) {
+      loops = next == address;
+      break;
+    }
+    path.push_back(*next);
+  }
+
+  Block trace;
+  trace.tier = 1;
+  auto function = liftTrace(path, loops, trace);
+  if (!function) {
+    return nullptr;
+  }
+  emitChaining(function, trace.successors);
+  optimizeLifted(arch, semantics, {function}, optimizer);
+
+  // Nothing runs lifted code while the dispatcher promotes, so the tier 0
+  // code can go right away
+  found = blocks.find(address);
+  unlinkPages(address, found->second);
+  auto slot = slots.find(address);
+  if (slot != slots.end()) {
+    *slot->second = nullptr;
+  }
+  executor.forget(address);
+  if (auto error = found->second.tracker->remove()) {
+    llvm::errs() << "Failed to release tier 0 code: "
+                 << llvm::toString(std::move(error)) << "\n";
+  }
+  blocks.erase(found);
+
+  auto compiled = install(address, function, std::move(trace),
+                          llvm::OptimizationLevel::O3);
+  if (compiled) {
+    numPromoted++;
+  }
+  return compiled;
+}
+
+void TranslationCache::promoteHot() {
+  auto addresses = std::move(hot);
+  hot.clear();
+  for (auto address : addresses) {
+    promote(address);
+  }
+}
+
+void TranslationCache::stopChain() {
+  numChained += chainStart - chainBudget;
+  chainStart = 0;
+  chainBudget = 0;
+}
+
+void TranslationCache::codeWritten(TranslationCache *cache, uint64_t address,
+                                   uint64_t size) {
+  // The current block (or trace) runs to its end with the code it was
+  // compiled from, but the chain must not continue into blocks that might be
+  // stale now
+  cache->stopChain();
+  cache->invalidatePage(address >> kPageShift);
+  cache->invalidatePage((address + size - 1) >> kPageShift);
+}
+
+void TranslationCache::blockHot(TranslationCache *cache, uint64_t address) {
+  // Back to the dispatcher after this block, so it can be promoted
+  cache->stopChain();
+  cache->hot.push_back(address);
+}
+
+void TranslationCache::unlinkPages(uint64_t address, const Block &block) {
+  auto basePage = memory.getBase() >> kPageShift;
+  for (auto page : block.pages) {
+    auto found = pageBlocks.find(page);
+    if (found == pageBlocks.end()) {
+      continue;
+    }
+    auto &addresses = found->second;
+    addresses.erase(std::remove(addresses.begin(), addresses.end(), address),
+                    addresses.end());
+    if (addresses.empty()) {
+      pageBlocks.erase(found);
+      codePages[page - basePage] = 0;
+    }
+  }
+}
+
+void TranslationCache::invalidatePage(uint64_t page) {
+  auto found = pageBlocks.find(page);
+  if (found == pageBlocks.end()) {
+    return;
+  }
+  auto addresses = std::move(found->second);
+  pageBlocks.erase(found);
+
+  auto basePage = memory.getBase() >> kPageShift;
+  codePages[page - basePage] = 0;
+  for (auto address : addresses) {
+    auto block = blocks.find(address);
+    if (block == blocks.end()) {
+      continue;
+    }
+
+    // Unlink the block from all the other pages it spans
+    unlinkPages(address, block->second);
+
+    auto slot = slots.find(address);
+    if (slot != slots.end()) {
+      *slot->second = nullptr;
+    }
+    executor.forget(address);
+    invalidated.push_back(std::move(block->second.tracker));
+    blocks.erase(block);
+    numInvalidated++;
+  }
+}
+
+void TranslationCache::releaseInvalidated() {
+  for (auto &tracker : invalidated) {
+    if (auto error = tracker->remove()) {
+      llvm::errs() << "Failed to release invalidated code: "
+                   << llvm::toString(std::move(error)) << "\n";
+    }
+  }
+  invalidated.clear();
+}
+
+uint64_t TranslationCache::run(GuestState &state, uint64_t maxBlocks) {
+  uint64_t numBlocks = 0;
+  while (numBlocks < maxBlocks) {
+    // Nothing runs lifted code here, so invalidated blocks can go, and hot
+    // blocks can be replaced
+    releaseInvalidated();
+    promoteHot();
+
+    auto pc = state.getPc();
+    auto found = blocks.find(pc);
+    auto function =
+        found != blocks.end() ? found->second.function : translate(pc);
+    if (!function) {
+      break;
+    }
+
+    // The first block is not paid for from the budget
+    chainBudget = std::min<uint64_t>(kChainLength, maxBlocks - numBlocks - 1);
+    chainStart = chainBudget;
+    numChained = 0;
+    executor.call(function, state);
+    numBlocks += 1 + numChained + (chainStart - chainBudget);
+  }
+  releaseInvalidated();
+  return numBlocks;
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "guest.hpp"
+#include "jit.hpp"
+#include "lifter.hpp"
+#include "optimizer.hpp"
+
+#include <remill/Arch/Arch.h>
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ExecutionEngine/Orc/Core.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Passes/OptimizationLevel.h>
+
+/// JIT translation cache keyed by guest PC.
+///
+/// Blocks are lifted from guest memory the first time the PC reaches them,
+/// compiled into their own module and kept until the guest overwrites them.
+///
+/// Chaining: the tail of every block compares NEXT_PC with its statically
+/// known successors and tail calls the successor through a host-side slot
+/// (__tcache_slot_<pc>) once it is compiled. Compiling a block patches its
+/// slot, so all the predecessors jump to it directly without going back to
+/// the dispatcher. A budget counter bounds the length of a chain.
+///
+/// Self-modifying code: every page a block was lifted from is marked in a page
+/// bitmap. The lifted code checks the bitmap after every
+/// __remill_write_memory_*, __remill_compare_exchange_memory_* and
+/// __remill_fetch_and_* call and notifies the cache, which unlinks all the
+/// blocks of the page and stops the current chain. Their code is released the
+/// next time control is back in the dispatcher.
+/// Stores into the block or trace that is running are not supported: the
+/// rest of it (up to a whole trace) still runs the code it was compiled from.
+/// For sandboxed memory the address is masked like the masked helpers do
+/// first, so writes through an alias of a page are caught too.
+///
+/// Tiering: with a hot threshold, blocks are first compiled without the remill
+/// optimizer and with a light JIT pipeline (tier 0). Every tier 0 block counts
+/// its executions. Once a block reached the threshold, the dispatcher lifts a
+/// trace starting at it again, following the hottest compiled successors, as
+/// one multi-block function. The trace gets the full pipeline and replaces the
+/// block in the cache (tier 1).
+class TranslationCache {
+public:
+  static std::unique_ptr<TranslationCache>
+  create(const remill::Arch *arch, llvm::Module *semantics,
+         JitExecutor &executor, GuestMemory &memory,
+         IncrementalOptimizer *optimizer);
+
+  /// Run from the PC of state until a block fails to lift or maxBlocks
+  /// blocks (chained ones included) ran. Returns the number of blocks.
+  uint64_t run(GuestState &state, uint64_t maxBlocks);
+
+  /// Executions after which a block is promoted to tier 1, 0 compiles every
+  /// block at tier 1 right away.
+  void setHotThreshold(uint64_t threshold) { hotThreshold = threshold; }
+
+  uint64_t getNumTranslated() const { return numTranslated; }
+  uint64_t getNumInvalidated() const { return numInvalidated; }
+  uint64_t getNumPromoted() const { return numPromoted; }
+
+private:
+  static constexpr unsigned kPageShift = 12;
+  // Blocks a chain can run before it has to go back to the dispatcher
+  static constexpr int64_t kChainLength = 1 << 16;
+  // Maximum number of guest blocks in a tier 1 trace
+  static constexpr size_t kTraceLength = 16;
+
+  struct Block {
+    void *function = nullptr;
+    // Guest pages the code was lifted from
+    llvm::SmallVector<uint64_t, 2> pages;
+    llvm::SmallVector<uint64_t, 2> successors;
+    llvm::orc::ResourceTrackerSP tracker;
+    unsigned tier = 0;
+  };
+
+  TranslationCache(const remill::Arch *arch, llvm::Module *semantics,
+                   JitExecutor &executor, GuestMemory &memory,
+                   IncrementalOptimizer *optimizer)
+      : arch(arch), semantics(semantics), executor(executor), memory(memory),
+        optimizer(optimizer), lifter(arch, semantics) {}
+
+  LiftedBlock liftAt(uint64_t address);
+  void *translate(uint64_t address);
+  void *promote(uint64_t address);
+  void promoteHot();
+  llvm::Function *liftTrace(llvm::ArrayRef<uint64_t> path, bool loops,
+                            Block &trace);
+  void *install(uint64_t address, llvm::Function *function, Block block,
+                llvm::OptimizationLevel level);
+
+  void *slotFor(uint64_t address);
+  int64_t *counterFor(uint64_t address);
+  llvm::Value *programCounterRef(llvm::BasicBlock *block);
+  void emitChaining(llvm::Function *function,
+                    const llvm::SmallVectorImpl<uint64_t> &successors);
+  void emitCounting(llvm::Function *function, uint64_t address);
+  void instrumentWrites(llvm::Module &module);
+  void unlinkPages(uint64_t address, const Block &block);
+  void invalidatePage(uint64_t page);
+  void releaseInvalidated();
+  void stopChain();
+
+  /// Called by lifted code that wrote to a page containing translated code.
+  static void codeWritten(TranslationCache *cache, uint64_t address,
+                          uint64_t size);
+  /// Called by a tier 0 block when it reaches the hot threshold.
+  static void blockHot(TranslationCache *cache, uint64_t address);
+
+  const remill::Arch *arch = nullptr;
+  llvm::Module *semantics = nullptr;
+  JitExecutor &executor;
+  GuestMemory &memory;
+  IncrementalOptimizer *optimizer = nullptr;
+  BlockLifter lifter;
+
+  llvm::DenseMap<uint64_t, Block> blocks;
+  // Chain slots hold the host address of the block of their PC (or null)
+  llvm::DenseMap<uint64_t, std::unique_ptr<void *>> slots;
+  // Execution counters of the tier 0 blocks, counting down to zero
+  llvm::DenseMap<uint64_t, std::unique_ptr<int64_t>> counters;
+  std::vector<uint64_t> hot;
+  uint64_t hotThreshold = 0;
+  // Guest pages with translated code and the blocks lifted from them
+  std::vector<uint8_t> codePages;
+  llvm::DenseMap<uint64_t, llvm::SmallVector<uint64_t, 4>> pageBlocks;
+  std::vector<llvm::orc::ResourceTrackerSP> invalidated;
+  // Decremented by lifted code for every chained block
+  int64_t chainBudget = 0;
+  int64_t chainStart = 0;
+  // Blocks chained before a code write stopped the chain
+  uint64_t numChained = 0;
+
+  uint64_t numTranslated = 0;
+  uint64_t numInvalidated = 0;
+  uint64_t numPromoted = 0;
+};
@@ -0,0 +1,38 @@
+#include "undefined.hpp"
+
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/InstIterator.h>
+#include <llvm/IR/Instructions.h>
+
+static const char kUndefinedPrefix[] = "__remill_undefined_";
+
+llvm::PreservedAnalyses
+UndefinedValuePass::run(llvm::Function &function,
+                        llvm::FunctionAnalysisManager &fam) {
+  llvm::SmallVector<llvm::CallInst *, 16> calls;
+  for (auto &instruction : llvm::instructions(function)) {
+    auto call = llvm::dyn_cast<llvm::CallInst>(&instruction);
+    auto callee = call ? call->getCalledFunction() : nullptr;
+    if (callee && call->arg_size() == 0 && !call->getType()->isVoidTy() &&
+        callee->getName().str().rfind(kUndefinedPrefix, 0) == 0) {
+      calls.push_back(call);
+    }
+  }
+  if (calls.empty()) {
+    return llvm::PreservedAnalyses::all();
+  }
+
+  for (auto call : calls) {
+    // One freeze per call: every undefined value may be different
+    llvm::IRBuilder<> ir(call);
+    auto value =
+        ir.CreateFreeze(llvm::PoisonValue::get(call->getType()), "undefined");
+    call->replaceAllUsesWith(value);
+    call->eraseFromParent();
+  }
+  llvm::PreservedAnalyses preserved;
+  preserved.preserveSet<llvm::CFGAnalyses>();
+  return preserved;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <llvm/IR/Function.h>
+#include <llvm/IR/PassManager.h>
+
+/// Replace the calls to __remill_undefined_* with freeze poison.
+///
+/// The semantics use these intrinsics for flags and results the architecture
+/// leaves undefined. As calls they are opaque values the optimizer has to keep
+/// alive, and the helpers define them as zero, which makes it materialize a
+/// zero for every one of them. freeze poison is a value the optimizer is free
+/// to choose, so computations that only feed undefined results fold away.
+///
+/// Runs on lifted functions after the semantics are inlined. Only for analysis
+/// output, emulation keeps defined (zero) values through the helpers.
+class UndefinedValuePass : public llvm::PassInfoMixin<UndefinedValuePass> {
+public:
+  llvm::PreservedAnalyses run(llvm::Function &function,
+                              llvm::FunctionAnalysisManager &fam);
+};